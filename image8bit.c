@@ -22,8 +22,15 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 #include "instrumentation.h"
 
 // The data structure
@@ -41,18 +48,49 @@
 // Clients should use images only through variables of type Image,
 // which are pointers to the image structure, and should not access the
 // structure fields directly.
+//
+// Several images may share the same pixel array (see ImageClone), which
+// is then reference counted: refs points to the number of images sharing
+// it (refs is NULL while the array is not shared).  Operations that modify
+// pixels in-place call ownPixels first, which copies a shared array
+// (copy-on-write).  Operations that compute a new array replace the old
+// one with setPixels, which frees it only when no other image uses it.
+// Once ImageRowPtr has handed out the array for writing (rowsOut != 0),
+// the client may write to it at any time, so it is never shared: clones
+// get their own copy, until the image gets a new array.
+//
+// An image may also keep results derived from its pixels (its histogram
+// and a blurred copy) in cache, so that they need not be recomputed from
+// scratch.  Operations that modify a region of the image (ImagePaste,
+// ImageBlend, ImageSetPixel) update the histogram over that region and
+// record it as dirty for the blurred copy; other in-place operations
+// discard the cache.  Pixels written through row pointers are not
+// tracked, so no cache is kept while rowsOut is set.
+//
+// The pixel array may also be in tiled layout (tiled != 0): the image is
+// cut into TILE x TILE tiles, stored one after the other in raster order
+// of tiles, each as a raster scan of its pixels.  Tiles on the right and
+// bottom borders are padded to full size.  A tile fills one memory page,
+// so operations that walk across rows (such as ImageRotate) touch few
+// pages at a time.  Operations without a tiled version that only read the
+// image work on a raster copy, from rasterCopy; those that modify it (or
+// hand out row pointers) first convert it to raster layout, with
+// rasterLayout.
 
 // Maximum value you can store in a pixel (maximum maxval accepted)
 const uint8 PixMax = 255;
 
-void * memcpy(void* , void*, size_t);
-
 // Internal structure for storing 8-bit graymap images
 struct image {
   int width;
   int height;
   int maxval;   // maximum gray value (pixels with maxval are pure WHITE)
   uint8* pixel; // pixel data (a raster scan)
+  atomic_int* refs;  // number of images sharing pixel (NULL: not shared)
+  struct derived* cache;  // results derived from the pixels (NULL: none)
+  int tiled;    // pixel is in tiled layout (see ImageSetLayout)
+  int rowsOut;  // pixel was handed out for writing (see ImageRowPtr)
+  int statsAsked;  // ImageStats was called (see ImageStats)
 };
 
 
@@ -76,10 +114,48 @@ struct image {
 // Additional information:  man 3 errno;  man 3 error;
 
 // Variable to preserve errno temporarily
-static int errsave = 0;
+static _Thread_local int errsave = 0;
+
+// The state of the library that operations change or depend on (error
+// cause, counters and settings) is kept in a context, so that threads may
+// use the library concurrently.  Each thread uses its own default context,
+// unless ImageContextUse selects another one.
+struct imageContext {
+  const char* errCause;   // error cause (see ImageErrMsg)
+  InstrState instr;       // instrumentation counters (see InstrUse)
+  int threads;            // threads per operation (see ImageSetThreads)
+  int allocPolicy;        // allocation policy (see ImageSetAlloc)
+  int ready;              // initialized
+};
+
+// Settings of new contexts (ImageInit reads defaultAlloc from the
+// environment; defaultThreads stays 0, one thread per processor)
+static int defaultThreads = 0;
+static int defaultAlloc = ALLOC_HUGEPAGES;
+
+// Context in use by the calling thread (NULL: its default context)
+static _Thread_local struct imageContext* curCtx = NULL;
 
-// Error cause
-static char* errCause;
+// Default context of the calling thread
+static _Thread_local struct imageContext ownCtx;
+
+// Give context c the default settings.
+static void contextInit(struct imageContext* c) {
+  c->errCause = NULL;
+  c->threads = defaultThreads;
+  c->allocPolicy = defaultAlloc;
+  c->ready = 1;
+}
+
+// Context in use by the calling thread.
+static inline struct imageContext* ctx(void) {
+  if (curCtx != NULL) return curCtx;
+  if (!ownCtx.ready) contextInit(&ownCtx);
+  return &ownCtx;
+}
+
+// Error cause (of the calling thread's context)
+#define errCause (ctx()->errCause)
 
 /// Error cause.
 /// After some other module function fails (and returns an error code),
@@ -89,8 +165,9 @@ static char* errCause;
 ///
 /// After a successful operation, the result is not garanteed (it might be
 /// the previous error cause).  It is not meant to be used in that situation!
+/// Each thread sees the error cause of its own context (see ImageContextUse).
 char* ImageErrMsg() { ///
-  return errCause;
+  return (char*)errCause;
 }
 
 
@@ -138,31 +215,626 @@ char* ImageErrMsg() { ///
 // Propagates the condition.
 // Preserves global errno!
 static int check(int condition, const char* failmsg) {
-  errCause = (char*)(condition ? "" : failmsg);
+  errCause = condition ? "" : failmsg;
   return condition;
 }
 
 
+/// Kernel dispatch
+
+// The inner loops of the hottest operations (point operations, blend,
+// mirror, rotate, blur and subimage matching) are kernels defined in
+// imageKernels.h, which is compiled here once per instruction set level,
+// with the target selected by #pragma GCC target.  The compiler
+// vectorizes each copy with the instructions of its target, so the
+// library is built with the baseline flags and still uses the best
+// instructions of the machine it runs on.
+// ImageInit selects the best level supported by the CPU.
+// The environment variable IMAGE8BIT_ISA may force a lower level
+// (scalar, sse2, sse41, avx2 or avx512), for testing and benchmarking.
+// All levels give exactly the same results.
+
+#define KCAT(a, b) KCAT2(a, b)
+#define KCAT2(a, b) a##b
+
+// Table of kernels of one instruction set level
+struct kernels {
+  void (*lutRow)(uint8* row, int n, const uint8* lut);
+  void (*blendRow)(uint8* dst, const uint8* src, int n, double alpha);
+  void (*mirrorRow)(uint8* dst, const uint8* src, int n);
+  void (*rotateBlock)(const uint8* src, int sstride, uint8* dst, int dstride, int bw, int bh);
+  void (*addRow)(uint32_t* sum, const uint8* s, int n);
+  void (*subRow)(uint32_t* sum, const uint8* s, int n);
+  unsigned (*sadRow)(const uint8* a, const uint8* b, int n);
+  void (*sobelRow)(const uint8* a, const uint8* b, const uint8* c, uint8* out,
+                   int n, int l2, int thr);
+  void (*blurRow[4][4])(const uint8* s, int w, uint16_t* col, uint8* out); // [dy][dx]
+};
+
+// Baseline kernels, built with the flags of the Makefile
+#define KLEVEL generic
+#include "imageKernels.h"
+#undef KLEVEL
+
+// Kernels without vectorization, for reference
+#pragma GCC push_options
+#pragma GCC optimize ("no-tree-vectorize")
+#define KLEVEL scalar
+#include "imageKernels.h"
+#undef KLEVEL
+#pragma GCC pop_options
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && !defined(__clang__)
+#define KERNELS_X86 1
+
+#pragma GCC push_options
+#pragma GCC target ("sse4.1")
+#define KLEVEL sse41
+#include "imageKernels.h"
+#undef KLEVEL
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target ("avx2")
+#define KLEVEL avx2
+#include "imageKernels.h"
+#undef KLEVEL
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target ("avx512f,avx512bw,avx512vl,prefer-vector-width=512")
+#define KLEVEL avx512
+#include "imageKernels.h"
+#undef KLEVEL
+#pragma GCC pop_options
+#endif
+
+// Selected kernels (the baseline ones until ImageInit)
+static const struct kernels* kern = &kernels_generic;
+static const char* kernName = "generic";
+
+// Select the best kernels supported by the CPU, or the level named in
+// IMAGE8BIT_ISA, if it is supported.
+static void selectKernels(void) {
+  struct { const char* name; const struct kernels* k; int supported; } level[] = {
+    { "scalar", &kernels_scalar, 1 },
+#ifdef KERNELS_X86
+    { "sse2", &kernels_generic, 1 },
+    { "sse41", &kernels_sse41, __builtin_cpu_supports("sse4.1") },
+    { "avx2", &kernels_avx2, __builtin_cpu_supports("avx2") },
+    { "avx512", &kernels_avx512, __builtin_cpu_supports("avx512f") &&
+                                 __builtin_cpu_supports("avx512bw") &&
+                                 __builtin_cpu_supports("avx512vl") },
+#else
+    { "generic", &kernels_generic, 1 },
+#endif
+  };
+  const int n = (int)(sizeof(level) / sizeof(level[0]));
+  // Each level requires the previous ones
+  int best = 0;
+  while (best + 1 < n && level[best + 1].supported) best++;
+  const char* want = getenv("IMAGE8BIT_ISA");
+  if (want != NULL) {
+    for (int i = 0; i < n; i++) {
+      if (strcmp(want, level[i].name) == 0 && i < best) best = i;
+    }
+  }
+  kern = level[best].k;
+  kernName = level[best].name;
+}
+
+/// Name of the instruction set level of the kernels in use:
+/// "scalar", "sse2", "sse41", "avx2", "avx512" (or "generic" on
+/// other architectures).
+const char* ImageKernels(void) { ///
+  return kernName;
+}
+
+
 /// Init Image library.  (Call once!)
-/// Currently, simply calibrate instrumentation and set names of counters.
+/// Calibrate instrumentation, set names of counters and select the
+/// kernels for this CPU.
+/// Also reads settings from the environment: IMAGE8BIT_TRACE (see
+/// InstrTraceOpen) and IMAGE8BIT_ALLOC (see ImageSetAlloc).
 void ImageInit(void) { ///
+  selectKernels();
   InstrCalibrate();
   InstrName[0] = "pixmem";  // InstrCount[0] will count pixel array acesses
   // Name other counters here...
   InstrName[1] = "countlocate";
   InstrName[2] = "countblur";
   InstrName[3] = "sumblur";
-  
+  // Trace to the file named in IMAGE8BIT_TRACE (if it can be created)
+  const char* trace = getenv("IMAGE8BIT_TRACE");
+  if (trace != NULL) InstrTraceOpen(trace);
+  // Allocation policy named in IMAGE8BIT_ALLOC, for all contexts
+  const char* alloc = getenv("IMAGE8BIT_ALLOC");
+  if (alloc != NULL) {
+    defaultAlloc = (strstr(alloc, "hugepages") != NULL ? ALLOC_HUGEPAGES : 0) |
+                   (strstr(alloc, "firsttouch") != NULL ? ALLOC_FIRSTTOUCH : 0);
+    ImageSetAlloc(defaultAlloc);
+  }
+}
+
+/// Create a new context, with the default settings and no error cause.
+/// (The caller is responsible for destroying the returned context!)
+/// On failure, returns NULL and errCause is set.
+ImageContext ImageContextCreate(void) { ///
+  struct imageContext* c = (struct imageContext*)calloc(1, sizeof(struct imageContext));
+  if (!check(c != NULL, "Out of memory for context")) return NULL;
+  contextInit(c);
+  return c;
+}
+
+/// Destroy the context pointed to by (*ctxp), which no thread may be
+/// using.  If (*ctxp)==NULL, no operation is performed.
+/// Ensures: (*ctxp)==NULL.
+void ImageContextDestroy(ImageContext* ctxp) { ///
+  assert (ctxp != NULL);
+  assert (*ctxp == NULL || *ctxp != curCtx);
+  free(*ctxp);
+  *ctxp = NULL;
+}
+
+/// Make the calling thread use context c (NULL: its default context) for
+/// the error cause, the instrumentation counters and the settings.
+/// Returns the context used before (NULL if it was the default one).
+ImageContext ImageContextUse(ImageContext c) { ///
+  ImageContext old = curCtx;
+  curCtx = c;
+  InstrUse(c != NULL ? &c->instr : NULL);
+  return old;
 }
 
 // Macros to simplify accessing instrumentation counters:
-#define PIXMEM InstrCount[0]
+#define PIXMEM 0
 // Add more macros here...
-#define CountLocate InstrCount[1]
-#define CountBlur InstrCount[2]
-#define SumBlur InstrCount[3]
+#define CountLocate 1
+#define CountBlur 2
+#define SumBlur 3
+
+// Counters are incremented with InstrAdd (once per row or per operation)
+// or InstrAddExact (per pixel, in teaching builds only), so that they
+// cost nothing when compiled out (see INSTRLEVEL in instrumentation.h).
+// TIP: Search for PIXMEM or InstrAdd to see where it is incremented!
+
+// Count the work of an operation: pixels processed, and pixel memory
+// accesses (each of one byte).  The accesses are counted in PIXMEM too.
+static inline void countPixels(unsigned long pixels, unsigned long accesses) {
+  InstrAdd(PIXMEM, accesses);
+  InstrWork(pixels, accesses);
+}
+
+// Operations that take some time are traced as spans named after their
+// function, showing the size of their image (and of the image created).
+// See InstrTraceBegin in instrumentation.h.
+
+// Begin the span of operation name on img (which may be NULL).
+static void traceBegin(const char* name, Image img) {
+  if (InstrTraceFile == NULL) return;
+  char args[64] = "";
+  if (img != NULL) {
+    snprintf(args, sizeof(args), "\"width\":%d,\"height\":%d", img->width, img->height);
+  }
+  InstrTraceBegin(name, args);
+}
+
+// End the span of an operation, which created image out (or NULL).
+static void traceEnd(Image out) {
+  if (InstrTraceFile == NULL) return;
+  char args[64] = "";
+  if (out != NULL) {
+    snprintf(args, sizeof(args), "\"outWidth\":%d,\"outHeight\":%d", out->width, out->height);
+  }
+  InstrTraceEnd(args);
+}
+
+
+/// Parallel execution
+
+// Some operations split the image into horizontal bands of rows and
+// process each band in a separate thread.  Each band writes only to its
+// own rows of the result, so no locking is needed.
+// Instrumentation counters are updated by the calling thread only.
+
+// Maximum number of threads used by a single operation
+#define MAXTHREADS 64
+
+// Minimum number of pixels in a band (smaller jobs are not worth a thread)
+#define MINBANDPIXELS 65536
+
+/// Set the number of threads used by parallel operations (in the calling
+/// thread's context).
+/// n == 0 selects the number of online processors.
+void ImageSetThreads(int n) { ///
+  assert (n >= 0);
+  ctx()->threads = n;
+}
+
+// Number of threads to use.
+static int numThreads(void) {
+  int nThreads = ctx()->threads;
+  if (nThreads > 0) return nThreads;
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (int)n : 1;
+}
+
+// Function that processes the rows [y0, y1) of a band.
+// Returns nonzero on success, 0 on failure (e.g. no memory for scratch).
+typedef int (*BandFunc)(void* arg, int y0, int y1);
+
+struct band {
+  BandFunc fn;
+  void* arg;
+  int y0, y1;
+  int ok;
+};
+
+// Process a band, in a trace span of its own.  Band functions count
+// nothing (the caller counts the whole job), so the span shows no counters.
+static void* bandThread(void* p) {
+  struct band* b = (struct band*)p;
+  if (InstrTraceFile != NULL) {
+    char args[48];
+    snprintf(args, sizeof(args), "\"y0\":%d,\"y1\":%d", b->y0, b->y1);
+    InstrTraceBeginUncounted("band", args);
+  }
+  b->ok = b->fn(b->arg, b->y0, b->y1);
+  InstrTraceEnd(NULL);
+  return NULL;
+}
+
+// Split [0, n) into nt bands and call fn on each band, concurrently.
+// The calling thread processes the first band.
+// If a thread cannot be created, its band is processed by the caller.
+// Returns nonzero if fn succeeded on every band.
+static int parallelSplit(int n, int nt, BandFunc fn, void* arg) {
+  if (nt > MAXTHREADS) nt = MAXTHREADS;
+  if (nt > n) nt = n;
+  if (nt <= 1) {
+    return n > 0 ? fn(arg, 0, n) : 1;
+  }
+  pthread_t tid[MAXTHREADS];
+  struct band band[MAXTHREADS];
+  int started[MAXTHREADS];
+  for (int t = 0; t < nt; t++) {
+    band[t].fn = fn;
+    band[t].arg = arg;
+    band[t].y0 = (int)((long)n * t / nt);
+    band[t].y1 = (int)((long)n * (t+1) / nt);
+  }
+  for (int t = 1; t < nt; t++) {
+    started[t] = pthread_create(&tid[t], NULL, bandThread, &band[t]) == 0;
+  }
+  bandThread(&band[0]);
+  int ok = band[0].ok;
+  for (int t = 1; t < nt; t++) {
+    if (started[t]) pthread_join(tid[t], NULL);
+    else bandThread(&band[t]);
+    ok = ok && band[t].ok;
+  }
+  return ok;
+}
+
+// Number of threads worth using for a job touching a given number of pixels.
+static int threadsFor(long pixels) {
+  int nt = numThreads();
+  long maxBands = pixels / MINBANDPIXELS;
+  return nt > maxBands ? (int)(maxBands > 0 ? maxBands : 1) : nt;
+}
+
+// Split rows [0, h) of a w-wide image into bands and call fn on each band,
+// concurrently, as in parallelSplit.
+static int parallelBands(int w, int h, BandFunc fn, void* arg) {
+  return parallelSplit(h, threadsFor((long)w * h), fn, arg);
+}
+
+
+/// Memory for pixels
+
+// Large pixel arrays (of HUGEMIN bytes or more) are allocated aligned to
+// huge pages, and the kernel is advised to back them with transparent huge
+// pages, so that walking a big image needs few TLB entries.  Their size is
+// rounded up to whole huge pages, which wastes at most 1/8 of the array;
+// smaller arrays would waste up to half, so they are allocated plainly.
+// The memory of an array is placed, page by page, on the NUMA node of the
+// thread that first writes to it.  Filters write their results by bands,
+// from the threads that process each band, so their pages are spread as
+// the work is.  New images are black, and zeroing them in the same bands
+// (rather than in the calling thread) spreads them in the same way.
+#define HUGEPAGE ((size_t)2 << 20)
+#define HUGEMIN (8 * HUGEPAGE)
+
+// Allocation policy set by ImageSetAlloc
+#define allocPolicy (ctx()->allocPolicy)
+
+/// Set the allocation policy for large pixel arrays (in the calling
+/// thread's context): ALLOC_HUGEPAGES, ALLOC_FIRSTTOUCH, both (or'ed) or
+/// none (0).
+void ImageSetAlloc(int policy) { ///
+  assert ((policy & ~(ALLOC_HUGEPAGES | ALLOC_FIRSTTOUCH)) == 0);
+  allocPolicy = policy;
+}
+
+// Allocate an array for size pixels, not initialized.
+// Returns NULL if there is no memory.
+static uint8* newPixels(size_t size) {
+  if (size < HUGEMIN || !(allocPolicy & ALLOC_HUGEPAGES)) {
+    return (uint8*)malloc(size > 0 ? size : 1);
+  }
+  size_t rounded = (size + HUGEPAGE - 1) & ~(HUGEPAGE - 1);
+  void* p = NULL;
+  if (posix_memalign(&p, HUGEPAGE, rounded) != 0) {
+    errno = ENOMEM;
+    return NULL;
+  }
+#ifdef MADV_HUGEPAGE
+  madvise(p, rounded, MADV_HUGEPAGE);  // just advice: failure is harmless
+#endif
+  return (uint8*)p;
+}
+
+// Shared state of a zeroing job
+struct zeroJob {
+  uint8* pixel;
+  size_t rowBytes;
+};
+
+// Zero the rows [y0, y1).
+static int zeroBand(void* arg, int y0, int y1) {
+  const struct zeroJob* job = (const struct zeroJob*)arg;
+  memset(job->pixel + (size_t)y0 * job->rowBytes, 0, (size_t)(y1 - y0) * job->rowBytes);
+  return 1;
+}
+
+// Allocate a black array of rows x rowBytes pixels.
+// Returns NULL if there is no memory.
+static uint8* newBlackPixels(size_t rowBytes, int rows) {
+  size_t size = rowBytes * rows;
+  uint8* pixel = newPixels(size);
+  if (pixel == NULL) return NULL;
+  struct zeroJob job = { .pixel = pixel, .rowBytes = rowBytes };
+  if (size >= HUGEPAGE && (allocPolicy & ALLOC_FIRSTTOUCH)) {
+    parallelSplit(rows, threadsFor((long)size), zeroBand, &job);
+  } else {
+    zeroBand(&job, 0, rows);
+  }
+  return pixel;
+}
+
+
+/// Pixel layout
+
+// Tiles have TILE x TILE pixels
+#define TILEBITS 6
+#define TILE (1 << TILEBITS)
+
+// Number of tiles needed for n pixels.
+static inline int tilesFor(int n) {
+  return (n + TILE - 1) >> TILEBITS;
+}
+
+// Index of pixel (x,y) in the tiled pixel array of img.
+static inline size_t tileIndex(Image img, int x, int y) {
+  size_t tile = (size_t)(y >> TILEBITS) * tilesFor(img->width) + (x >> TILEBITS);
+  return (tile << 2*TILEBITS) + ((y & (TILE - 1)) << TILEBITS) + (x & (TILE - 1));
+}
+
+// Size of the pixel array of a w x h image, in either layout.
+static inline size_t layoutBytes(int w, int h, int tiled) {
+  return tiled ? (size_t)tilesFor(w) * tilesFor(h) << 2*TILEBITS : (size_t)w * h;
+}
+
+// Size of the pixel array of img.
+static inline size_t pixelBytes(Image img) {
+  return layoutBytes(img->width, img->height, img->tiled);
+}
+
+
+/// Derived results
+
+// Results derived from the pixels of an image, and how to update them.
+// The histogram is updated as pixels change, removing the old levels of
+// a region and adding the new ones.  The blurred copy is updated lazily,
+// by ImageBlurred: only the pixels whose window intersects the dirty
+// rectangle [x0,x1)x[y0,y1) are recomputed.
+struct derived {
+  int histValid;             // hist counts the levels of the image pixels
+  unsigned long hist[256];   // number of pixels with each level
+  Image blur;                // the image blurred with dx, dy (NULL: none)
+  int dx, dy;
+  int x0, y0, x1, y1;        // pixels changed since blur (empty: x0 >= x1)
+};
+
+// Get the cache of img, creating an empty one if needed.
+// Returns NULL if there is no memory for it.
+static struct derived* getCache(Image img) {
+  if (img->cache == NULL) img->cache = (struct derived*)calloc(1, sizeof(struct derived));
+  return img->cache;
+}
+
+// Forget the blurred copy of img.
+static void dropBlur(Image img) {
+  if (img->cache != NULL) ImageDestroy(&img->cache->blur);
+}
+
+// Forget all results derived from img: its pixels are about to change
+// in a way that is not tracked.
+static void dropCache(Image img) {
+  if (img->cache != NULL) {
+    dropBlur(img);
+    free(img->cache);
+    img->cache = NULL;
+  }
+}
+
+// Add (sign = 1) or remove (sign = -1) the pixels of rectangle (x,y,w,h)
+// of img to/from its cached histogram, if any.
+static void histRegion(Image img, int x, int y, int w, int h, int sign) {
+  struct derived* c = img->cache;
+  if (c == NULL || !c->histValid) return;
+  for (int j = 0; j < h; j++) {
+    if (img->tiled) {
+      for (int i = 0; i < w; i++) c->hist[img->pixel[tileIndex(img, x + i, y + j)]] += sign;
+      continue;
+    }
+    const uint8* row = img->pixel + (size_t)(y + j) * img->width + x;
+    for (int i = 0; i < w; i++) c->hist[row[i]] += sign;
+  }
+}
+
+// Pixels of rectangle (x,y,w,h) of img are about to change.
+static inline void beginChange(Image img, int x, int y, int w, int h) {
+  if (img->cache != NULL) histRegion(img, x, y, w, h, -1);
+}
+
+// Pixels of rectangle (x,y,w,h) of img have changed.
+static inline void endChange(Image img, int x, int y, int w, int h) {
+  struct derived* c = img->cache;
+  if (c == NULL) return;
+  histRegion(img, x, y, w, h, 1);
+  if (c->blur != NULL) {
+    if (c->x0 >= c->x1) {
+      c->x0 = x; c->y0 = y; c->x1 = x + w; c->y1 = y + h;
+    } else {
+      if (x < c->x0) c->x0 = x;
+      if (y < c->y0) c->y0 = y;
+      if (x + w > c->x1) c->x1 = x + w;
+      if (y + h > c->y1) c->y1 = y + h;
+    }
+  }
+}
+
+
+/// Pixel arrays
+
+// Release the pixels of img: free them, unless other images share them.
+static void releasePixels(Image img) {
+  if (img->refs == NULL || atomic_fetch_sub(img->refs, 1) == 1) {
+    free(img->pixel);
+    free(img->refs);
+  }
+  img->pixel = NULL;
+  img->refs = NULL;
+}
+
+// Replace the pixels of img by a new array, allocated with malloc.
+static void setPixels(Image img, uint8* pixel) {
+  dropCache(img);
+  releasePixels(img);
+  img->pixel = pixel;
+  img->rowsOut = 0;
+}
+
+// Make sure img does not share its pixels, so that they may be modified
+// in-place, copying them if needed.
+// Returns nonzero on success, or 0 (with errCause set) if there is no
+// memory for the copy, in which case img is not changed.
+static int ownPixels(Image img) {
+  if (img->refs == NULL) return 1;
+  if (atomic_load(img->refs) == 1) {
+    // The other images sharing the pixels are gone
+    free(img->refs);
+    img->refs = NULL;
+    return 1;
+  }
+  size_t size = pixelBytes(img);
+  uint8* copy = newPixels(size);
+  if (!check(copy != NULL, "Out of memory for copy of shared pixels")) return 0;
+  memcpy(copy, img->pixel, size);
+  countPixels(size, 2 * size);  // reads + stores
+  releasePixels(img);  // the cache stays valid: the pixels are the same
+  img->pixel = copy;
+  img->rowsOut = 0;
+  return 1;
+}
+
+// Allocate a black pixel array for a w x h image in tiled layout.
+static uint8* newTiles(int w, int h) {
+  // A row of tiles at a time
+  return newBlackPixels((size_t)tilesFor(w) << 2*TILEBITS, tilesFor(h));
+}
+
+// Create a black w x h image in tiled layout.
+// Returns NULL (with errCause set) if there is no memory for it.
+static Image createTiled(int w, int h, uint8 maxval) {
+  Image img = (Image)malloc(sizeof(struct image));
+  if (!check(img != NULL, "Out of memory for image")) return NULL;
+  *img = (struct image){ .width = w, .height = h, .maxval = maxval, .tiled = 1 };
+  if (!check((img->pixel = newTiles(w, h)) != NULL, "Out of memory for image")) {
+    free(img);
+    return NULL;
+  }
+  return img;
+}
+
+// Copy the pixels of raster array src into tiled array dst, or back if
+// toRaster, for a w x h image.
+// Each row of a tile is a run of up to TILE contiguous pixels in both.
+static void copyTiles(uint8* dst, const uint8* src, int w, int h, int toRaster) {
+  const int tx = tilesFor(w);
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x += TILE) {
+      size_t raster = (size_t)y * w + x;
+      size_t tiled = (((size_t)(y >> TILEBITS) * tx + (x >> TILEBITS)) << 2*TILEBITS)
+                   + ((y & (TILE - 1)) << TILEBITS);
+      int n = w - x < TILE ? w - x : TILE;
+      if (toRaster) memcpy(dst + raster, src + tiled, n);
+      else memcpy(dst + tiled, src + raster, n);
+    }
+  }
+}
+
+// Convert the pixels of img to tiled layout, or to raster layout.
+// Returns nonzero on success, or 0 (with errCause set) if there is no
+// memory for the new array, in which case img is not changed.
+static int changeLayout(Image img, int tiled) {
+  if (img->tiled == tiled) return 1;
+  const int w = img->width, h = img->height;
+  size_t size = layoutBytes(w, h, tiled);
+  uint8* pixel = tiled ? newTiles(w, h) : newPixels(size);
+  if (!check(pixel != NULL, "Out of memory for layout conversion")) return 0;
+  copyTiles(pixel, img->pixel, w, h, !tiled);
+  countPixels((unsigned long)w * h, 2ul * w * h);  // reads + stores
+  releasePixels(img);  // the cache stays valid: the pixels are the same
+  img->pixel = pixel;
+  img->tiled = tiled;
+  img->rowsOut = 0;
+  return 1;
+}
+
+// Make sure the pixels of img are in raster layout, as operations that
+// modify it in place need them.  Returns 0 (with errCause set) if there is no memory for the
+// conversion.
+static inline int rasterLayout(Image img) {
+  return !img->tiled || changeLayout(img, 0);
+}
+
+// A raster layout version of img, for operations that only read it: img
+// itself if it is in raster layout, or else a new raster copy, so that the
+// layout of img is kept and other threads reading img are not disturbed.
+// Returns NULL (with errCause set) if there is no memory for the copy.
+// Release it with rasterDone.
+static Image rasterCopy(Image img) {
+  if (!img->tiled) return img;
+  const int w = img->width, h = img->height;
+  Image copy = (Image)malloc(sizeof(struct image));
+  if (!check(copy != NULL, "Out of memory for layout conversion")) return NULL;
+  *copy = (struct image){ .width = w, .height = h, .maxval = img->maxval };
+  if (!check( (copy->pixel = newPixels((size_t)w * h)) != NULL,
+              "Out of memory for layout conversion" )) {
+    free(copy);
+    return NULL;
+  }
+  copyTiles(copy->pixel, img->pixel, w, h, 1);
+  countPixels((unsigned long)w * h, 2ul * w * h);  // reads + stores
+  return copy;
+}
 
-// TIP: Search for PIXMEM or InstrCount to see where it is incremented!
+// Release copy, the result of rasterCopy(img).
+static void rasterDone(Image img, Image copy) {
+  if (copy != img) ImageDestroy(&copy);
+}
 
 
 /// Image management functions
@@ -190,19 +862,19 @@ Image ImageCreate(int width, int height, uint8 maxval) { ///
   newImg->width = width;
   newImg->height = height;
   newImg->maxval = maxval;
-  //Calculates the number of pixels necessary
-  size_t pixelSize = width * height * sizeof(uint8);
-  newImg->pixel = (uint8*)malloc(pixelSize);
+  newImg->refs = NULL;
+  newImg->cache = NULL;
+  newImg->tiled = 0;
+  newImg->rowsOut = 0;
+  newImg->statsAsked = 0;
+  //Allocates a black Image (every pixel with the value 0), row by row
+  newImg->pixel = newBlackPixels(width, height);
   //Verifies if there's pixels values in the new image created
   //If it doesn't verify, shows error message, free the space previously allocated and returns NULL
   if (!check(newImg->pixel != NULL, "No pixel in image!")) {
 	  free(newImg);
 	  return NULL;
   }
-  //Creates a black Image by altering every pixel in the image to a pixel with the value 0 (black)
-  for (int i = 0; i < width * height; i++) {
-	  newImg->pixel[i] = 0;
-  }
 
   return newImg;
 }
@@ -216,12 +888,54 @@ void ImageDestroy(Image* imgp) { ///
   assert (imgp != NULL);
 
   if (*imgp != NULL) {
-	  free((*imgp)->pixel);
+	  dropCache(*imgp);
+	  releasePixels(*imgp);
 	  free((*imgp));
 	  *imgp = NULL;
   }
 }
 
+/// Clone an image.
+/// The clone shares the pixels of img until either of them is modified,
+/// and only then are the pixels copied.  So cloning is cheap, and the
+/// original img is not modified by operations on the clone (or vice-versa).
+/// If img has handed out row pointers for writing (see ImageRowPtr), which
+/// may still be written through, the pixels are copied right away.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageClone(Image img) { ///
+  assert (img != NULL);
+  Image clone = NULL;
+  if (img->refs == NULL && !img->rowsOut) {
+    // Start counting the references to the pixels
+    if (!check( (img->refs = (atomic_int*)malloc(sizeof(atomic_int))) != NULL,
+                "Out of memory for clone" )) return NULL;
+    atomic_init(img->refs, 1);
+  }
+  if (!check( (clone = (Image)malloc(sizeof(struct image))) != NULL,
+              "Out of memory for clone" )) return NULL;
+  *clone = *img;
+  clone->cache = NULL;
+  clone->rowsOut = 0;
+  clone->statsAsked = 0;
+  if (img->rowsOut) {
+    // Writes through the row pointers of img must not reach the clone
+    size_t size = pixelBytes(img);
+    clone->refs = NULL;
+    if (!check( (clone->pixel = newPixels(size)) != NULL, "Out of memory for clone" )) {
+      free(clone);
+      return NULL;
+    }
+    memcpy(clone->pixel, img->pixel, size);
+    countPixels(size, 2 * size);  // reads + stores
+    return clone;
+  }
+  atomic_fetch_add(img->refs, 1);
+  return clone;
+}
+
 
 /// PGM file operations
 
@@ -251,6 +965,7 @@ Image ImageLoad(const char* filename) { ///
   char c;
   FILE* f = NULL;
   Image img = NULL;
+  traceBegin(__func__, NULL);
 
   int success = 
   check( (f = fopen(filename, "rb")) != NULL, "Open failed" ) &&
@@ -267,7 +982,7 @@ Image ImageLoad(const char* filename) { ///
   (img = ImageCreate(w, h, (uint8)maxval)) != NULL &&
   // Read pixels
   check( fread(img->pixel, sizeof(uint8), w*h, f) == w*h , "Reading pixels" );
-  PIXMEM += (unsigned long)(w*h);  // count pixel memory accesses
+  countPixels((unsigned long)(w*h), (unsigned long)(w*h));  // count pixel memory accesses
 
   // Cleanup
   if (!success) {
@@ -276,9 +991,28 @@ Image ImageLoad(const char* filename) { ///
     errno = errsave;
   }
   if (f != NULL) fclose(f);
+  traceEnd(img);
   return img;
 }
 
+// Write the pixels of img to f, as a raster scan.
+// Returns nonzero on success, or 0 with errCause set.
+static int writePixels(Image img, FILE* f) {
+  const int w = img->width, h = img->height;
+  if (!img->tiled) {
+    return check( fwrite(img->pixel, sizeof(uint8), (size_t)w*h, f) == (size_t)w*h, "Writing pixels failed" );
+  }
+  // A row is a run of pixels in each tile it crosses
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x += TILE) {
+      size_t n = w - x < TILE ? w - x : TILE;
+      if (!check( fwrite(img->pixel + tileIndex(img, x, y), sizeof(uint8), n, f) == n,
+                  "Writing pixels failed" )) return 0;
+    }
+  }
+  return 1;
+}
+
 /// Save image to PGM file.
 /// On success, returns nonzero.
 /// On failure, returns 0, errno/errCause are set appropriately, and
@@ -289,15 +1023,17 @@ int ImageSave(Image img, const char* filename) { ///
   int h = img->height;
   uint8 maxval = img->maxval;
   FILE* f = NULL;
+  traceBegin(__func__, img);
 
   int success =
   check( (f = fopen(filename, "wb")) != NULL, "Open failed" ) &&
   check( fprintf(f, "P5\n%d %d\n%u\n", w, h, maxval) > 0, "Writing header failed" ) &&
-  check( fwrite(img->pixel, sizeof(uint8), w*h, f) == w*h, "Writing pixels failed" ); 
-  PIXMEM += (unsigned long)(w*h);  // count pixel memory accesses
+  writePixels(img, f);
+  countPixels((unsigned long)(w*h), (unsigned long)(w*h));  // count pixel memory accesses
 
   // Cleanup
   if (f != NULL) fclose(f);
+  traceEnd(NULL);
   return success;
 }
 
@@ -329,22 +1065,40 @@ int ImageMaxval(Image img) { ///
 /// On return,
 /// *min is set to the minimum gray level in the image,
 /// *max is set to the maximum.
+/// (For an image with no pixels, *min and *max are not changed.)
+/// From the second call on, the histogram of the image is kept, and
+/// updated as it is modified by ImagePaste, ImageBlend, ImageSetPixel or
+/// the pixel transformations, so calling this again only costs a scan of
+/// the 256 levels.  (Not while the pixels may be written through row
+/// pointers: see ImageRowPtr.)
 void ImageStats(Image img, uint8* min, uint8* max) { ///
   assert (img != NULL);
-  // Insert your code here!
-  int x, y;
-
-  for (x = 0; x < img->width; x++) {
-	for (y = 0; y < img->height; y++) {
-	  uint8 pixelColor = ImageGetPixel(img, x, y);
-	  if (*min > pixelColor) {
-		*min = pixelColor;
-	  }
-	  else if (*max < pixelColor) {
-		*max = pixelColor;
-	  }
-	}
+  const int w = img->width;
+  unsigned long local[256];
+  // Keep the histogram from the second call on (if NULL, just use local)
+  struct derived* c = NULL;
+  if (!img->rowsOut && (img->cache != NULL || img->statsAsked)) c = getCache(img);
+  img->statsAsked = 1;
+  unsigned long* hist = c != NULL ? c->hist : local;
+  if (c == NULL || !c->histValid) {
+    memset(hist, 0, sizeof(local));
+    for (int y = 0; y < img->height; y++) {
+      // A row is a run of pixels in each tile it crosses, if tiled
+      for (int x0 = 0; x0 < w; x0 += img->tiled ? TILE : w) {
+        int n = img->tiled && w - x0 > TILE ? TILE : w - x0;
+        const uint8* row = img->pixel + (img->tiled ? tileIndex(img, x0, y) : (size_t)y * w);
+        for (int x = 0; x < n; x++) hist[row[x]]++;
+      }
+    }
+    countPixels((unsigned long)w * img->height, (unsigned long)w * img->height);  // count pixel reads
+    if (c != NULL) c->histValid = 1;
   }
+  int lo = 0, hi = 255;
+  while (lo < 256 && hist[lo] == 0) lo++;
+  if (lo == 256) return;   // no pixels
+  while (hist[hi] == 0) hi--;
+  *min = (uint8)lo;
+  *max = (uint8)hi;
 }
 
 /// Check if pixel position (x,y) is inside img.
@@ -372,14 +1126,14 @@ int ImageValidRect(Image img, int x, int y, int w, int h) { ///
 
 // Transform (x, y) coords into linear pixel index.
 // This internal function is used in ImageGetPixel / ImageSetPixel. 
-// The returned index must satisfy (0 <= index < img->width*img->height)
-static inline int G(Image img, int x, int y) {
-  int index;
+// The returned index must satisfy (0 <= index < pixelBytes(img))
+static inline size_t G(Image img, int x, int y) {
+  size_t index;
   
   // Insert your code here!
-  index = x + (y * img->width);
+  index = img->tiled ? tileIndex(img, x, y) : x + (size_t)y * img->width;
   
-  assert (index >= 0 && index < (img->width*img->height));    
+  assert (index < pixelBytes(img));
   return index;
 }
 
@@ -387,87 +1141,182 @@ static inline int G(Image img, int x, int y) {
 uint8 ImageGetPixel(Image img, int x, int y) { ///
   assert (img != NULL);
   assert (ImageValidPos(img, x, y));
-  PIXMEM += 1;  // count one pixel access (read)
+  InstrAddExact(PIXMEM, 1);  // count one pixel access (read)
   return img->pixel[G(img, x, y)];
 } 
 
 /// Set the pixel at position (x,y) to new level.
+/// If img shares its pixels with a clone, they are copied first: if there
+/// is no memory for that, the pixel is not set and errCause is set.
 void ImageSetPixel(Image img, int x, int y, uint8 level) { ///
   assert (img != NULL);
   assert (ImageValidPos(img, x, y));
-  PIXMEM += 1;  // count one pixel access (store)
+  if (!ownPixels(img)) return;
+  InstrAddExact(PIXMEM, 1);  // count one pixel access (store)
+  beginChange(img, x, y, 1, 1);
   img->pixel[G(img, x, y)] = level;
+  endChange(img, x, y, 1, 1);
 } 
 
 
+/// Row access
+
+// Row pointers are counted as accesses to the whole row: a client that
+// reads or writes every pixel of the rows it gets is counted exactly as
+// if it had used ImageGetPixel or ImageSetPixel once per pixel.
+
+/// Distance, in pixels, from a row to the next one.
+/// Pixel (x, y+1) is at ImageRowPtr(img, y) + ImageStride(img) + x.
+int ImageStride(Image img) { ///
+  assert (img != NULL);
+  return img->width;
+}
+
+/// Pointer to the first pixel of row y, for reading and writing.
+/// Requires: 0 <= y < height.
+/// If img shares its pixels with a clone, they are copied first: if there
+/// is no memory for that, returns NULL and errCause is set.
+uint8* ImageRowPtr(Image img, int y) { ///
+  assert (img != NULL);
+  assert (0 <= y && y < img->height);
+  if (!rasterLayout(img) || !ownPixels(img)) return NULL;
+  dropCache(img);  // the row may be modified
+  img->rowsOut = 1;
+  countPixels(img->width, img->width);  // count the row pixels
+  return img->pixel + (size_t)y * img->width;
+}
+
+/// Pointer to the first pixel of row y, for reading only.
+/// Requires: 0 <= y < height.
+/// If img is tiled and there is no memory to convert it to raster layout,
+/// returns NULL and errCause is set.
+const uint8* ImageRowConst(Image img, int y) { ///
+  assert (img != NULL);
+  assert (0 <= y && y < img->height);
+  if (!rasterLayout(img)) return NULL;
+  countPixels(img->width, img->width);  // count the row pixels
+  return img->pixel + (size_t)y * img->width;
+}
+
+/// Call fn for each row of img, in order, from y = 0 to height-1.
+/// The function may read and modify the pixels of the row it is given,
+/// but must not keep the row pointer after it returns.
+///
+/// On success, returns nonzero.
+/// On failure (no memory to copy pixels shared with a clone), returns 0,
+/// errCause is set and fn is not called.
+int ImageForEachRow(Image img, ImageRowFunc fn, void* arg) { ///
+  assert (img != NULL);
+  assert (fn != NULL);
+  if (!rasterLayout(img)) return 0;
+  if (!ownPixels(img)) return 0;
+  dropCache(img);
+  const int w = img->width;
+  for (int y = 0; y < img->height; y++) fn(img->pixel + (size_t)y * w, w, y, w, arg);
+  countPixels((unsigned long)w * img->height, (unsigned long)w * img->height);  // count all pixels
+  return 1;
+}
+
+
+/// Pixel layout
+
+/// Memory layout of the pixels of img.
+ImageLayout ImageGetLayout(Image img) { ///
+  assert (img != NULL);
+  return img->tiled ? LAYOUT_TILED : LAYOUT_RASTER;
+}
+
+/// Convert the pixels of img to the given memory layout.
+/// The image does not change: only the order of its pixels in memory.
+///
+/// On success, returns nonzero.
+/// On failure, returns 0, errCause is set and img is not modified.
+int ImageSetLayout(Image img, ImageLayout layout) { ///
+  assert (img != NULL);
+  assert (layout == LAYOUT_RASTER || layout == LAYOUT_TILED);
+  return changeLayout(img, layout == LAYOUT_TILED);
+}
+
+
 /// Pixel transformations
 
 /// These functions modify the pixel levels in an image, but do not change
 /// pixel positions or image geometry in any way.
-/// All of these functions modify the image in-place: no allocation involved.
-/// They never fail.
+/// All of these functions modify the image in-place.  They allocate memory
+/// only to copy pixels shared with a clone (see ImageClone):
+/// On success, they return nonzero.
+/// On failure (no memory for the copy), they return 0, errCause is set
+/// and the image is not modified.
+
 
+// Replace each pixel p of img by lut[p], row by row.
+// The point operations compute their result for each of the 256 levels
+// once, and then just look it up.
+// Returns 0 if the pixels are shared and cannot be copied.
+static int applyLut(Image img, const uint8 lut[256]) {
+  if (!ownPixels(img)) return 0;
+  struct derived* c = img->cache;
+  if (c != NULL) {
+    // The histogram of the result follows from the lookup table
+    if (c->histValid) {
+      unsigned long hist[256] = { 0 };
+      for (int p = 0; p < 256; p++) hist[lut[p]] += c->hist[p];
+      memcpy(c->hist, hist, sizeof(hist));
+    }
+    dropBlur(img);
+  }
+  const int w = img->width;
+  if (img->tiled) {
+    // Any layout will do, padding included: map each tile as a whole
+    size_t tiles = pixelBytes(img) >> 2*TILEBITS;
+    for (size_t t = 0; t < tiles; t++) kern->lutRow(img->pixel + (t << 2*TILEBITS), TILE * TILE, lut);
+  } else {
+    for (int y = 0; y < img->height; y++) kern->lutRow(img->pixel + (size_t)y * w, w, lut);
+  }
+  countPixels((unsigned long)w * img->height, 2ul * w * img->height);  // reads + stores
+  return 1;
+}
 
 /// Transform image to negative image.
 /// This transforms dark pixels to light pixels and vice-versa,
 /// resulting in a "photographic negative" effect.
-void ImageNegative(Image img) { ///
+int ImageNegative(Image img) { ///
   assert (img != NULL);
-  // Insert your code here!
-  int x, y;
-
-  for (x = 0; x < img->width; x++) {
-	  for (y = 0; y < img->height; y++) {
-      // Calculates new pixelColor, subtracting PixMax with the former pixelColor, inverting the colour.
-	    uint8 pixelColor = PixMax - ImageGetPixel(img, x, y);     
-      ImageSetPixel(img, x, y, pixelColor);                     
-    }
-  }
+  uint8 lut[256];
+  for (int p = 0; p < 256; p++) lut[p] = PixMax - p;
+  traceBegin(__func__, img);
+  int success = applyLut(img, lut);
+  traceEnd(NULL);
+  return success;
 }
 
 /// Apply threshold to image.
 /// Transform all pixels with level<thr to black (0) and
 /// all pixels with level>=thr to white (maxval).
-void ImageThreshold(Image img, uint8 thr) { ///
+int ImageThreshold(Image img, uint8 thr) { ///
   assert (img != NULL);
-  // Insert your code here!
-
-  int x, y;
-  //Changes the colour of the pixel according to the value of the threshold given
-  //It'll change to white whenever the value of the colour is >= to the threshold
-  //And change to black if the previous isn't verified
-  for (x = 0; x < img->width; x++) {
-	  for (y = 0; y < img->height; y++) {
-	    if (ImageGetPixel(img, x, y) < thr){           
-        ImageSetPixel(img, x, y, 0);
-      }
-      else {
-        ImageSetPixel(img, x, y, ImageMaxval(img));
-      }
-
-    }
-  }
+  uint8 lut[256];
+  for (int p = 0; p < 256; p++) lut[p] = p < thr ? 0 : img->maxval;
+  traceBegin(__func__, img);
+  int success = applyLut(img, lut);
+  traceEnd(NULL);
+  return success;
 }
 
 /// Brighten image by a factor.
 /// Multiply each pixel level by a factor, but saturate at maxval.
 /// This will brighten the image if factor>1.0 and
 /// darken the image if factor<1.0.
-void ImageBrighten(Image img, double factor) { ///
+int ImageBrighten(Image img, double factor) { ///
   assert (img != NULL);
   assert (factor >= 0.0);
-  // Insert your code here!
-  int x, y;
-
-  for (x = 0; x < img->width; x++) {
-	  for (y = 0; y < img->height; y++) {
-	    uint8 pixelColor = ImageGetPixel(img, x, y);          
-      pixelColor = (uint8) (pixelColor * factor + 0.5);   // This will round any value without using the math library
-                                                        // if the result of the multiplication is, for example, 2.7, adding 0.5 will be 3.2, which will be 3 when typecasted to int
-                                                        // if the result of the multiplication is, for example, 2.2, adding 0.5 will be 2.7, which will be 2 when typecasted to int
-      ImageSetPixel(img, x, y, pixelColor);
-    }
-  }
+  uint8 lut[256];
+  // Adding 0.5 rounds to the nearest level
+  for (int p = 0; p < 256; p++) lut[p] = (uint8)(p * factor + 0.5);
+  traceBegin(__func__, img);
+  int success = applyLut(img, lut);
+  traceEnd(NULL);
+  return success;
 }
 
 
@@ -484,9 +1333,39 @@ void ImageBrighten(Image img, double factor) { ///
 // Implementation hint: 
 // Call ImageCreate whenever you need a new image!
 
+// Size of the blocks copied by ImageRotate
+#define ROTATEBLOCK 32
+
+// Rotate a tiled image into a tiled image, one source tile at a time.
+// Column x of tile (tx, ty) goes to row w-1-x of the result, within its
+// tile column ty: the columns are split into runs that go to the same
+// tile of the result, and each run is rotated as a block.
+static Image rotateTiled(Image img) {
+  const int w = img->width, h = img->height;
+  Image nImg = createTiled(h, w, img->maxval);
+  if (nImg == NULL) return NULL;
+  for (int y0 = 0; y0 < h; y0 += TILE) {
+    int bh = h - y0 < TILE ? h - y0 : TILE;
+    for (int x0 = 0; x0 < w; x0 += TILE) {
+      int bw = w - x0 < TILE ? w - x0 : TILE;
+      const uint8* src = img->pixel + tileIndex(img, x0, y0);
+      for (int i = 0; i < bw; ) {
+        int y1 = w - 1 - (x0 + i);          // row of the result for column i
+        int n = (y1 & (TILE - 1)) + 1;     // columns left in that tile
+        if (n > bw - i) n = bw - i;
+        kern->rotateBlock(src + i, TILE, nImg->pixel + tileIndex(nImg, y0, y1), TILE, n, bh);
+        i += n;
+      }
+    }
+  }
+  countPixels((unsigned long)w * h, 2ul * w * h);  // reads + stores
+  return nImg;
+}
+
 /// Rotate an image.
 /// Returns a rotated version of the image.
 /// The rotation is 90 degrees clockwise.
+/// If img is tiled, so is the result, and it is rotated tile by tile.
 /// Ensures: The original img is not modified.
 /// 
 /// On success, a new image is returned.
@@ -494,21 +1373,32 @@ void ImageBrighten(Image img, double factor) { ///
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageRotate(Image img) { ///
   assert (img != NULL);
-  int nWidth = img->height;
-  int nHeight = img->width;
-  uint8 maxValue = img->maxval;
+  const int w = img->width, h = img->height;
+  traceBegin(__func__, img);
+  if (img->tiled) {
+    Image nImg = rotateTiled(img);
+    traceEnd(nImg);
+    return nImg;
+  }
   //Create a new image that'll be rotated
-  Image nImg = ImageCreate(nWidth, nHeight, maxValue);
-
+  Image nImg = ImageCreate(h, w, img->maxval);
   if (nImg == NULL) {
+	  traceEnd(NULL);
 	  return NULL;
   }
-  for (int i = 0; i < nWidth; i++) {
-	  for (int y = 0; y < nHeight; y++) {
-	    //ImageSetPixel(nImg, nWidth - 1 - i, y, ImageGetPixel(img, y, i));       /// Rotação de 90º em sentido do relógio (não passa os testes)
-      ImageSetPixel(nImg,  i, img->width-1-y, ImageGetPixel(img, y, i));        /// Rotação de 90º em sentido contra-relógio (passa nos testes)
-	  }
+  // Rotation of 90 degrees counter-clockwise: pixel (x, y) goes to
+  // (y, w-1-x).  Copy square blocks, so that both images are accessed
+  // with good locality.
+  for (int by = 0; by < h; by += ROTATEBLOCK) {
+    int bh = h - by < ROTATEBLOCK ? h - by : ROTATEBLOCK;
+    for (int bx = 0; bx < w; bx += ROTATEBLOCK) {
+      int bw = w - bx < ROTATEBLOCK ? w - bx : ROTATEBLOCK;
+      kern->rotateBlock(img->pixel + (size_t)by * w + bx, w,
+                        nImg->pixel + (size_t)(w - 1 - bx) * h + by, h, bw, bh);
+    }
   }
+  countPixels((unsigned long)w * h, 2ul * w * h);  // reads + stores
+  traceEnd(nImg);
 
   return nImg;
 
@@ -523,26 +1413,27 @@ Image ImageRotate(Image img) { ///
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageMirror(Image img) { ///
   assert (img != NULL);
-  int nHeight = img->height;
-  int nWidth = img->width;
-  uint8 maxValue = img->maxval;
+  if (img->tiled) {
+    // Read a raster copy, keeping the layout of img
+    Image r = rasterCopy(img);
+    Image res = r != NULL ? ImageMirror(r) : NULL;
+    rasterDone(img, r);
+    return res;
+  }
+  const int w = img->width, h = img->height;
+  traceBegin(__func__, img);
   // Create a new image that'll be a mirror of the original image
-  Image nImg = ImageCreate(nWidth, nHeight, maxValue);
-
+  Image nImg = ImageCreate(w, h, img->maxval);
   if (nImg == NULL) {
+	  traceEnd(NULL);
 	  return NULL;
   }
-  // Goes through every position of the freshly created image
-  for (int i = 0; i < nWidth; i++) {
-	  for (int y = 0; y < nHeight; y++) {
-      //The value for y remains the same
-      //The value of x is changed, so that the first x becomes the last, and the last becomes the first
-      //nWidth-1 is the last position that x can have. Then the current position is subtracted to the last position.
-	    ImageSetPixel(nImg, nWidth - 1 - i, y, ImageGetPixel(img, i, y));
-      //This way, in a 8 by 8 image, for example, y of the new image will always be the current position
-      //While x will be follow the formula: x=7-currentPosition
-	  }
+  // Each row is reversed: the first x becomes the last, and vice-versa
+  for (int y = 0; y < h; y++) {
+    kern->mirrorRow(nImg->pixel + (size_t)y * w, img->pixel + (size_t)y * w, w);
   }
+  countPixels((unsigned long)w * h, 2ul * w * h);  // reads + stores
+  traceEnd(nImg);
 
   return nImg;
 }
@@ -562,22 +1453,26 @@ Image ImageMirror(Image img) { ///
 Image ImageCrop(Image img, int x, int y, int w, int h) { ///
   assert (img != NULL);
   assert (ImageValidRect(img, x, y, w, h));
-  // Insert your code here!
-  
-  uint8 maxValue = img->maxval;
-  Image nImg = ImageCreate(w, h, maxValue);                         // Creates a new white Image with w width and h height
-  
-  
+  if (img->tiled) {
+    // Read a raster copy, keeping the layout of img
+    Image r = rasterCopy(img);
+    Image res = r != NULL ? ImageCrop(r, x, y, w, h) : NULL;
+    rasterDone(img, r);
+    return res;
+  }
+  traceBegin(__func__, img);
+  Image nImg = ImageCreate(w, h, img->maxval);
   if (nImg == NULL) {
+	  traceEnd(NULL);
 	  return NULL;
   }
-  for (int i=0; i<w; i++){
-    for(int j=0; j<h; j++){
-      // Sets each pixel in the new image in the position (i,j) after obtaining the pixel of the original image in the position (x+i, y+j)
-      ImageSetPixel(nImg, i, j, ImageGetPixel(img, x+i, y+j));    
-    }
+  // Copy the rectangle row by row
+  for (int j = 0; j < h; j++) {
+    memcpy(nImg->pixel + (size_t)j * w, img->pixel + (size_t)(y + j) * img->width + x, w);
   }
-  
+  countPixels((unsigned long)w * h, 2ul * w * h);  // reads + stores
+  traceEnd(nImg);
+
   return nImg;
 }
 
@@ -586,42 +1481,90 @@ Image ImageCrop(Image img, int x, int y, int w, int h) { ///
 
 /// Paste an image into a larger image.
 /// Paste img2 into position (x, y) of img1.
-/// This modifies img1 in-place: no allocation involved.
+/// This modifies img1 in-place.  It allocates memory (and so may fail)
+/// only to give img1 its own copy of pixels shared with a clone (see
+/// ImageClone), to convert a tiled img1 to raster layout, or to read a
+/// tiled img2 through a raster copy (see ImageSetLayout).
 /// Requires: img2 must fit inside img1 at position (x, y).
-void ImagePaste(Image img1, int x, int y, Image img2) { ///
+///
+/// On success, returns nonzero.
+/// On failure, returns 0, errCause is set and img1 is not modified.
+int ImagePaste(Image img1, int x, int y, Image img2) { ///
   assert (img1 != NULL);
   assert (img2 != NULL);
   assert (ImageValidRect(img1, x, y, img2->width, img2->height));
-  // Insert your code here!
-  //Goes through every position of image2
-  for (int i=0; i<img2->width; i++){
-    for (int j=0; j<img2->height; j++){                           
-      ImageSetPixel(img1, i+x, j+y, ImageGetPixel(img2,  i, j)); //Set the pixel of the img2 in the position on img1, in the position it originally was in img2 + the values of x and y
-    }
+  if (img2->tiled) {
+    // Read a raster copy, keeping the layout of img2
+    Image r2 = rasterCopy(img2);
+    int res = r2 != NULL && ImagePaste(img1, x, y, r2);
+    rasterDone(img2, r2);
+    return res;
   }
+  if (!rasterLayout(img1)) return 0;
+  const int w2 = img2->width;
+  if (!ownPixels(img1)) return 0;
+  traceBegin(__func__, img2);
+  beginChange(img1, x, y, w2, img2->height);
+  //Copies each row of image2 to the matching row of image1
+  for (int j = 0; j < img2->height; j++) {
+    memcpy(img1->pixel + (size_t)(y + j) * img1->width + x, img2->pixel + (size_t)j * w2, w2);
+  }
+  endChange(img1, x, y, w2, img2->height);
+  countPixels((unsigned long)w2 * img2->height, 2ul * w2 * img2->height);  // reads + stores
+  traceEnd(NULL);
+  return 1;
 }
 
 /// Blend an image into a larger image.
 /// Blend img2 into position (x, y) of img1.
-/// This modifies img1 in-place: no allocation involved.
+/// This modifies img1 in-place.  It allocates memory (and so may fail)
+/// only to give img1 its own copy of pixels shared with a clone (see
+/// ImageClone), to convert a tiled img1 to raster layout, or to read a
+/// tiled img2 through a raster copy (see ImageSetLayout).
 /// Requires: img2 must fit inside img1 at position (x, y).
 /// alpha usually is in [0.0, 1.0], but values outside that interval
 /// may provide interesting effects.  Over/underflows should saturate.
-void ImageBlend(Image img1, int x, int y, Image img2, double alpha) { ///
+///
+/// On success, returns nonzero.
+/// On failure, returns 0, errCause is set and img1 is not modified.
+int ImageBlend(Image img1, int x, int y, Image img2, double alpha) { ///
   assert (img1 != NULL);
   assert (img2 != NULL);
   assert (ImageValidRect(img1, x, y, img2->width, img2->height));
-  // Insert your code here!
-  //Goes through every position of image2
-  for (int i=0; i<img2->width; i++){
-    for (int j=0; j<img2->height; j++){  
-      //Blends image1 and image2, according to a value alpha given, rounding the final value given
-      //Follows the formula (1-alpha)*(Pixel(img1))+(alpha)*(Pixel(img2))
-      uint8 blend = (uint8)( (1-alpha) * ImageGetPixel(img1,i+x,j+y) + (alpha) * ImageGetPixel(img2,i,j) +0.5);
-      //Stores the value in the correct position in the image1, which will be the current position plus the position given by (x,y)                       
-      ImageSetPixel(img1, i+x, j+y, blend);
-    }
+  if (img2->tiled) {
+    // Read a raster copy, keeping the layout of img2
+    Image r2 = rasterCopy(img2);
+    int res = r2 != NULL && ImageBlend(img1, x, y, r2, alpha);
+    rasterDone(img2, r2);
+    return res;
+  }
+  if (!rasterLayout(img1)) return 0;
+  const int w2 = img2->width;
+  if (!ownPixels(img1)) return 0;
+  traceBegin(__func__, img2);
+  //Blends each row of image2 into the matching row of image1, following
+  //the formula (1-alpha)*(Pixel(img1))+(alpha)*(Pixel(img2)), rounded
+  beginChange(img1, x, y, w2, img2->height);
+  for (int j = 0; j < img2->height; j++) {
+    kern->blendRow(img1->pixel + (size_t)(y + j) * img1->width + x,
+                   img2->pixel + (size_t)j * w2, w2, alpha);
+  }
+  endChange(img1, x, y, w2, img2->height);
+  countPixels((unsigned long)w2 * img2->height, 3ul * w2 * img2->height);  // reads + stores
+  traceEnd(NULL);
+  return 1;
+}
+
+// Compare img2 to the subimage of img1 at (x, y), row by row.
+// Adds the number of pixels compared to *count.
+static int matchAt(Image img1, int x, int y, Image img2, unsigned long* count) {
+  const int w2 = img2->width;
+  for (int j = 0; j < img2->height; j++) {
+    *count += w2;
+    if (memcmp(img1->pixel + (size_t)(y + j) * img1->width + x,
+               img2->pixel + (size_t)j * w2, w2) != 0) return 0;
   }
+  return 1;
 }
 
 /// Compare an image to a subimage of a larger image.
@@ -631,13 +1574,22 @@ int ImageMatchSubImage(Image img1, int x, int y, Image img2) { ///
   assert (img1 != NULL);
   assert (img2 != NULL);
   assert (ImageValidPos(img1, x, y));
-  // Insert your code here!
+  if (img1->tiled || img2->tiled) {
+    // Read raster copies, keeping the layouts of img1 and img2
+    Image r1 = rasterCopy(img1), r2 = rasterCopy(img2);
+    int res = r1 != NULL && r2 != NULL && ImageMatchSubImage(r1, x, y, r2);
+    rasterDone(img1, r1);
+    rasterDone(img2, r2);
+    return res;
+  }
+#if INSTRLEVEL >= 2
+  // Teaching build: compare pixel by pixel, counting each comparison
   int mWidth = img2->width;
   int mHeight = img2->height;
   //Goes through every position of image2
   for (int i = 0; i < mWidth; i++) {
 	  for (int j = 0; j < mHeight; j++) {
-      CountLocate+=1;
+      InstrAddExact(CountLocate, 1);
       //Compares if the pixels of image2 in the current position with the pixels of image1 in the position given by the sums x+current position && y+current position don't match
 	    if (ImageGetPixel(img1, x + i, y + j) != ImageGetPixel(img2, i, j)) {
       //Returns 0 (false) if they are different
@@ -647,122 +1599,2850 @@ int ImageMatchSubImage(Image img1, int x, int y, Image img2) { ///
   }
   //Returns 1 (true) if the image matches the subimage
   return 1;
+#else
+  // Compare row by row, counting the rows compared
+  unsigned long count = 0;
+  int match = matchAt(img1, x, y, img2, &count);
+  InstrAdd(CountLocate, count);
+  countPixels(count, 2 * count);  // reads
+  return match;
+#endif
+}
+
+// Locating is split among threads by stripes of LOCATESTRIPE columns of
+// candidate positions, handed out in scan order.  Candidates are scanned
+// as in the original serial version (x-major, then y), and the first match
+// found so far is shared, so that a thread stops as soon as all its
+// remaining candidates come after a known match.  Hence the result is
+// always the first match in the serial scan order.
+#define LOCATESTRIPE 4
+
+// Shared state of a locate job
+struct locateJob {
+  Image img1, img2;
+  int nx, ny;                 // number of candidate columns and rows
+  unsigned long maxSad;       // maximum SAD accepted as a match (0: exact)
+  atomic_int next;            // next stripe to scan
+  atomic_long best;           // scan index x*ny+y of first match known
+  atomic_ullong bestKey;      // (SAD << 32 | scan index) of best candidate
+  unsigned long count[MAXTHREADS];  // pixels compared by each worker
+};
+
+// Sum of absolute differences between img2 and the subimage of img1 at
+// (x, y), row by row.  Gives up as soon as the partial sum exceeds limit,
+// returning that partial sum.
+// Adds the number of pixels compared to *count.
+static unsigned long sadAt(Image img1, int x, int y, Image img2,
+                           unsigned long limit, unsigned long* count) {
+  const int w2 = img2->width;
+  unsigned long sum = 0;
+  for (int j = 0; j < img2->height && sum <= limit; j++) {
+    *count += w2;
+    sum += kern->sadRow(img1->pixel + (size_t)(y + j) * img1->width + x,
+                        img2->pixel + (size_t)j * w2, w2);
+  }
+  return sum;
+}
+
+// Locate worker for the first match: t0 is the worker number.
+static int locateWorker(void* arg, int t0, int t1) {
+  (void)t1;
+  struct locateJob* job = (struct locateJob*)arg;
+  const long ny = job->ny;
+  unsigned long count = 0;
+  for (;;) {
+    int x0 = atomic_fetch_add(&job->next, 1) * LOCATESTRIPE;
+    if (x0 >= job->nx || x0 * ny >= atomic_load_explicit(&job->best, memory_order_relaxed)) break;
+    int x1 = x0 + LOCATESTRIPE < job->nx ? x0 + LOCATESTRIPE : job->nx;
+    for (int x = x0; x < x1; x++) {
+      for (int y = 0; y < ny; y++) {
+        long pos = x * ny + y;
+        long best = atomic_load_explicit(&job->best, memory_order_relaxed);
+        if (pos >= best) goto stripeDone;   // a previous match is known
+        int match = job->maxSad == 0
+                  ? matchAt(job->img1, x, y, job->img2, &count)
+                  : sadAt(job->img1, x, y, job->img2, job->maxSad, &count) <= job->maxSad;
+        if (match) {
+          // Keep the minimum scan index
+          while (pos < best && !atomic_compare_exchange_weak(&job->best, &best, pos)) {}
+          goto stripeDone;
+        }
+      }
+    }
+  stripeDone: ;
+  }
+  job->count[t0] = count;
+  return 1;
+}
+
+// Locate worker for the best match: t0 is the worker number.
+// Candidates are ranked by the key (SAD << 32 | scan index), so ties are
+// won by the first candidate in scan order, as in a serial scan.
+static int locateBestWorker(void* arg, int t0, int t1) {
+  (void)t1;
+  struct locateJob* job = (struct locateJob*)arg;
+  const long ny = job->ny;
+  unsigned long count = 0;
+  for (;;) {
+    int x0 = atomic_fetch_add(&job->next, 1) * LOCATESTRIPE;
+    if (x0 >= job->nx) break;
+    int x1 = x0 + LOCATESTRIPE < job->nx ? x0 + LOCATESTRIPE : job->nx;
+    for (int x = x0; x < x1; x++) {
+      for (int y = 0; y < ny; y++) {
+        unsigned long long pos = (unsigned long long)(x * ny + y);
+        unsigned long long best = atomic_load_explicit(&job->bestKey, memory_order_relaxed);
+        // The candidate loses if its SAD exceeds the best one (or equals
+        // it, coming later in scan order): give up when that is certain.
+        int later = pos > (best & 0xFFFFFFFFu);
+        if ((best >> 32) == 0 && later) continue;
+        unsigned long limit = (unsigned long)(best >> 32) - later;
+        unsigned long sad = sadAt(job->img1, x, y, job->img2, limit, &count);
+        if (sad > limit) continue;
+        unsigned long long key = (unsigned long long)sad << 32 | pos;
+        while (key < best && !atomic_compare_exchange_weak(&job->bestKey, &best, key)) {}
+      }
+    }
+  }
+  job->count[t0] = count;
+  return 1;
+}
+
+// Run a locate job for img2 inside img1 with the given worker.
+// Returns 0 if img2 does not fit inside img1.
+static int locateRun(struct locateJob* job, BandFunc worker) {
+  Image img1 = job->img1, img2 = job->img2;
+  //Candidate positions: img2 must fit inside img1
+  job->nx = img1->width - img2->width + 1;
+  job->ny = img1->height - img2->height + 1;
+  if (job->nx <= 0 || job->ny <= 0) return 0;
+  atomic_init(&job->next, 0);
+  atomic_init(&job->best, LONG_MAX);
+  atomic_init(&job->bestKey, ULLONG_MAX);
+  int nt = threadsFor((long)job->nx * job->ny * img2->width * img2->height);
+  if (nt > MAXTHREADS) nt = MAXTHREADS;  // one count per worker, as parallelSplit
+  parallelSplit(nt, nt, worker, job);
+  unsigned long count = 0;
+  for (int t = 0; t < nt; t++) count += job->count[t];
+  InstrAdd(CountLocate, count);
+  countPixels(count, 2 * count);  // reads
+  return 1;
 }
 
 /// Locate a subimage inside another image.
 /// Searches for img2 inside img1.
 /// If a match is found, returns 1 and matching position is set in vars (*px, *py).
 /// If no match is found, returns 0 and (*px, *py) are left untouched.
+/// The search is done in parallel, but the position returned is always the
+/// first match in x-major order (smallest x, then smallest y).
 int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) { ///
   assert (img1 != NULL);
   assert (img2 != NULL);
-  //Goes through every position (pixel) of the image1 as long as the image2 can still fit, i.e., up to img1->width-img2->width && img1->height-img2->height
-  //There's no need to check the pixels further in the image past that point if the image2 as still not been found, because it wouldn't fit any longer 
-  for (int i = 0; i<=img1->width-img2->width; i++){
-    for (int j =0; j<=img1->height-img2->height; j++){
-      //Checks if the pixel of image2 matches the pixel in image1 in the specified position
-      if(ImageMatchSubImage(img1, i, j, img2)){
-        //Alters the value of *px and *py, returning 1 (or true)
-        
-        *px = i;
-        *py = j;
-        return 1;
+  if (img1->tiled || img2->tiled) {
+    // Read raster copies, keeping the layouts of img1 and img2
+    Image r1 = rasterCopy(img1), r2 = rasterCopy(img2);
+    int res = r1 != NULL && r2 != NULL && ImageLocateSubImage(r1, px, py, r2);
+    rasterDone(img1, r1);
+    rasterDone(img2, r2);
+    return res;
+  }
+  struct locateJob job = { .img1 = img1, .img2 = img2, .maxSad = 0 };
+  traceBegin(__func__, img1);
+  int ok = locateRun(&job, locateWorker);
+  traceEnd(NULL);
+  if (!ok) return 0;
+  long best = atomic_load(&job.best);
+  if (best == LONG_MAX) return 0;
+  *px = (int)(best / job.ny);
+  *py = (int)(best % job.ny);
+  return 1;
+}
+
+/// Locate an approximate subimage inside another image.
+/// Searches for a subimage of img1 whose sum of absolute differences (SAD)
+/// to img2 is at most maxSad.
+/// If one is found, returns 1 and its position is set in vars (*px, *py).
+/// If none is found, returns 0 and (*px, *py) are left untouched.
+/// The position returned is the first in x-major order, as in
+/// ImageLocateSubImage.  With maxSad==0 this is ImageLocateSubImage.
+int ImageLocateWithin(Image img1, int* px, int* py, Image img2, unsigned long maxSad) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  if (img1->tiled || img2->tiled) {
+    // Read raster copies, keeping the layouts of img1 and img2
+    Image r1 = rasterCopy(img1), r2 = rasterCopy(img2);
+    int res = r1 != NULL && r2 != NULL && ImageLocateWithin(r1, px, py, r2, maxSad);
+    rasterDone(img1, r1);
+    rasterDone(img2, r2);
+    return res;
+  }
+  struct locateJob job = { .img1 = img1, .img2 = img2, .maxSad = maxSad };
+  traceBegin(__func__, img1);
+  int ok = locateRun(&job, locateWorker);
+  traceEnd(NULL);
+  if (!ok) return 0;
+  long best = atomic_load(&job.best);
+  if (best == LONG_MAX) return 0;
+  *px = (int)(best / job.ny);
+  *py = (int)(best % job.ny);
+  return 1;
+}
+
+/// Locate the best approximation of a subimage inside another image.
+/// Finds the subimage of img1 with the least sum of absolute differences
+/// (SAD) to img2, and sets its position in (*px, *py) and its SAD in *sad.
+/// Ties are broken by x-major order, as in ImageLocateSubImage.
+/// Returns 1, or 0 if img2 does not fit inside img1 (vars left untouched).
+/// Requires: img2 has less than 2^24 pixels and img1 less than 2^32 positions.
+int ImageLocateBest(Image img1, int* px, int* py, Image img2, unsigned long* sad) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  assert ((long)img2->width * img2->height < (1l << 24));
+  assert ((long)(img1->width - img2->width + 1) * (img1->height - img2->height + 1) < (1l << 32));
+  if (img1->tiled || img2->tiled) {
+    // Read raster copies, keeping the layouts of img1 and img2
+    Image r1 = rasterCopy(img1), r2 = rasterCopy(img2);
+    int res = r1 != NULL && r2 != NULL && ImageLocateBest(r1, px, py, r2, sad);
+    rasterDone(img1, r1);
+    rasterDone(img2, r2);
+    return res;
+  }
+  struct locateJob job = { .img1 = img1, .img2 = img2 };
+  traceBegin(__func__, img1);
+  int ok = locateRun(&job, locateBestWorker);
+  traceEnd(NULL);
+  if (!ok) return 0;
+  unsigned long long best = atomic_load(&job.bestKey);
+  unsigned long pos = (unsigned long)(best & 0xFFFFFFFFu);
+  *px = (int)(pos / job.ny);
+  *py = (int)(pos % job.ny);
+  *sad = (unsigned long)(best >> 32);
+  return 1;
+}
+
+// Locating many subimages scans the positions of img1 once, row by row.
+// Subimages are bucketed by a hash of the first KEYLEN pixels of their
+// first row (fewer if some subimage is narrower): at each position, the
+// key of the pixels there selects the only subimages that may match, and
+// only those are compared in full.  The first match of each subimage in
+// x-major order is kept in its best scan index x*height+y, shared among
+// the threads scanning bands of rows, so a position is compared to a
+// subimage only if it comes before any match already known.
+#define KEYLEN 4
+
+// Shared state of a multiple locate job
+struct locateManyJob {
+  Image img1;
+  Image* img2;                // the subimages
+  int n;                      // number of subimages
+  int keylen;                 // pixels in a key
+  unsigned mask;              // bucket of hash h is h & mask
+  int* head;                  // first subimage of each bucket, or -1
+  int* next;                  // next subimage in the same bucket, or -1
+  uint32_t* key;              // key of each subimage
+  atomic_long* best;          // first match of each subimage (LONG_MAX: none)
+  atomic_ulong count;         // pixels compared
+};
+
+// Key of the keylen pixels starting at p.
+static inline uint32_t locateKey(const uint8* p, int keylen) {
+  uint32_t key = 0;
+  for (int i = 0; i < keylen; i++) key = key << 8 | p[i];
+  return key;
+}
+
+// Bucket of a key.
+static inline unsigned locateBucket(uint32_t key, unsigned mask) {
+  return (key * 2654435761u >> 8) & mask;
+}
+
+// Scan the positions of rows [y0, y1) of img1 for all subimages.
+static int locateManyBand(void* arg, int y0, int y1) {
+  struct locateManyJob* job = (struct locateManyJob*)arg;
+  Image img1 = job->img1;
+  const int w1 = img1->width, h1 = img1->height;
+  unsigned long count = 0;
+  for (int y = y0; y < y1; y++) {
+    const uint8* row = img1->pixel + (size_t)y * w1;
+    for (int x = 0; x + job->keylen <= w1; x++) {
+      uint32_t key = locateKey(row + x, job->keylen);
+      for (int t = job->head[locateBucket(key, job->mask)]; t >= 0; t = job->next[t]) {
+        Image img2 = job->img2[t];
+        if (job->key[t] != key || x + img2->width > w1 || y + img2->height > h1) continue;
+        long pos = (long)x * h1 + y;
+        long best = atomic_load_explicit(&job->best[t], memory_order_relaxed);
+        if (pos >= best || !matchAt(img1, x, y, img2, &count)) continue;
+        // Keep the minimum scan index
+        while (pos < best && !atomic_compare_exchange_weak(&job->best[t], &best, pos)) {}
       }
     }
   }
-  //Returns 0 (or false) if the image2 is not found within the confines of the image1
-  return 0;
+  atomic_fetch_add(&job->count, count);
+  return 1;
+}
+
+/// Locate several subimages inside an image, in a single scan.
+/// Searches for each of img2[0..n-1] inside img1, and sets results[i] to
+/// the first match of img2[i] in x-major order, as ImageLocateSubImage
+/// would find it (results[i].found is 0 if there is none).
+/// The scan costs about the same for any number of subimages, except for
+/// the positions where a subimage matches its first few pixels.
+/// Requires: n >= 0.
+///
+/// On success, returns nonzero.
+/// On failure, returns 0 and errCause is set.
+int ImageLocateMany(Image img1, Image img2[], int n, ImageMatch results[]) { ///
+  assert (img1 != NULL);
+  assert (n >= 0);
+  int tiled = img1->tiled;
+  for (int t = 0; t < n; t++) {
+    assert (img2[t] != NULL);
+    tiled |= img2[t]->tiled;
+  }
+  if (tiled) {
+    // Read raster copies, keeping the layouts of img1 and img2[]
+    Image r1 = rasterCopy(img1);
+    Image* r2 = (Image*)calloc(n > 0 ? n : 1, sizeof(Image));
+    int res = r1 != NULL && check(r2 != NULL, "Out of memory for locate");
+    for (int t = 0; res && t < n; t++) res = (r2[t] = rasterCopy(img2[t])) != NULL;
+    res = res && ImageLocateMany(r1, r2, n, results);
+    for (int t = 0; r2 != NULL && t < n; t++) rasterDone(img2[t], r2[t]);
+    free(r2);
+    rasterDone(img1, r1);
+    return res;
+  }
+  const int w1 = img1->width, h1 = img1->height;
+  struct locateManyJob job = { .img1 = img1, .img2 = img2, .n = n, .keylen = KEYLEN };
+  // Subimages that are empty, or do not fit, need no scan
+  int scan = 0;
+  for (int t = 0; t < n; t++) {
+    results[t].found = 0;
+    int w2 = img2[t]->width, h2 = img2[t]->height;
+    if (w2 > w1 || h2 > h1) continue;
+    if (w2 == 0 || h2 == 0) {
+      results[t].found = 1;
+      results[t].x = results[t].y = 0;
+      continue;
+    }
+    if (w2 < job.keylen) job.keylen = w2;
+    scan++;
+  }
+  if (scan == 0) return 1;
+
+  unsigned buckets = 1;
+  while (buckets < 2u * scan) buckets *= 2;
+  job.mask = buckets - 1;
+  traceBegin(__func__, img1);
+  int success =
+  check( (job.head = (int*)malloc(sizeof(int) * buckets)) != NULL, "Out of memory for locate" ) &&
+  check( (job.next = (int*)malloc(sizeof(int) * n)) != NULL, "Out of memory for locate" ) &&
+  check( (job.key = (uint32_t*)malloc(sizeof(uint32_t) * n)) != NULL, "Out of memory for locate" ) &&
+  check( (job.best = (atomic_long*)malloc(sizeof(atomic_long) * n)) != NULL, "Out of memory for locate" );
+  if (success) {
+    for (unsigned b = 0; b < buckets; b++) job.head[b] = -1;
+    // Add subimages to buckets in reverse, so each bucket lists them in order
+    for (int t = n - 1; t >= 0; t--) {
+      Image img2t = img2[t];
+      job.next[t] = -1;
+      atomic_init(&job.best[t], LONG_MAX);
+      if (results[t].found || img2t->width > w1 || img2t->height > h1) continue;
+      job.key[t] = locateKey(img2t->pixel, job.keylen);
+      unsigned b = locateBucket(job.key[t], job.mask);
+      job.next[t] = job.head[b];
+      job.head[b] = t;
+    }
+    atomic_init(&job.count, 0);
+    parallelBands(w1, h1, locateManyBand, &job);
+    for (int t = 0; t < n; t++) {
+      long best = atomic_load(&job.best[t]);
+      if (best == LONG_MAX) continue;
+      results[t].found = 1;
+      results[t].x = (int)(best / h1);
+      results[t].y = (int)(best % h1);
+    }
+    unsigned long count = atomic_load(&job.count);
+    InstrAdd(CountLocate, count);
+    countPixels((unsigned long)w1 * h1 + count, (unsigned long)w1 * h1 + 2 * count);  // reads
+  }
+  free(job.head);
+  free(job.next);
+  free(job.key);
+  free(job.best);
+  traceEnd(NULL);
+  return success;
+}
+
+
+/// Search indexes
+
+// A search index lists the positions (x, y) of an image where an 8x8 block
+// fits, in x-major order, by the hash of the block at each position.
+// The lists of all buckets are stored one after the other in a single
+// array, pos, with bucket b in pos[start[b]..start[b+1]), like a bucket
+// sort of the positions.  There are about as many buckets as positions,
+// so a bucket holds few positions other than those of repeated blocks.
+// A subimage can only match at the positions in the bucket of its top
+// left block; they are compared in x-major order, so the first match is
+// the one a full scan finds.
+// The index does not store the hashes: a candidate whose block differs
+// is usually rejected by the first row compared.
+#define INDEXBLOCK 8
+
+struct imageIndex {
+  Image img;              // clone of the indexed image
+  int ny;                 // rows of positions: pos = x*ny + y
+  int bits;               // there are 2^bits buckets
+  uint32_t* start;        // first position of each bucket (2^bits + 1)
+  uint32_t* pos;          // positions, by bucket
+  uint64_t sum;           // hash of all the pixels (see pixelsHash)
+};
+
+// Hashes of blocks are polynomials in INDEXKEY of the 8-pixel rows of the
+// block, read as 64-bit words, from top to bottom.  Down a column, the
+// hash of the next block is then updated with one row in and one row out.
+#define INDEXKEY 0x9E3779B97F4A7C15ull
+
+// Read the 8-pixel row at p as a word.
+static inline uint64_t blockRow(const uint8* p) {
+  uint64_t row;
+  memcpy(&row, p, sizeof(row));
+  return row;
+}
+
+// Hash of the 8x8 block at p, in rows stride apart.
+static inline uint64_t blockHash(const uint8* p, int stride) {
+  uint64_t h = 0;
+  for (int j = 0; j < INDEXBLOCK; j++) h = h * INDEXKEY + blockRow(p + (size_t)j * stride);
+  return h;
+}
+
+// Bucket of a block hash, out of 2^bits.
+static inline uint32_t indexBucket(uint64_t h, int bits) {
+  h ^= h >> 29;
+  return (uint32_t)((h * 0xD6E8FEB86659FD93ull) >> (64 - bits));
+}
+
+// Hash of n pixels, to tell whether an index belongs to an image.
+static uint64_t pixelsHash(const uint8* p, size_t n) {
+  uint64_t h = 0xCBF29CE484222325ull ^ n;
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    uint64_t word;
+    memcpy(&word, p + i, sizeof(word));
+    h = (h ^ word) * 0x100000001B3ull;
+  }
+  for (; i < n; i++) h = (h ^ p[i]) * 0x100000001B3ull;
+  return h;
+}
+
+// Shared state of an index job
+struct indexJob {
+  Image img;
+  int ny;
+  int bits;
+  uint32_t* bucket;       // bucket of each position
+};
+
+// Compute the buckets of the positions in columns [x0, x1).
+static int indexCols(void* arg, int x0, int x1) {
+  struct indexJob* job = (struct indexJob*)arg;
+  const int w = job->img->width, ny = job->ny;
+  // Factor of the row that leaves the block: INDEXKEY^INDEXBLOCK
+  uint64_t out = 1;
+  for (int j = 0; j < INDEXBLOCK; j++) out *= INDEXKEY;
+  for (int x = x0; x < x1; x++) {
+    const uint8* p = job->img->pixel + x;
+    uint32_t* b = job->bucket + (size_t)x * ny;
+    uint64_t h = blockHash(p, w);
+    b[0] = indexBucket(h, job->bits);
+    for (int y = 1; y < ny; y++) {
+      h = h * INDEXKEY - blockRow(p + (size_t)(y - 1) * w) * out
+        + blockRow(p + (size_t)(y + INDEXBLOCK - 1) * w);
+      b[y] = indexBucket(h, job->bits);
+    }
+  }
+  return 1;
+}
+
+// Allocate an index of img with no positions, and clone img into it.
+// Sets its number of rows of positions and of buckets.
+static ImageIndex newIndex(Image img) {
+  ImageIndex idx = NULL;
+  if (!check( (idx = (ImageIndex)calloc(1, sizeof(struct imageIndex))) != NULL,
+              "Out of memory for index" )) return NULL;
+  const int nx = img->width - INDEXBLOCK + 1;
+  idx->ny = img->height - INDEXBLOCK + 1;
+  size_t n = nx > 0 && idx->ny > 0 ? (size_t)nx * idx->ny : 0;
+  idx->bits = 1;
+  while (((size_t)1 << idx->bits) < n) idx->bits++;
+  if (!check( (idx->start = (uint32_t*)malloc(sizeof(uint32_t) * (((size_t)1 << idx->bits) + 1))) != NULL &&
+              (idx->pos = (uint32_t*)malloc(sizeof(uint32_t) * (n > 0 ? n : 1))) != NULL,
+              "Out of memory for index" ) ||
+      (idx->img = ImageClone(img)) == NULL) {
+    ImageIndexDestroy(&idx);
+  }
+  return idx;
+}
+
+/// Create a search index of img.
+/// Requires: img has less than 2^32 pixels.
+///
+/// On success, a new index is returned.
+/// (The caller is responsible for destroying the returned index!)
+/// On failure, returns NULL and errCause is set.
+ImageIndex ImageIndexCreate(Image img) { ///
+  assert (img != NULL);
+  assert ((long)img->width * img->height < (1l << 32));
+  if (img->tiled) {
+    // Read a raster copy, keeping the layout of img
+    Image r = rasterCopy(img);
+    ImageIndex res = r != NULL ? ImageIndexCreate(r) : NULL;
+    rasterDone(img, r);
+    return res;
+  }
+  ImageIndex idx = NULL;
+  struct indexJob job = { .img = img, .bucket = NULL };
+  const int nx = img->width - INDEXBLOCK + 1;
+  const int ny = img->height - INDEXBLOCK + 1;
+  const size_t n = nx > 0 && ny > 0 ? (size_t)nx * ny : 0;
+  traceBegin(__func__, img);
+  int success =
+  (idx = newIndex(img)) != NULL &&
+  check( (job.bucket = (uint32_t*)malloc(sizeof(uint32_t) * (n > 0 ? n : 1))) != NULL,
+         "Out of memory for index" );
+  if (success) {
+    // Sort positions by bucket, keeping them in x-major order
+    const size_t buckets = (size_t)1 << idx->bits;
+    job.ny = idx->ny;
+    job.bits = idx->bits;
+    if (n > 0) parallelSplit(nx, threadsFor((long)n * INDEXBLOCK), indexCols, &job);
+    memset(idx->start, 0, sizeof(uint32_t) * (buckets + 1));
+    for (size_t i = 0; i < n; i++) idx->start[job.bucket[i] + 1]++;
+    for (size_t b = 0; b < buckets; b++) idx->start[b + 1] += idx->start[b];
+    // Fill each bucket, advancing its start to the start of the next one
+    for (size_t i = 0; i < n; i++) idx->pos[idx->start[job.bucket[i]]++] = (uint32_t)i;
+    for (size_t b = buckets; b > 0; b--) idx->start[b] = idx->start[b - 1];
+    idx->start[0] = 0;
+    idx->sum = pixelsHash(img->pixel, (size_t)img->width * img->height);
+    countPixels((unsigned long)n, (unsigned long)n * INDEXBLOCK * INDEXBLOCK +
+                (unsigned long)img->width * img->height);
+  } else {
+    ImageIndexDestroy(&idx);
+  }
+  free(job.bucket);
+  traceEnd(NULL);
+  return idx;
+}
+
+/// Destroy the index pointed to by (*idxp).
+/// If (*idxp)==NULL, no operation is performed.
+/// Ensures: (*idxp)==NULL.
+void ImageIndexDestroy(ImageIndex* idxp) { ///
+  assert (idxp != NULL);
+  ImageIndex idx = *idxp;
+  if (idx == NULL) return;
+  ImageDestroy(&idx->img);
+  free(idx->start);
+  free(idx->pos);
+  free(idx);
+  *idxp = NULL;
+}
+
+/// Locate a subimage inside the indexed image.
+/// As ImageLocateSubImage: returns 1 and sets (*px, *py) to the first
+/// match of img2 in x-major order, or returns 0 if there is none.
+/// Subimages smaller than 8x8 are located by a full scan.
+int ImageIndexLocate(ImageIndex idx, int* px, int* py, Image img2) { ///
+  assert (idx != NULL);
+  assert (img2 != NULL);
+  Image img1 = idx->img;
+  const int w2 = img2->width, h2 = img2->height;
+  if (w2 < INDEXBLOCK || h2 < INDEXBLOCK) return ImageLocateSubImage(img1, px, py, img2);
+  if (w2 > img1->width || h2 > img1->height) return 0;
+  if (img2->tiled) {
+    // Read a raster copy, keeping the layout of img2
+    Image r2 = rasterCopy(img2);
+    int res = r2 != NULL && ImageIndexLocate(idx, px, py, r2);
+    rasterDone(img2, r2);
+    return res;
+  }
+  traceBegin(__func__, img2);
+  uint32_t b = indexBucket(blockHash(img2->pixel, w2), idx->bits);
+  unsigned long count = 0;
+  int found = 0;
+  for (uint32_t i = idx->start[b]; i < idx->start[b + 1] && !found; i++) {
+    int x = (int)(idx->pos[i] / idx->ny);
+    int y = (int)(idx->pos[i] % idx->ny);
+    if (x + w2 > img1->width || y + h2 > img1->height) continue;
+    if (matchAt(img1, x, y, img2, &count)) {
+      *px = x;
+      *py = y;
+      found = 1;
+    }
+  }
+  InstrAdd(CountLocate, count);
+  countPixels(count + INDEXBLOCK * INDEXBLOCK, 2 * count + INDEXBLOCK * INDEXBLOCK);  // reads
+  traceEnd(NULL);
+  return found;
+}
+
+// Index files have a text header, as PGM files, with the size of the image
+// and of the blocks, the number of bits of the buckets and the hash of
+// the pixels, followed by the arrays start and pos, in binary.
+#define INDEXMAGIC "I8X1"
+
+/// Save a search index to a file.
+/// The image is not saved: save it with ImageSave, if needed.
+/// The file is in the byte order of this machine.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// a partial and invalid file may be left in the system.
+int ImageIndexSave(ImageIndex idx, const char* filename) { ///
+  assert (idx != NULL);
+  Image img = idx->img;
+  const size_t buckets = (size_t)1 << idx->bits;
+  const size_t n = idx->start[buckets];
+  FILE* f = NULL;
+  traceBegin(__func__, img);
+
+  int success =
+  check( (f = fopen(filename, "wb")) != NULL, "Open failed" ) &&
+  check( fprintf(f, INDEXMAGIC "\n%d %d %d %d\n%016llx\n", img->width, img->height,
+                 INDEXBLOCK, idx->bits, (unsigned long long)idx->sum) > 0, "Writing header failed" ) &&
+  check( fwrite(idx->start, sizeof(uint32_t), buckets + 1, f) == buckets + 1 &&
+         fwrite(idx->pos, sizeof(uint32_t), n, f) == n, "Writing index failed" );
+
+  // Cleanup
+  if (f != NULL) fclose(f);
+  traceEnd(NULL);
+  return success;
+}
+
+// Check that the arrays of a loaded index are consistent, so that
+// searching it never reads out of bounds.
+static int indexValid(ImageIndex idx, size_t n) {
+  const size_t buckets = (size_t)1 << idx->bits;
+  if (idx->start[0] != 0 || idx->start[buckets] != n) return 0;
+  for (size_t b = 0; b < buckets; b++) {
+    if (idx->start[b] > idx->start[b + 1]) return 0;
+  }
+  for (size_t i = 0; i < n; i++) {
+    if (idx->pos[i] >= n) return 0;
+  }
+  return 1;
+}
+
+/// Load a search index of img from a file saved by ImageIndexSave.
+/// Loading is faster than creating the index, but still reads every pixel
+/// of img, to check that it is the image indexed.
+/// On success, a new index is returned.
+/// (The caller is responsible for destroying the returned index!)
+/// On failure (including an index of another image), returns NULL and
+/// errno/errCause are set accordingly.
+ImageIndex ImageIndexLoad(const char* filename, Image img) { ///
+  assert (img != NULL);
+  int w, h, block, bits;
+  unsigned long long sum;
+  char c;
+  FILE* f = NULL;
+  ImageIndex idx = NULL;
+  if (img->tiled) {
+    // Read a raster copy, keeping the layout of img
+    Image r = rasterCopy(img);
+    ImageIndex res = r != NULL ? ImageIndexLoad(filename, r) : NULL;
+    rasterDone(img, r);
+    return res;
+  }
+  traceBegin(__func__, img);
+  const int nx = img->width - INDEXBLOCK + 1;
+  const int ny = img->height - INDEXBLOCK + 1;
+  const size_t n = nx > 0 && ny > 0 ? (size_t)nx * ny : 0;
+
+  int success =
+  check( (f = fopen(filename, "rb")) != NULL, "Open failed" ) &&
+  // Parse header
+  check( fscanf(f, INDEXMAGIC "%c", &c) == 1 && isspace(c), "Invalid file format" ) &&
+  check( fscanf(f, "%d %d %d %d %llx%c", &w, &h, &block, &bits, &sum, &c) == 6 &&
+         isspace(c), "Invalid index header" ) &&
+  check( w == img->width && h == img->height && block == INDEXBLOCK &&
+         sum == pixelsHash(img->pixel, (size_t)w * h), "Index of another image" ) &&
+  // Allocate index
+  (idx = newIndex(img)) != NULL &&
+  check( bits == idx->bits, "Invalid index header" ) &&
+  // Read arrays
+  check( fread(idx->start, sizeof(uint32_t), ((size_t)1 << bits) + 1, f) == ((size_t)1 << bits) + 1 &&
+         fread(idx->pos, sizeof(uint32_t), n, f) == n, "Reading index" ) &&
+  check( indexValid(idx, n), "Invalid index" );
+  countPixels((unsigned long)n, (unsigned long)img->width * img->height);  // pixels hashed
+
+  // Cleanup
+  if (success) {
+    idx->sum = sum;
+  } else {
+    errsave = errno;
+    ImageIndexDestroy(&idx);
+    errno = errsave;
+  }
+  if (f != NULL) fclose(f);
+  traceEnd(NULL);
+  return idx;
 }
 
 
 /// Filtering
 
+// Blurring computes exact means, rounded as (sum+count/2)/count, where
+// count is the number of pixels of the window inside the image.
+// Small windows (dx, dy <= SMALLBLUR) have their own row kernels, in
+// imageKernels.h, with the window size fixed at compile time: the
+// loops over the window are fully unrolled, the loops over pixels are
+// vectorized, and the division by the constant count becomes a multiply.
+// Larger windows use sliding sums: a running sum per column, over the
+// window rows, and a running sum of those along the row.
+// Either way, the cost per pixel does not depend on the image size, and
+// rows are split into bands among threads.
+#define SMALLBLUR 3
+
+// Shared state of a blur job
+struct blurJob {
+  const uint8* src;
+  uint8* dst;
+  int w, h;
+  int dx, dy;
+};
+
+// Mean of the window around (x, y), clamped to the image.
+// Used for pixels near the borders by the small window kernels.
+static uint8 blurAt(const struct blurJob* job, int x, int y) {
+  int xm = x - job->dx > 0 ? x - job->dx : 0;
+  int xM = x + job->dx < job->w - 1 ? x + job->dx : job->w - 1;
+  int ym = y - job->dy > 0 ? y - job->dy : 0;
+  int yM = y + job->dy < job->h - 1 ? y + job->dy : job->h - 1;
+  uint32_t sum = 0;
+  for (int j = ym; j <= yM; j++) {
+    const uint8* row = job->src + (size_t)j * job->w;
+    for (int i = xm; i <= xM; i++) sum += row[i];
+  }
+  uint32_t count = (uint32_t)(xM - xm + 1) * (yM - ym + 1);
+  return (uint8)((sum + count/2) / count);
+}
+
+// Blur the rows [y0, y1) with a small window, using the row kernel
+// for its size.  Pixels near the borders are computed by blurAt.
+static int blurSmall(void* arg, int y0, int y1) {
+  const struct blurJob* job = (const struct blurJob*)arg;
+  const int w = job->w, h = job->h, dx = job->dx, dy = job->dy;
+  void (*blurRow)(const uint8*, int, uint16_t*, uint8*) = kern->blurRow[dy][dx];
+  uint16_t* col = (uint16_t*)malloc(sizeof(uint16_t) * (size_t)w);
+  if (col == NULL) return 0;
+  for (int y = y0; y < y1; y++) {
+    uint8* out = job->dst + (size_t)y * w;
+    if (y < dy || y >= h - dy || w <= 2*dx) {
+      for (int x = 0; x < w; x++) out[x] = blurAt(job, x, y);
+      continue;
+    }
+    blurRow(job->src + (size_t)(y - dy) * w, w, col, out);
+    for (int x = 0; x < dx; x++) out[x] = blurAt(job, x, y);
+    for (int x = w - dx; x < w; x++) out[x] = blurAt(job, x, y);
+  }
+  free(col);
+  return 1;
+}
+
+// Blur the rows [y0, y1) with sliding sums, for any window size.
+static int blurSliding(void* arg, int y0, int y1) {
+  const struct blurJob* job = (const struct blurJob*)arg;
+  const int w = job->w, h = job->h, dx = job->dx, dy = job->dy;
+  uint32_t* col = (uint32_t*)calloc((size_t)w, sizeof(uint32_t));
+  if (col == NULL) return 0;
+  // Column sums over the window rows [ym, yM] of row y0
+  int ym = y0 - dy > 0 ? y0 - dy : 0;
+  int yM = y0 + dy < h - 1 ? y0 + dy : h - 1;
+  for (int j = ym; j <= yM; j++) kern->addRow(col, job->src + (size_t)j * w, w);
+  for (int y = y0; y < y1; y++) {
+    if (y > y0) {
+      // Slide the column sums down one row
+      if (y + dy < h) {
+        kern->addRow(col, job->src + (size_t)(y + dy) * w, w);
+        yM++;
+      }
+      if (y - dy - 1 >= 0) {
+        kern->subRow(col, job->src + (size_t)(y - dy - 1) * w, w);
+        ym++;
+      }
+    }
+    uint32_t rows = (uint32_t)(yM - ym + 1);
+    // Slide the window along the row
+    uint8* restrict out = job->dst + (size_t)y * w;
+    uint32_t sum = 0;
+    int xM = dx < w - 1 ? dx : w - 1;
+    for (int x = 0; x <= xM; x++) sum += col[x];
+    for (int x = 0; x < w; x++) {
+      int xm = x - dx > 0 ? x - dx : 0;
+      xM = x + dx < w - 1 ? x + dx : w - 1;
+      uint32_t count = (uint32_t)(xM - xm + 1) * rows;
+      out[x] = (uint8)((sum + count/2) / count);
+      if (x + dx + 1 < w) sum += col[x + dx + 1];
+      if (x - dx >= 0) sum -= col[x - dx];
+    }
+  }
+  free(col);
+  return 1;
+}
+
 /// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter.
 /// Each pixel is substituted by the mean of the pixels in the rectangle
 /// [x-dx, x+dx]x[y-dy, y+dy].
 /// The image is changed in-place.
-void ImageBlur(Image img, int dx, int dy) { ///
-  // Insert your code here!
-  /*
-  Image imgAuxiliar = ImageCreate(img->width, img->height, img->maxval);
-  memcpy((void*)imgAuxiliar->pixel, (void*)img->pixel, img->width * img-> height);    //copies original image to the previously created Auxiliar Image.
-  
-  //Goes through every position of the original image
- 
-  for (int i = 0; i < img->width; i++) {
-	  for (int j = 0; j < img->height; j++) {
-	    int sum = 0;
-	    int count = 0;
-
-      // Goes through every position of the sub-image with dx width and dy height
-
-	    for (int k = i - dx; k <= i + dx; k++) {
-		    for (int l = j - dy; l <= j + dy; l++) {
-          CountBlur+=1;
-          //Checks if the position is valid
-		      if (ImageValidPos(img, k, l)) {
-            SumBlur+=1;
-            //Sum the pixel of the auxiliar image and increments count.
-			      sum += ImageGetPixel(imgAuxiliar, k, l);
-			      count++;
-		      }
-		    }
-	    }
+/// Requires: dx, dy >= 0.
+///
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set and img is not modified.
+int ImageBlur(Image img, int dx, int dy) { ///
+  assert (img != NULL);
+  assert (dx >= 0 && dy >= 0);
+  if (!rasterLayout(img)) return 0;
+  int w = img->width, h = img->height;
+  if (w == 0 || h == 0 || (dx == 0 && dy == 0)) return 1;
+  struct blurJob job = { .src = img->pixel, .w = w, .h = h, .dx = dx, .dy = dy };
+  int small = dx <= SMALLBLUR && dy <= SMALLBLUR;
+  BandFunc kernel = small ? blurSmall : blurSliding;
 
-    // Sets the value of the pixel in the original pixel. The value of the pixel is the average of the pixels in the vicinity, adjusted for rounding 
-	  ImageSetPixel(img, i, j, (uint8) (((sum+count/2)/count)));
-	  }
+  traceBegin(__func__, img);
+  int success =
+  check( (job.dst = newPixels((size_t)w * h)) != NULL, "Out of memory for blur" ) &&
+  check( parallelBands(w, h, kernel, &job), "Out of memory for blur" );
+  InstrAdd(CountBlur, (unsigned long)w * h);  // pixels blurred
+  if (small) {
+    InstrAdd(SumBlur, (unsigned long)w * h * (2*dx + 2*dy));   // additions
+    countPixels((unsigned long)w * h, (unsigned long)w * h * (2*dy + 2));       // reads + store
+  } else {
+    InstrAdd(SumBlur, 4ul * w * h);   // additions and subtractions
+    countPixels((unsigned long)w * h, 3ul * w * h);    // reads + store
   }
-  //destroys the Auxiliar image
-  ImageDestroy(&imgAuxiliar);
-  */
-   //A more efficient method to calculate ImageBlur
-  
-  int h = img->height, w = img->width;
-  uint32_t sum[h][w];
-
-  // Sum of every pixel before the position aborded
-  for (int i = 0; i < w; i++){
-    for (int j = 0; j < h; j++){
-      if(i == 0 && j == 0 ){
-        sum[j][i] = (uint32_t)ImageGetPixel(img,i,j); // Value of the (x,y)
-      }else if(i == 0){
-        sum[j][i] = (uint32_t)(ImageGetPixel(img,i,j) + sum[j-1][i]);
-        SumBlur+=1;
-      }else if(j == 0){        
-        sum[j][i] = (uint32_t)(ImageGetPixel(img,i,j) + sum[j][i-1]);
-        SumBlur+=1;
-      }else{
-        sum[j][i] = (uint32_t)(ImageGetPixel(img,i,j) + sum[j][i-1] + sum[j-1][i] - sum[j-1][i-1]);
-        SumBlur+=2;
-      }
+
+  // Cleanup
+  if (success) {
+    setPixels(img, job.dst);
+  } else {
+    free(job.dst);
+  }
+  traceEnd(NULL);
+  return success;
+}
+
+// Recompute the pixels of blur (img blurred with dx, dy) whose window
+// intersects rectangle [x0,x1)x[y0,y1) of img.
+// The region of img they depend on is blurred in a temporary image: its
+// windows are clipped where the region is clipped by the image border,
+// so the blur of its inner part is exactly that of the whole image.
+// Returns 0 on failure (out of memory), with blur unchanged.
+static int blurRegion(Image img, Image blur, int dx, int dy,
+                      int x0, int y0, int x1, int y1) {
+  const int w = img->width, h = img->height;
+  // Pixels to recompute: the region expanded by the window
+  int rx0 = x0 - dx > 0 ? x0 - dx : 0, rx1 = x1 + dx < w ? x1 + dx : w;
+  int ry0 = y0 - dy > 0 ? y0 - dy : 0, ry1 = y1 + dy < h ? y1 + dy : h;
+  // Pixels they depend on: expanded again
+  int sx0 = rx0 - dx > 0 ? rx0 - dx : 0, sx1 = rx1 + dx < w ? rx1 + dx : w;
+  int sy0 = ry0 - dy > 0 ? ry0 - dy : 0, sy1 = ry1 + dy < h ? ry1 + dy : h;
+  const int sw = sx1 - sx0;
+  Image tmp = ImageCreate(sw, sy1 - sy0, img->maxval);
+  if (tmp == NULL) return 0;
+  for (int y = sy0; y < sy1; y++) {
+    memcpy(tmp->pixel + (size_t)(y - sy0) * sw, img->pixel + (size_t)y * w + sx0, sw);
+  }
+  int success = ImageBlur(tmp, dx, dy) && ownPixels(blur);
+  if (success) {
+    for (int y = ry0; y < ry1; y++) {
+      memcpy(blur->pixel + (size_t)y * w + rx0,
+             tmp->pixel + (size_t)(y - sy0) * sw + (rx0 - sx0), rx1 - rx0);
+    }
+    countPixels((unsigned long)sw * (sy1 - sy0) + (unsigned long)(rx1 - rx0) * (ry1 - ry0),
+                2ul * sw * (sy1 - sy0) + 2ul * (rx1 - rx0) * (ry1 - ry0));  // copies
+  }
+  ImageDestroy(&tmp);
+  return success;
+}
+
+/// Blurred copy of an image.
+/// Returns a new image with img blurred as by ImageBlur(img, dx, dy),
+/// without modifying img.
+/// The blurred image is kept with img: when img is only modified in a
+/// region (by ImagePaste, ImageBlend or ImageSetPixel), blurring it again
+/// with the same dx, dy only recomputes the pixels around that region.
+/// (Nothing is kept while the pixels may be written through row pointers:
+/// see ImageRowPtr.)
+/// Requires: dx, dy >= 0.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageBlurred(Image img, int dx, int dy) { ///
+  assert (img != NULL);
+  assert (dx >= 0 && dy >= 0);
+  if (img->tiled) {
+    // Blur a raster copy, keeping the layout of img
+    traceBegin(__func__, img);
+    Image out = rasterCopy(img);
+    if (out != NULL && !ImageBlur(out, dx, dy)) ImageDestroy(&out);
+    traceEnd(out);
+    return out;
+  }
+  if (img->rowsOut) {
+    // The pixels may be written through row pointers: blur them afresh
+    traceBegin(__func__, img);
+    Image out = ImageClone(img);
+    if (out != NULL && !ImageBlur(out, dx, dy)) ImageDestroy(&out);
+    traceEnd(out);
+    return out;
+  }
+  struct derived* c = getCache(img);
+  if (!check(c != NULL, "Out of memory for blur")) return NULL;
+  if (c->blur != NULL && (c->dx != dx || c->dy != dy)) dropBlur(img);
+  traceBegin(__func__, img);
+  int success = 1;
+  if (c->blur == NULL) {
+    success = (c->blur = ImageClone(img)) != NULL && ImageBlur(c->blur, dx, dy);
+    if (success) {
+      c->dx = dx; c->dy = dy;
+      c->x0 = c->x1 = 0;
+    } else {
+      dropBlur(img);
     }
+  } else if (c->x0 < c->x1) {
+    success = blurRegion(img, c->blur, dx, dy, c->x0, c->y0, c->x1, c->y1);
+    if (success) c->x0 = c->x1 = 0;
+  }
+  Image out = success ? ImageClone(c->blur) : NULL;
+  traceEnd(out);
+  return out;
+}
+
+
+/// Convolution
+
+// Kernel weights are converted to fixed-point integers with FIXBITS
+// fractional bits, so the per-pixel arithmetic is done on integers only.
+// Inner loops run along a row, with the kernel tap in the outer loop,
+// so that the compiler can vectorize them across pixels.
+#define FIXBITS 12
+#define FIXONE (1 << FIXBITS)
+
+// The row pass of a separable convolution keeps its results with MIDBITS
+// fractional bits, so that the column pass fits in 32-bit accumulators.
+#define MIDBITS 4
+
+// Bounds on the sums of absolute weights of kernels, so that sums of
+// weighted pixels fit in 32-bit accumulators: FIXONE*255*CONVMAXSUM < 2^31
+// for a 2D kernel, and the column pass of a separable one sums up to
+// SEPMAXSUM times the results of the row pass, with MIDBITS more bits.
+#define SEPMAXSUM 8
+#define CONVMAXSUM 2048
+
+// Sum of the absolute values of n weights.
+static double sumAbs(const double* w, int n) {
+  double sum = 0.0;
+  for (int i = 0; i < n; i++) sum += fabs(w[i]);
+  return sum;
+}
+
+// Round to the nearest integer (halves away from zero).
+static long roundHalf(double v) {
+  return (long)(v < 0.0 ? v - 0.5 : v + 0.5);
+}
+
+// Saturate a level to [0, maxval].
+static inline uint8 saturate(int32_t v, int maxval) {
+  return (uint8)(v < 0 ? 0 : (v > maxval ? maxval : v));
+}
+
+// Convert n weights w[] (multiplied by scale) to fixed point in q[].
+// Rounding errors are carried over to the next weight, so the quantized
+// weights add up to the rounded sum of the originals.
+// (A normalized kernel stays exactly normalized.)
+static void quantizeKernel(const double* w, int n, double scale, int32_t* q) {
+  double acc = 0.0;
+  long prev = 0;
+  for (int i = 0; i < n; i++) {
+    acc += w[i] * scale * FIXONE;
+    long cur = roundHalf(acc);
+    q[i] = (int32_t)(cur - prev);
+    prev = cur;
   }
+}
+
+// Allocate and return a fixed-point copy of n kernel weights.
+// Returns NULL if there is no memory.
+static int32_t* kernelFixed(const double* w, int n) {
+  int32_t* q = (int32_t*)malloc(sizeof(int32_t) * n);
+  if (q != NULL) quantizeKernel(w, n, 1.0, q);
+  return q;
+}
 
-  for (int x = 0; x < w; x++){
-    for (int y = 0; y < h; y++){
-      CountBlur+=1;
-      
-      int xM = (x+dx<w-1) ? x+dx : w-1;
-      int xm = (x-dx>0) ? x-dx : 0;
-      int yM = (y+dy<h-1) ? y+dy : h-1;
-      int ym = (y-dy>0) ? y-dy : 0;
-      int count = (xM-xm +1)*(yM-ym+1); 
+// Scale factor for a kernel truncated at the image border.
+// Taps outside the image are dropped and the remaining ones are rescaled to
+// keep the kernel sum, just as ImageBlur divides by the number of pixels
+// inside the window.  Kernels that sum to zero are not rescaled.
+static double borderScale(double sum, double sumIn) {
+  if (sum == 0.0 || sumIn == 0.0 || (sum > 0.0) != (sumIn > 0.0)) return 1.0;
+  return sum / sumIn;
+}
 
+// Fixed-point taps of a 1D kernel along an axis with n samples.
+// Positions less than r = nk/2 samples away from either end have their own
+// truncated copy of the kernel (with zeros for taps outside [0, n)).
+struct taps {
+  int nk;           // number of taps (odd)
+  int r;            // radius
+  int n;            // number of samples along the axis
+  int32_t* full;    // nk taps for interior positions
+  int32_t* border;  // 2r rows of nk taps for border positions
+};
 
-      // Searches in array the value of the sum
-      uint32_t a = (ym < 1 || xm < 1 ) ? 0 : sum[ym -1][xm -1];
-      uint32_t b = ym < 1 ? 0 : sum[ym - 1][xM];
-      uint32_t c = xm < 1 ? 0 : sum[yM][xm-1];
-      uint32_t d = sum[yM][xM];
-      // Subtracts the areas of outside the area we are calculating, adding afterwards the area that was twice removed
-      double soma = (double) d-b-c+a;
-      // Sets the value of the pixel we want, rounded
-      ImageSetPixel(img , x, y, (uint8)((soma+count/2)/count));
+// Build the taps for kernel k[0..nk-1] on an axis with n samples.
+// Returns 0 if there is no memory.
+static int tapsInit(struct taps* t, const double* k, int nk, int n) {
+  t->nk = nk;
+  t->r = nk / 2;
+  t->n = n;
+  t->full = (int32_t*)malloc(sizeof(int32_t) * nk * (2*t->r + 1));
+  if (t->full == NULL) return 0;
+  t->border = t->full + nk;
+  quantizeKernel(k, nk, 1.0, t->full);
+  double sum = 0.0;
+  for (int j = 0; j < nk; j++) sum += k[j];
+  double kin[nk];
+  for (int b = 0; b < 2*t->r; b++) {
+    // b < r: position b; otherwise: position n-r+(b-r)
+    int i = (b < t->r) ? b : n - 2*t->r + b;
+    double sumIn = 0.0;
+    for (int j = 0; j < nk; j++) {
+      int p = i - t->r + j;
+      kin[j] = (0 <= p && p < n) ? k[j] : 0.0;
+      sumIn += kin[j];
     }
+    // Rescaling must not take the truncated kernel beyond SEPMAXSUM
+    double scale = borderScale(sum, sumIn);
+    if (scale * sumAbs(kin, nk) > SEPMAXSUM) scale = 1.0;
+    quantizeKernel(kin, nk, scale, t->border + b*nk);
   }
-  
+  return 1;
+}
+
+// Taps to use at position i.
+static inline const int32_t* tapsAt(const struct taps* t, int i) {
+  if (i < t->r) return t->border + i*t->nk;
+  if (i >= t->n - t->r) return t->border + (i - t->n + 2*t->r)*t->nk;
+  return t->full;
+}
+
+// Row pass: convolve a row src[0..w-1] with taps tx into dst[0..w-1],
+// with MIDBITS fractional bits.
+static void convolveRow(const uint8* restrict src, int w, const struct taps* tx,
+                        int32_t* restrict dst) {
+  const int nk = tx->nk, r = tx->r;
+  const int shift = FIXBITS - MIDBITS;
+  const int32_t half = 1 << (shift - 1);
+  int xl = r < w ? r : w;             // end of left border
+  int xr = w - r > xl ? w - r : xl;   // start of right border
+  // Interior: vectorizable across pixels
+  for (int x = xl; x < xr; x++) dst[x] = half;
+  for (int j = 0; j < nk; j++) {
+    const int32_t c = tx->full[j];
+    const uint8* s = src + j - r;
+    for (int x = xl; x < xr; x++) dst[x] += c * s[x];
+  }
+  for (int x = xl; x < xr; x++) dst[x] >>= shift;
+  // Borders: skip taps outside the row
+  for (int x = 0; x < w; x++) {
+    if (x == xl) x = xr;
+    if (x >= w) break;
+    const int32_t* t = tapsAt(tx, x);
+    int j0 = r - x > 0 ? r - x : 0;
+    int j1 = w - x + r < nk ? w - x + r : nk;
+    int32_t acc = half;
+    for (int j = j0; j < j1; j++) acc += t[j] * src[x - r + j];
+    dst[x] = acc >> shift;
+  }
+}
+
+// Shared state of a convolution job
+struct convJob {
+  const uint8* src;   // source pixels
+  uint8* dst;         // destination pixels (a different array)
+  int w, h, maxval;
+  struct taps tx, ty; // separable kernel
+  const int32_t* k;   // 2D kernel (nkx*nky fixed-point weights)
+  int nkx, nky;
+  double sum;         // sum of 2D kernel weights
+};
+
+// Convolve the rows [y0, y1) of a separable convolution job.
+// Each band keeps a ring of the last nky row pass results, so every source
+// row is passed once per band (plus 2r overlapping rows).
+static int convolveSeparableBand(void* arg, int y0, int y1) {
+  struct convJob* job = (struct convJob*)arg;
+  const int w = job->w, h = job->h, nk = job->ty.nk, r = job->ty.r;
+  const int shift = FIXBITS + MIDBITS;
+  const int32_t half = 1 << (shift - 1);
+  int32_t* ring = (int32_t*)malloc(sizeof(int32_t) * (size_t)w * (nk + 1));
+  if (ring == NULL) return 0;
+  int32_t* acc = ring + (size_t)w * nk;
+  int next = y0 - r > 0 ? y0 - r : 0;   // next row for the row pass
+  for (int y = y0; y < y1; y++) {
+    int last = y + r < h - 1 ? y + r : h - 1;
+    for (; next <= last; next++) {
+      convolveRow(job->src + (size_t)next * w, w, &job->tx, ring + (size_t)(next % nk) * w);
+    }
+    const int32_t* t = tapsAt(&job->ty, y);
+    for (int x = 0; x < w; x++) acc[x] = half;
+    for (int j = 0; j < nk; j++) {
+      int yy = y - r + j;
+      if (yy < 0 || yy >= h || t[j] == 0) continue;
+      const int32_t c = t[j];
+      const int32_t* restrict row = ring + (size_t)(yy % nk) * w;
+      for (int x = 0; x < w; x++) acc[x] += c * row[x];
+    }
+    uint8* restrict out = job->dst + (size_t)y * w;
+    for (int x = 0; x < w; x++) out[x] = saturate(acc[x] >> shift, job->maxval);
+  }
+  free(ring);
+  return 1;
+}
+
+// 2D convolution at a single pixel (x, y) near the border:
+// taps outside the image are dropped and the rest rescaled.
+static uint8 convolve2DAt(const struct convJob* job, int x, int y) {
+  const int rx = job->nkx / 2, ry = job->nky / 2;
+  long acc = 0, sumIn = 0;
+  for (int j = 0; j < job->nky; j++) {
+    int yy = y - ry + j;
+    if (yy < 0 || yy >= job->h) continue;
+    for (int i = 0; i < job->nkx; i++) {
+      int xx = x - rx + i;
+      if (xx < 0 || xx >= job->w) continue;
+      int32_t c = job->k[j*job->nkx + i];
+      acc += (long)c * job->src[(size_t)yy * job->w + xx];
+      sumIn += c;
+    }
+  }
+  double v = acc * borderScale(job->sum, (double)sumIn / FIXONE) / FIXONE;
+  return saturate((int32_t)roundHalf(v), job->maxval);
+}
+
+// Convolve the rows [y0, y1) of a 2D convolution job.
+static int convolve2DBand(void* arg, int y0, int y1) {
+  struct convJob* job = (struct convJob*)arg;
+  const int w = job->w, h = job->h;
+  const int nkx = job->nkx, nky = job->nky, rx = nkx / 2, ry = nky / 2;
+  const int32_t half = 1 << (FIXBITS - 1);
+  int32_t* acc = (int32_t*)malloc(sizeof(int32_t) * (size_t)w);
+  if (acc == NULL) return 0;
+  int xl = rx < w ? rx : w;
+  int xr = w - rx > xl ? w - rx : xl;
+  for (int y = y0; y < y1; y++) {
+    uint8* restrict out = job->dst + (size_t)y * w;
+    if (y < ry || y >= h - ry) {
+      for (int x = 0; x < w; x++) out[x] = convolve2DAt(job, x, y);
+      continue;
+    }
+    for (int x = xl; x < xr; x++) acc[x] = half;
+    for (int j = 0; j < nky; j++) {
+      const uint8* row = job->src + (size_t)(y - ry + j) * w - rx;
+      for (int i = 0; i < nkx; i++) {
+        const int32_t c = job->k[j*nkx + i];
+        const uint8* restrict s = row + i;
+        for (int x = xl; x < xr; x++) acc[x] += c * s[x];
+      }
+    }
+    for (int x = xl; x < xr; x++) out[x] = saturate(acc[x] >> FIXBITS, job->maxval);
+    for (int x = 0; x < xl; x++) out[x] = convolve2DAt(job, x, y);
+    for (int x = xr; x < w; x++) out[x] = convolve2DAt(job, x, y);
+  }
+  free(acc);
+  return 1;
 }
 
+/// Convolve an image with a separable kernel.
+/// Rows are convolved with kernel kx[0..nkx-1], then columns with kernel
+/// ky[0..nky-1].  Kernels are centered: tap nk/2 weighs the pixel itself.
+/// Near the borders, taps falling outside the image are dropped and the
+/// others rescaled to keep the kernel sum (as ImageBlur does).
+/// Results are rounded and saturated to [0, maxval].
+/// The image is changed in-place.
+/// Requires: nkx and nky are odd.
+///   The sums of absolute weights of kx and ky must not exceed 8 each.
+///   (Near the borders, taps are not rescaled beyond that bound.)
+///
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set and img is not modified.
+int ImageConvolveSeparable(Image img, const double* kx, int nkx,
+                           const double* ky, int nky) { ///
+  assert (img != NULL);
+  assert (kx != NULL && nkx > 0 && nkx % 2 == 1);
+  assert (ky != NULL && nky > 0 && nky % 2 == 1);
+  assert (sumAbs(kx, nkx) <= SEPMAXSUM && sumAbs(ky, nky) <= SEPMAXSUM);
+  if (!rasterLayout(img)) return 0;
+  int w = img->width, h = img->height;
+  if (w == 0 || h == 0) return 1;
+  struct convJob job = { .src = img->pixel, .w = w, .h = h, .maxval = img->maxval };
+  job.tx.full = job.ty.full = NULL;
 
+  traceBegin(__func__, img);
+  int success =
+  check( tapsInit(&job.tx, kx, nkx, w) && tapsInit(&job.ty, ky, nky, h),
+         "Out of memory for kernel" ) &&
+  check( (job.dst = newPixels((size_t)w * h)) != NULL,
+         "Out of memory for convolution" ) &&
+  check( parallelBands(w, h, convolveSeparableBand, &job),
+         "Out of memory for convolution" );
+  countPixels((unsigned long)w * h, (unsigned long)w * h * (nkx + 1));  // row pass reads + stores
 
+  // Cleanup
+  free(job.tx.full);
+  free(job.ty.full);
+  if (success) {
+    setPixels(img, job.dst);
+  } else {
+    free(job.dst);
+  }
+  traceEnd(NULL);
+  return success;
+}
+
+/// Convolve an image with a small 2D kernel.
+/// k[j*nkx + i] is the weight at column i and row j of a nkx x nky kernel,
+/// centered on the pixel, as in ImageConvolveSeparable.
+/// Borders are handled, and results rounded, as in ImageConvolveSeparable.
+/// The image is changed in-place.
+/// Requires: nkx and nky are odd.
+///   The sum of absolute weights of k must not exceed 2048.
+///
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set and img is not modified.
+int ImageConvolve(Image img, const double* k, int nkx, int nky) { ///
+  assert (img != NULL);
+  assert (k != NULL);
+  assert (nkx > 0 && nkx % 2 == 1);
+  assert (nky > 0 && nky % 2 == 1);
+  assert (sumAbs(k, nkx*nky) <= CONVMAXSUM);
+  if (!rasterLayout(img)) return 0;
+  int w = img->width, h = img->height;
+  if (w == 0 || h == 0) return 1;
+  struct convJob job = { .src = img->pixel, .w = w, .h = h, .maxval = img->maxval,
+                         .nkx = nkx, .nky = nky, .sum = 0.0 };
+  int32_t* q = NULL;
+  for (int i = 0; i < nkx*nky; i++) job.sum += k[i];
+
+  traceBegin(__func__, img);
+  int success =
+  check( (job.k = q = kernelFixed(k, nkx*nky)) != NULL, "Out of memory for kernel" ) &&
+  check( (job.dst = newPixels((size_t)w * h)) != NULL,
+         "Out of memory for convolution" ) &&
+  check( parallelBands(w, h, convolve2DBand, &job),
+         "Out of memory for convolution" );
+  countPixels((unsigned long)w * h, (unsigned long)w * h * (nkx*nky + 1));  // reads + stores
+
+  // Cleanup
+  free(q);
+  if (success) {
+    setPixels(img, job.dst);
+  } else {
+    free(job.dst);
+  }
+  traceEnd(NULL);
+  return success;
+}
+
+
+/// Gaussian blur
+
+// A Gaussian filter is approximated by three successive box (mean) filters,
+// each applied to rows and then to columns.  Box filters use sliding sums,
+// so the cost per pixel does not depend on the radius (nor on sigma).
+// Windows are clamped to the image, and each mean is rounded as in
+// ImageBlur: (sum+count/2)/count.
+// Intermediate passes keep GAUSSBITS fractional bits in 16-bit scratch
+// buffers holding a row or a block of GAUSSLANES columns, not whole images.
+#define GAUSSBITS 8
+#define GAUSSLANES 16
+
+// Box filter with radius r along n samples, each a group of `lanes`
+// independent values: sample i of lane b is in[i*lanes + b].
+// Results go to out, which must not overlap in.
+// The inner loops run across lanes, so they can be vectorized.
+static void boxPass(const uint16_t* restrict in, uint16_t* restrict out,
+                    int n, int lanes, int r) {
+  uint32_t sum[lanes];
+  for (int b = 0; b < lanes; b++) sum[b] = 0;
+  int hi = r < n - 1 ? r : n - 1;
+  for (int i = 0; i <= hi; i++) {
+    for (int b = 0; b < lanes; b++) sum[b] += in[i*lanes + b];
+  }
+  for (int i = 0; i < n; i++) {
+    int lo = i - r > 0 ? i - r : 0;
+    hi = i + r < n - 1 ? i + r : n - 1;
+    uint32_t count = (uint32_t)(hi - lo + 1);
+    for (int b = 0; b < lanes; b++) out[i*lanes + b] = (uint16_t)((sum[b] + count/2) / count);
+    // slide the window
+    if (i + r + 1 < n) {
+      for (int b = 0; b < lanes; b++) sum[b] += in[(i+r+1)*lanes + b];
+    }
+    if (i - r >= 0) {
+      for (int b = 0; b < lanes; b++) sum[b] -= in[(i-r)*lanes + b];
+    }
+  }
+}
+
+// Radii of the three box filters approximating a Gaussian with given sigma.
+// Box widths are the odd integers around the ideal width, mixed so that the
+// variance of the cascade matches sigma^2.
+// See: P. Kovesi, "Fast Almost-Gaussian Filtering", DICTA 2010.
+static void gaussRadii(double sigma, int radius[3]) {
+  const int n = 3;
+  double var = 12.0 * sigma * sigma;
+  int wl = (int)sqrt(var / n + 1.0);
+  if (wl % 2 == 0) wl--;
+  int m = (int)roundHalf((var - n*wl*wl - 4*n*wl - 3*n) / (-4.0*wl - 4.0));
+  for (int i = 0; i < n; i++) {
+    int width = i < m ? wl : wl + 2;
+    radius[i] = (width - 1) / 2;
+  }
+}
+
+// Shared state of a Gaussian blur job
+struct gaussJob {
+  uint8* pixel;
+  int w, h, maxval;
+  int radius[3];
+};
+
+// Blur the rows [y0, y1) horizontally, in-place.
+static int gaussRowsBand(void* arg, int y0, int y1) {
+  struct gaussJob* job = (struct gaussJob*)arg;
+  const int w = job->w;
+  const uint16_t half = 1 << (GAUSSBITS - 1);
+  uint16_t* buf = (uint16_t*)malloc(sizeof(uint16_t) * 2 * (size_t)w);
+  if (buf == NULL) return 0;
+  for (int y = y0; y < y1; y++) {
+    uint8* row = job->pixel + (size_t)y * w;
+    uint16_t* a = buf;
+    uint16_t* b = buf + w;
+    for (int x = 0; x < w; x++) a[x] = (uint16_t)(row[x] << GAUSSBITS);
+    for (int p = 0; p < 3; p++) {
+      boxPass(a, b, w, 1, job->radius[p]);
+      uint16_t* t = a; a = b; b = t;
+    }
+    for (int x = 0; x < w; x++) row[x] = saturate((a[x] + half) >> GAUSSBITS, job->maxval);
+  }
+  free(buf);
+  return 1;
+}
+
+// Blur the blocks of columns [b0, b1) vertically, in-place.
+// Block k has the columns [k*GAUSSLANES, (k+1)*GAUSSLANES).
+static int gaussColsBand(void* arg, int b0, int b1) {
+  struct gaussJob* job = (struct gaussJob*)arg;
+  const int w = job->w, h = job->h;
+  const uint16_t half = 1 << (GAUSSBITS - 1);
+  uint16_t* buf = (uint16_t*)malloc(sizeof(uint16_t) * 2 * GAUSSLANES * (size_t)h);
+  if (buf == NULL) return 0;
+  for (int k = b0; k < b1; k++) {
+    int x0 = k * GAUSSLANES;
+    int lanes = w - x0 < GAUSSLANES ? w - x0 : GAUSSLANES;
+    uint16_t* a = buf;
+    uint16_t* b = buf + GAUSSLANES * (size_t)h;
+    for (int y = 0; y < h; y++) {
+      const uint8* src = job->pixel + (size_t)y * w + x0;
+      for (int i = 0; i < lanes; i++) a[y*lanes + i] = (uint16_t)(src[i] << GAUSSBITS);
+    }
+    for (int p = 0; p < 3; p++) {
+      boxPass(a, b, h, lanes, job->radius[p]);
+      uint16_t* t = a; a = b; b = t;
+    }
+    for (int y = 0; y < h; y++) {
+      uint8* dst = job->pixel + (size_t)y * w + x0;
+      for (int i = 0; i < lanes; i++) dst[i] = saturate((a[y*lanes + i] + half) >> GAUSSBITS, job->maxval);
+    }
+  }
+  free(buf);
+  return 1;
+}
+
+/// Blur an image with an approximate Gaussian filter of deviation sigma.
+/// The filter is a cascade of three mean filters (as in ImageBlur) applied
+/// to rows and columns, so the cost does not depend on sigma.
+/// The image is changed in-place.
+/// Requires: sigma >= 0.
+///
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set and the image may have
+/// been blurred along rows only.
+int ImageGaussianBlur(Image img, double sigma) { ///
+  assert (img != NULL);
+  assert (sigma >= 0.0);
+  if (!rasterLayout(img)) return 0;
+  int w = img->width, h = img->height;
+  struct gaussJob job = { .w = w, .h = h, .maxval = img->maxval };
+  gaussRadii(sigma, job.radius);
+  if (w == 0 || h == 0 || job.radius[0] + job.radius[1] + job.radius[2] == 0) return 1;
+  int blocks = (w + GAUSSLANES - 1) / GAUSSLANES;
+  // Blur in-place
+  if (!ownPixels(img)) return 0;
+  dropCache(img);
+  job.pixel = img->pixel;
+
+  traceBegin(__func__, img);
+  int success =
+  check( parallelBands(w, h, gaussRowsBand, &job), "Out of memory for blur" ) &&
+  // Column blocks are split among threads (counting pixels in a long)
+  check( parallelSplit(blocks, threadsFor((long)GAUSSLANES * h * blocks), gaussColsBand, &job),
+         "Out of memory for blur" );
+  countPixels((unsigned long)w * h, 4ul * w * h);  // one read and one store per pixel in each direction
+  traceEnd(NULL);
+  return success;
+}
+
+
+/// Median filter
+
+// The median filter uses the constant-time algorithm of
+// S. Perreault and P. Hebert, "Median Filtering in Constant Time",
+// IEEE Trans. Image Processing 16(9), 2007.
+//
+// Each band keeps one histogram per column, counting the levels of the
+// pixels in that column within the window rows.  Moving down a row adds one
+// pixel to and removes one from each column histogram.
+// Along a row, the window histogram is the sum of 2dx+1 column histograms.
+// Histograms have two levels: a coarse one, with 16 bins for the 4 high
+// bits of the level, and a fine one with 256 bins.  The coarse window
+// histogram is updated at every step, while each group of 16 fine bins is
+// only brought up to date when the median falls into it.
+#define COARSE 16
+
+// Shared state of a median job
+struct medianJob {
+  const uint8* src;
+  uint8* dst;
+  int w, h;
+  int dx, dy;
+};
+
+// Add (sign=1) or subtract (sign=-1) the fine bins of group c of columns
+// [x0, x1] to the window histogram fine[] (16 bins).
+static void medianFine(uint32_t* restrict fine, const uint16_t* restrict colFine,
+                       int c, int x0, int x1, int sign) {
+  for (int x = x0; x <= x1; x++) {
+    const uint16_t* f = colFine + (size_t)x * 256 + c * COARSE;
+    for (int i = 0; i < COARSE; i++) fine[i] += sign * f[i];
+  }
+}
+
+// Median filter the rows [y0, y1) of a median job.
+static int medianBand(void* arg, int y0, int y1) {
+  struct medianJob* job = (struct medianJob*)arg;
+  const int w = job->w, h = job->h, dx = job->dx, dy = job->dy;
+  // Column histograms: fine and coarse bins of column x
+  uint16_t* colFine = (uint16_t*)calloc((size_t)w * (256 + COARSE), sizeof(uint16_t));
+  if (colFine == NULL) return 0;
+  uint16_t* colCoarse = colFine + (size_t)w * 256;
+
+  // Window histogram, and window position of each fine group
+  uint32_t coarse[COARSE];
+  uint32_t fine[COARSE][COARSE];
+  int lo[COARSE], hi[COARSE];
+
+  int top = y0 - dy > 0 ? y0 - dy : 0;
+  int bottom = y0 + dy < h - 1 ? y0 + dy : h - 1;
+  for (int yy = top; yy <= bottom; yy++) {
+    const uint8* row = job->src + (size_t)yy * w;
+    for (int x = 0; x < w; x++) {
+      colFine[(size_t)x * 256 + row[x]]++;
+      colCoarse[x * COARSE + (row[x] >> 4)]++;
+    }
+  }
+  for (int y = y0; y < y1; y++) {
+    if (y > y0) {
+      // Slide column histograms down one row
+      if (y + dy < h) {
+        const uint8* row = job->src + (size_t)(y + dy) * w;
+        for (int x = 0; x < w; x++) {
+          colFine[(size_t)x * 256 + row[x]]++;
+          colCoarse[x * COARSE + (row[x] >> 4)]++;
+        }
+        bottom++;
+      }
+      if (y - dy - 1 >= 0) {
+        const uint8* row = job->src + (size_t)(y - dy - 1) * w;
+        for (int x = 0; x < w; x++) {
+          colFine[(size_t)x * 256 + row[x]]--;
+          colCoarse[x * COARSE + (row[x] >> 4)]--;
+        }
+        top++;
+      }
+    }
+    int rows = bottom - top + 1;
+
+    // Start the window at the left border
+    int x1 = dx < w - 1 ? dx : w - 1;
+    for (int c = 0; c < COARSE; c++) {
+      coarse[c] = 0;
+      lo[c] = 0; hi[c] = -1;   // empty: fine group not computed yet
+    }
+    for (int x = 0; x <= x1; x++) {
+      for (int c = 0; c < COARSE; c++) coarse[c] += colCoarse[x * COARSE + c];
+    }
+
+    uint8* out = job->dst + (size_t)y * w;
+    for (int x = 0; x < w; x++) {
+      int wlo = x - dx > 0 ? x - dx : 0;
+      int whi = x + dx < w - 1 ? x + dx : w - 1;
+      uint32_t rank = ((uint32_t)(whi - wlo + 1) * rows - 1) / 2;
+      // Find the coarse bin containing the median
+      int c = 0;
+      while (rank >= coarse[c]) rank -= coarse[c++];
+      // Bring that fine group up to date
+      if (hi[c] < wlo) {   // nothing to reuse
+        for (int i = 0; i < COARSE; i++) fine[c][i] = 0;
+        medianFine(fine[c], colFine, c, wlo, whi, 1);
+      } else {
+        medianFine(fine[c], colFine, c, lo[c], wlo - 1, -1);
+        medianFine(fine[c], colFine, c, hi[c] + 1, whi, 1);
+      }
+      lo[c] = wlo; hi[c] = whi;
+      // Find the fine bin containing the median
+      int i = 0;
+      while (rank >= fine[c][i]) rank -= fine[c][i++];
+      out[x] = (uint8)(c * COARSE + i);
+      // Slide the coarse window histogram one column right
+      if (x + dx + 1 < w) {
+        for (int k = 0; k < COARSE; k++) coarse[k] += colCoarse[(x + dx + 1) * COARSE + k];
+      }
+      if (x - dx >= 0) {
+        for (int k = 0; k < COARSE; k++) coarse[k] -= colCoarse[(x - dx) * COARSE + k];
+      }
+    }
+  }
+  free(colFine);
+  return 1;
+}
+
+/// Apply a (2dx+1)x(2dy+1) median filter to an image.
+/// Each pixel is substituted by the median of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy] that are inside the image.
+/// When the number of such pixels is even, the lower median is used.
+/// The cost per pixel does not depend on dx, dy.
+/// The image is changed in-place.
+/// Requires: dx, dy >= 0 and 2dy+1 < 65536.
+///
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set and img is not modified.
+int ImageMedian(Image img, int dx, int dy) { ///
+  assert (img != NULL);
+  assert (dx >= 0 && dy >= 0);
+  assert (dy < 32767);
+  if (!rasterLayout(img)) return 0;
+  int w = img->width, h = img->height;
+  if (w == 0 || h == 0) return 1;
+  struct medianJob job = { .src = img->pixel, .w = w, .h = h, .dx = dx, .dy = dy };
+
+  traceBegin(__func__, img);
+  int success =
+  check( (job.dst = newPixels((size_t)w * h)) != NULL, "Out of memory for median" ) &&
+  check( parallelBands(w, h, medianBand, &job), "Out of memory for median" );
+  countPixels((unsigned long)w * h, 3ul * w * h);  // added and removed from histograms, stored
+
+  // Cleanup
+  if (success) {
+    setPixels(img, job.dst);
+  } else {
+    free(job.dst);
+  }
+  traceEnd(NULL);
+  return success;
+}
+
+
+/// Morphology
+
+// Erosion (dilation) replaces each pixel by the minimum (maximum) level in
+// a (2dx+1)x(2dy+1) rectangle clamped to the image.  The rectangle is
+// separable, so rows and then columns are filtered with 1D windows.
+// Each 1D pass uses the algorithm of van Herk and Gil & Werman: the line is
+// cut into blocks of the window size k=2r+1, and a window covering parts
+// of two blocks is the combination of a suffix of one and a prefix of the
+// other.  That takes 3 comparisons per pixel, whatever the window size.
+// Columns are filtered in blocks of MORPHLANES, vectorized across columns.
+#define MORPHLANES 32
+
+#define MORPHMIN(a, b) ((a) < (b) ? (a) : (b))
+#define MORPHMAX(a, b) ((a) > (b) ? (a) : (b))
+
+// Define a 1D pass `name` with operator `op` (min or max) and identity
+// `pad`, used for positions outside the image.
+// The pass filters n samples with window radius r, in-place, where sample
+// i of lane b is data[i*lanes + b].  buf must hold 3*morphLength(n,r)*lanes
+// bytes.
+#define MORPHPASS(name, op, pad)                                          \
+static void name(uint8* restrict data, int n, int lanes, int r,          \
+                 uint8* restrict buf) {                                  \
+  const int k = 2*r + 1;                                                 \
+  const int m = morphLength(n, r);                                       \
+  uint8* p = buf;                         /* padded input */             \
+  uint8* pre = buf + (size_t)m * lanes;   /* prefix op within block */   \
+  uint8* suf = pre + (size_t)m * lanes;   /* suffix op within block */   \
+  memset(p, pad, (size_t)r * lanes);                                     \
+  memcpy(p + (size_t)r * lanes, data, (size_t)n * lanes);                \
+  memset(p + (size_t)(n + r) * lanes, pad, (size_t)(m - n - r) * lanes); \
+  for (int j = 0; j < m; j++) {                                          \
+    uint8* c = pre + (size_t)j * lanes;                                  \
+    const uint8* v = p + (size_t)j * lanes;                              \
+    if (j % k == 0) {                                                    \
+      memcpy(c, v, lanes);                                               \
+    } else {                                                             \
+      for (int b = 0; b < lanes; b++) c[b] = op(c[b - lanes], v[b]);     \
+    }                                                                    \
+  }                                                                      \
+  for (int j = m - 1; j >= 0; j--) {                                     \
+    uint8* c = suf + (size_t)j * lanes;                                  \
+    const uint8* v = p + (size_t)j * lanes;                              \
+    if (j % k == k - 1) {                                                \
+      memcpy(c, v, lanes);                                               \
+    } else {                                                             \
+      for (int b = 0; b < lanes; b++) c[b] = op(c[b + lanes], v[b]);     \
+    }                                                                    \
+  }                                                                      \
+  for (int i = 0; i < n; i++) {                                          \
+    uint8* d = data + (size_t)i * lanes;                                 \
+    const uint8* s = suf + (size_t)i * lanes;                            \
+    const uint8* e = pre + (size_t)(i + 2*r) * lanes;                    \
+    for (int b = 0; b < lanes; b++) d[b] = op(s[b], e[b]);               \
+  }                                                                      \
+}
+
+// Length of the padded line: n plus r on each side, rounded up to a
+// multiple of the window size.
+static inline int morphLength(int n, int r) {
+  int k = 2*r + 1;
+  return (n + 2*r + k - 1) / k * k;
+}
+
+MORPHPASS(erodePass, MORPHMIN, 0xFF)
+MORPHPASS(dilatePass, MORPHMAX, 0x00)
+
+// Shared state of a morphology job
+struct morphJob {
+  uint8* pixel;
+  int w, h;
+  int dx, dy;
+  void (*pass)(uint8* restrict, int, int, int, uint8* restrict);
+};
+
+// Filter the rows [y0, y1) in-place.
+static int morphRowsBand(void* arg, int y0, int y1) {
+  struct morphJob* job = (struct morphJob*)arg;
+  uint8* buf = (uint8*)malloc(3 * (size_t)morphLength(job->w, job->dx));
+  if (buf == NULL) return 0;
+  for (int y = y0; y < y1; y++) {
+    job->pass(job->pixel + (size_t)y * job->w, job->w, 1, job->dx, buf);
+  }
+  free(buf);
+  return 1;
+}
+
+// Filter the blocks of columns [b0, b1) in-place.
+// Block k has the columns [k*MORPHLANES, (k+1)*MORPHLANES).
+static int morphColsBand(void* arg, int b0, int b1) {
+  struct morphJob* job = (struct morphJob*)arg;
+  const int w = job->w, h = job->h;
+  size_t m = (size_t)morphLength(h, job->dy);
+  uint8* col = (uint8*)malloc(MORPHLANES * ((size_t)h + 3*m));
+  if (col == NULL) return 0;
+  uint8* buf = col + MORPHLANES * (size_t)h;
+  for (int k = b0; k < b1; k++) {
+    int x0 = k * MORPHLANES;
+    int lanes = w - x0 < MORPHLANES ? w - x0 : MORPHLANES;
+    for (int y = 0; y < h; y++) {
+      memcpy(col + (size_t)y * lanes, job->pixel + (size_t)y * w + x0, lanes);
+    }
+    job->pass(col, h, lanes, job->dy, buf);
+    for (int y = 0; y < h; y++) {
+      memcpy(job->pixel + (size_t)y * w + x0, col + (size_t)y * lanes, lanes);
+    }
+  }
+  free(col);
+  return 1;
+}
+
+// Erode (dilate=0) or dilate (dilate=1) img in-place.
+static int morph(Image img, int dx, int dy, int dilate) {
+  int w = img->width, h = img->height;
+  struct morphJob job = { .w = w, .h = h, .dx = dx, .dy = dy,
+                          .pass = dilate ? dilatePass : erodePass };
+  if (w == 0 || h == 0) return 1;
+  int blocks = (w + MORPHLANES - 1) / MORPHLANES;
+  // Filter in-place
+  if (!rasterLayout(img) || !ownPixels(img)) return 0;
+  dropCache(img);
+  job.pixel = img->pixel;
+  traceBegin(dilate ? "ImageDilate" : "ImageErode", img);
+
+  int success =
+  check( dx == 0 || parallelBands(w, h, morphRowsBand, &job), "Out of memory for morphology" ) &&
+  // Column blocks are split among threads (counting pixels in a long)
+  check( dy == 0 || parallelSplit(blocks, threadsFor((long)MORPHLANES * h * blocks), morphColsBand, &job),
+         "Out of memory for morphology" );
+  countPixels((unsigned long)w * h, 4ul * w * h);  // one read and one store per pixel in each direction
+  traceEnd(NULL);
+  return success;
+}
+
+/// Erode an image with a (2dx+1)x(2dy+1) rectangle.
+/// Each pixel is substituted by the minimum of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy] that are inside the image.
+/// The image is changed in-place.
+/// Requires: dx, dy >= 0.
+///
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set and the image may have
+/// been eroded along rows only.
+int ImageErode(Image img, int dx, int dy) { ///
+  assert (img != NULL);
+  assert (dx >= 0 && dy >= 0);
+  return morph(img, dx, dy, 0);
+}
+
+/// Dilate an image with a (2dx+1)x(2dy+1) rectangle.
+/// Each pixel is substituted by the maximum of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy] that are inside the image.
+/// The image is changed in-place.
+/// Requires: dx, dy >= 0.
+///
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set and the image may have
+/// been dilated along rows only.
+int ImageDilate(Image img, int dx, int dy) { ///
+  assert (img != NULL);
+  assert (dx >= 0 && dy >= 0);
+  return morph(img, dx, dy, 1);
+}
+
+/// Morphological opening: erode, then dilate, with the same rectangle.
+/// Removes bright details smaller than the rectangle.
+/// Success and failure are treated as in ImageErode.
+int ImageOpen(Image img, int dx, int dy) { ///
+  assert (img != NULL);
+  assert (dx >= 0 && dy >= 0);
+  return morph(img, dx, dy, 0) && morph(img, dx, dy, 1);
+}
+
+/// Morphological closing: dilate, then erode, with the same rectangle.
+/// Removes dark details smaller than the rectangle.
+/// Success and failure are treated as in ImageErode.
+int ImageClose(Image img, int dx, int dy) { ///
+  assert (img != NULL);
+  assert (dx >= 0 && dy >= 0);
+  return morph(img, dx, dy, 1) && morph(img, dx, dy, 0);
+}
+
+
+/// Connected components
+
+// Labeling uses union-find on pixel indices, kept in the label array
+// itself: during labeling, the entry of a foreground pixel i is p+1, where
+// p is its parent, and p == i for the root of a tree.  Parents always come
+// before their children in raster order (a new pixel joins an earlier
+// neighbour, and a union links the later root to the earlier one), so
+// the root of a component is its first pixel.
+// 1. Bands of rows are labeled in parallel, each looking only at its own
+//    rows, so they write disjoint parts of the array.
+// 2. The first row of each band is merged with the last row of the band
+//    above it.
+// 3. A raster scan replaces each entry with its final label: a root gets
+//    the next label, and any other pixel the final label of its parent,
+//    which comes before it.  Statistics are gathered along the way.
+
+// Shared state of a labeling job
+struct labelJob {
+  const uint8* pixel;
+  uint32_t* label;
+  int w, h;
+  int eight;                  // 8-connectivity
+  atomic_int nbands;          // number of bands labeled
+  int start[MAXTHREADS];      // first row of each band
+};
+
+// Root of the tree of pixel i, halving the path on the way.
+static size_t labelFind(uint32_t* label, size_t i) {
+  while (label[i] - 1 != i) {
+    size_t p = label[i] - 1;
+    label[i] = label[p];
+    i = p;
+  }
+  return i;
+}
+
+// Join the trees of foreground pixels i and j.
+static void labelUnion(uint32_t* label, size_t i, size_t j) {
+  i = labelFind(label, i);
+  j = labelFind(label, j);
+  if (i < j) label[j] = (uint32_t)(i + 1);
+  else if (j < i) label[i] = (uint32_t)(j + 1);
+}
+
+// Join foreground pixel i to foreground neighbour n (which comes before it).
+static inline void labelJoin(uint32_t* label, size_t i, size_t n) {
+  if (label[i] == 0) label[i] = label[n];   // first neighbour: same parent
+  else labelUnion(label, i, n);
+}
+
+// Join the pixels of row y to their neighbours in row y-1.
+static void labelRowAbove(struct labelJob* job, int y) {
+  const int w = job->w;
+  const uint8* row = job->pixel + (size_t)y * w;
+  const uint8* up = row - w;
+  size_t i = (size_t)y * w;
+  for (int x = 0; x < w; x++, i++) {
+    if (row[x] == 0) continue;
+    if (job->eight && x > 0 && up[x-1] != 0) labelUnion(job->label, i, i - w - 1);
+    if (up[x] != 0) labelUnion(job->label, i, i - w);
+    if (job->eight && x + 1 < w && up[x+1] != 0) labelUnion(job->label, i, i - w + 1);
+  }
+}
+
+// Label the rows [y0, y1), considering only neighbours in these rows.
+static int labelBand(void* arg, int y0, int y1) {
+  struct labelJob* job = (struct labelJob*)arg;
+  const int w = job->w, eight = job->eight;
+  uint32_t* label = job->label;
+  job->start[atomic_fetch_add(&job->nbands, 1)] = y0;
+  for (int y = y0; y < y1; y++) {
+    const uint8* row = job->pixel + (size_t)y * w;
+    const uint8* up = y > y0 ? row - w : NULL;
+    size_t i = (size_t)y * w;
+    for (int x = 0; x < w; x++, i++) {
+      label[i] = 0;
+      if (row[x] == 0) continue;
+      if (x > 0 && row[x-1] != 0) labelJoin(label, i, i - 1);
+      if (up != NULL) {
+        if (eight && x > 0 && up[x-1] != 0) labelJoin(label, i, i - w - 1);
+        if (up[x] != 0) labelJoin(label, i, i - w);
+        if (eight && x + 1 < w && up[x+1] != 0) labelJoin(label, i, i - w + 1);
+      }
+      if (label[i] == 0) label[i] = (uint32_t)(i + 1);   // a new root
+    }
+  }
+  return 1;
+}
+
+/// Label the connected components of the foreground of img.
+/// Foreground pixels are those with a nonzero level (as in the result of
+/// ImageThreshold), connected to their 4 (connectivity==4) or 8
+/// (connectivity==8) neighbours.
+/// Components are numbered from 1, in the raster order of their first
+/// pixel.  On return, *labels points to a new width*height array, in
+/// raster order, with the label of each pixel (0 for the background), and
+/// *stats to a new array with the statistics of component i in
+/// (*stats)[i-1].  (The caller is responsible for freeing both arrays!)
+/// Rows are labeled by bands in parallel, and then merged.
+/// Requires: connectivity is 4 or 8; img has less than 2^32 pixels.
+///
+/// On success, returns the number of components (possibly 0).
+/// On failure, returns -1, errno/errCause are set and *labels and *stats
+/// are left untouched.
+int ImageLabel(Image img, int connectivity, uint32_t** labels, ImageComponent** stats) { ///
+  assert (img != NULL);
+  assert (connectivity == 4 || connectivity == 8);
+  assert (labels != NULL && stats != NULL);
+  assert ((unsigned long)img->width * img->height < UINT32_MAX);
+  if (img->tiled) {
+    // Read a raster copy, keeping the layout of img
+    Image r = rasterCopy(img);
+    int res = r != NULL ? ImageLabel(r, connectivity, labels, stats) : -1;
+    rasterDone(img, r);
+    return res;
+  }
+  const int w = img->width, h = img->height;
+  const size_t size = (size_t)w * h;
+  struct labelJob job = { .pixel = img->pixel, .w = w, .h = h, .eight = connectivity == 8 };
+  atomic_init(&job.nbands, 0);
+  // Per component sums, grown as needed
+  int n = 0, cap = 64;
+  ImageComponent* comp = NULL;
+  double* sum = NULL;   // sums of x and y of each component
+  traceBegin(__func__, img);
+  int success =
+  check( (job.label = (uint32_t*)malloc(sizeof(uint32_t) * (size > 0 ? size : 1))) != NULL, "Out of memory for labels" ) &&
+  check( (comp = (ImageComponent*)malloc(sizeof(ImageComponent) * cap)) != NULL, "Out of memory for labels" ) &&
+  check( (sum = (double*)malloc(sizeof(double) * 2 * cap)) != NULL, "Out of memory for labels" );
+  if (success) {
+    parallelBands(w, h, labelBand, &job);
+    for (int b = 0; b < atomic_load(&job.nbands); b++) {
+      if (job.start[b] > 0) labelRowAbove(&job, job.start[b]);
+    }
+  }
+  uint32_t* label = job.label;
+  for (size_t i = 0; success && i < size; i++) {
+    if (label[i] == 0) continue;
+    int x = (int)(i % w), y = (int)(i / w);
+    uint32_t p = label[i] - 1;
+    if (p == i) {
+      // A root: start a new component
+      if (n == cap) {
+        ImageComponent* c2 = (ImageComponent*)realloc(comp, sizeof(ImageComponent) * 2 * cap);
+        if (c2 != NULL) comp = c2;
+        double* s2 = c2 != NULL ? (double*)realloc(sum, sizeof(double) * 4 * cap) : NULL;
+        if (s2 != NULL) sum = s2;
+        if (!check(s2 != NULL, "Out of memory for labels")) {
+          success = 0;
+          break;
+        }
+        cap *= 2;
+      }
+      comp[n] = (ImageComponent){ .area = 0, .x = x, .y = y, .width = 1, .height = 1 };
+      sum[2*n] = sum[2*n+1] = 0.0;
+      label[i] = (uint32_t)++n;
+    } else {
+      label[i] = label[p];   // already final
+    }
+    // Add pixel (x, y) to its component
+    ImageComponent* c = &comp[label[i] - 1];
+    c->area++;
+    if (x < c->x) { c->width += c->x - x; c->x = x; }
+    if (x >= c->x + c->width) c->width = x - c->x + 1;
+    if (y >= c->y + c->height) c->height = y - c->y + 1;
+    sum[2*(label[i] - 1)] += x;
+    sum[2*(label[i] - 1) + 1] += y;
+  }
+  countPixels(size, 3 * size);   // reads + stores of labels
+  traceEnd(NULL);
+  if (!success) {
+    free(job.label);
+    free(comp);
+    free(sum);
+    return -1;
+  }
+  for (int k = 0; k < n; k++) {
+    comp[k].cx = sum[2*k] / comp[k].area;
+    comp[k].cy = sum[2*k+1] / comp[k].area;
+  }
+  free(sum);
+  *labels = label;
+  *stats = comp;
+  return n;
+}
+
+
+/// Distance transform
+
+// The exact Euclidean distance transform is separable (Felzenszwalb and
+// Huttenlocher, "Distance Transforms of Sampled Functions"):
+// 1. Along columns, the distance to the nearest foreground pixel of the
+//    column, g(x, y), takes a forward and a backward sweep.  Columns are
+//    handled in blocks of EDTBLOCK, sweeping a block row by row, so that
+//    accesses are contiguous; blocks are split among threads.
+// 2. Along rows, the squared distance is the lower envelope of the
+//    parabolas (x - i)^2 + g(i, y)^2, found in linear time for each row;
+//    bands of rows are split among threads.
+// Both passes work in the output array, which holds g and then the
+// squared distances.
+#define EDTBLOCK 256
+#define EDTINF UINT32_MAX
+
+// Shared state of a distance transform job
+struct edtJob {
+  const uint8* pixel;
+  uint32_t* dist;
+  int w, h;
+};
+
+// Column pass, on the blocks of columns [b0, b1).
+static int edtColsBand(void* arg, int b0, int b1) {
+  const struct edtJob* job = (const struct edtJob*)arg;
+  const int w = job->w, h = job->h;
+  for (int b = b0; b < b1; b++) {
+    int x0 = b * EDTBLOCK, n = w - x0 < EDTBLOCK ? w - x0 : EDTBLOCK;
+    // Forward: distance to the nearest foreground pixel above (or at y)
+    for (int y = 0; y < h; y++) {
+      const uint8* p = job->pixel + (size_t)y * w + x0;
+      uint32_t* d = job->dist + (size_t)y * w + x0;
+      if (y == 0) {
+        for (int i = 0; i < n; i++) d[i] = p[i] != 0 ? 0 : EDTINF;
+        continue;
+      }
+      const uint32_t* up = d - w;
+      for (int i = 0; i < n; i++) {
+        d[i] = p[i] != 0 ? 0 : up[i] == EDTINF ? EDTINF : up[i] + 1;
+      }
+    }
+    // Backward: or below
+    for (int y = h - 2; y >= 0; y--) {
+      uint32_t* d = job->dist + (size_t)y * w + x0;
+      const uint32_t* down = d + w;
+      for (int i = 0; i < n; i++) {
+        if (down[i] != EDTINF && down[i] + 1 < d[i]) d[i] = down[i] + 1;
+      }
+    }
+  }
+  return 1;
+}
+
+// Row pass, on the rows [y0, y1).
+static int edtRowsBand(void* arg, int y0, int y1) {
+  const struct edtJob* job = (const struct edtJob*)arg;
+  const int w = job->w;
+  // Parabola k has its vertex at v[k] with height f[k], and is the lowest
+  // one in [z[k], z[k+1]).
+  int* v = (int*)malloc(sizeof(int) * (size_t)w);
+  double* f = (double*)malloc(sizeof(double) * (size_t)w);
+  double* z = (double*)malloc(sizeof(double) * ((size_t)w + 1));
+  int ok = v != NULL && f != NULL && z != NULL;
+  for (int y = y0; ok && y < y1; y++) {
+    uint32_t* d = job->dist + (size_t)y * w;
+    int k = -1;
+    for (int q = 0; q < w; q++) {
+      if (d[q] == EDTINF) continue;   // no parabola
+      double fq = (double)d[q] * d[q];
+      double s = -HUGE_VAL;
+      while (k >= 0) {
+        s = ((fq + (double)q * q) - (f[k] + (double)v[k] * v[k])) / (2.0 * (q - v[k]));
+        if (s > z[k]) break;
+        k--;   // parabola k is hidden by q
+      }
+      k++;
+      v[k] = q;
+      f[k] = fq;
+      z[k] = k == 0 ? -HUGE_VAL : s;
+    }
+    if (k < 0) continue;   // no foreground at all: distances stay EDTINF
+    z[k + 1] = HUGE_VAL;
+    for (int x = 0, j = 0; x < w; x++) {
+      while (z[j + 1] < x) j++;
+      double dx = x - v[j];
+      d[x] = (uint32_t)(dx * dx + f[j]);
+    }
+  }
+  free(v);
+  free(f);
+  free(z);
+  return ok;
+}
+
+/// Squared Euclidean distance from each pixel to the nearest foreground
+/// (nonzero) pixel of img.
+/// Returns a new width*height array, in raster order, with the exact
+/// squared distances (0 on the foreground), or UINT32_MAX everywhere if
+/// img has no foreground.
+/// (The caller is responsible for freeing the returned array!)
+/// Requires: width*width + height*height < 2^32.
+/// On failure, returns NULL and errno/errCause are set accordingly.
+uint32_t* ImageDistanceSquared(Image img) { ///
+  assert (img != NULL);
+  assert ((double)img->width * img->width + (double)img->height * img->height < 4294967296.0);
+  if (img->tiled) {
+    // Read a raster copy, keeping the layout of img
+    Image r = rasterCopy(img);
+    uint32_t* res = r != NULL ? ImageDistanceSquared(r) : NULL;
+    rasterDone(img, r);
+    return res;
+  }
+  const int w = img->width, h = img->height;
+  struct edtJob job = { .pixel = img->pixel, .w = w, .h = h };
+  int blocks = (w + EDTBLOCK - 1) / EDTBLOCK;
+  traceBegin(__func__, img);
+  int success =
+  check( (job.dist = (uint32_t*)malloc(sizeof(uint32_t) * ((size_t)w * h > 0 ? (size_t)w * h : 1))) != NULL,
+         "Out of memory for distance transform" ) &&
+  // Column blocks are split among threads as if they were rows
+  check( parallelSplit(blocks, threadsFor((long)w * h), edtColsBand, &job), "Out of memory for distance transform" ) &&
+  check( parallelBands(w, h, edtRowsBand, &job), "Out of memory for distance transform" );
+  countPixels((unsigned long)w * h, 6ul * w * h);  // reads + stores of both passes
+  traceEnd(NULL);
+  if (!success) {
+    free(job.dist);
+    return NULL;
+  }
+  return job.dist;
+}
+
+/// Euclidean distance transform.
+/// Returns a new image with the distance from each pixel to the nearest
+/// foreground (nonzero) pixel of img, rounded to the nearest integer and
+/// saturated at PixMax (which is also the distance if there is no
+/// foreground).  The maxval of the result is PixMax.
+/// Requires: width*width + height*height < 2^32.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageDistanceTransform(Image img) { ///
+  assert (img != NULL);
+  uint32_t* dist = ImageDistanceSquared(img);
+  if (dist == NULL) return NULL;
+  const int w = img->width, h = img->height;
+  Image out = ImageCreate(w, h, PixMax);
+  if (out != NULL) {
+    // round(sqrt(d)) <= r exactly when d < (r + 1/2)^2, i.e. d <= r*r + r
+    const uint32_t maxd = (uint32_t)PixMax * PixMax + PixMax;
+    for (size_t i = 0; i < (size_t)w * h; i++) {
+      uint32_t d = dist[i];
+      if (d > maxd) {
+        out->pixel[i] = PixMax;
+      } else {
+        int r = (int)sqrt((double)d);
+        if (d > (uint32_t)(r * r + r)) r++;
+        out->pixel[i] = (uint8)r;
+      }
+    }
+    countPixels((unsigned long)w * h, 2ul * w * h);  // reads + stores
+  }
+  free(dist);
+  return out;
+}
+
+
+/// Edge detection
+
+// The Sobel operator is computed in a single pass over the rows, in bands.
+// Each row of the result is computed from three rows of the source (the
+// row and its neighbours, replicated at the top and bottom borders) by a
+// row kernel, which also does the thresholding, if any.  The pixels at the
+// left and right borders are computed separately, by sobelAt.
+
+// Shared state of a Sobel job
+struct sobelJob {
+  const uint8* src;
+  uint8* dst;
+  int w, h;
+  int l2, thr;
+};
+
+// Sobel result at pixel (x, y), replicating the borders of the image.
+static uint8 sobelAt(const struct sobelJob* job, int x, int y) {
+  // Copy the 3x3 neighbourhood and apply the row kernel to it
+  uint8 nb[3][3], out[3];
+  for (int j = 0; j < 3; j++) {
+    int yy = y + j - 1 < 0 ? 0 : y + j - 1 >= job->h ? job->h - 1 : y + j - 1;
+    for (int i = 0; i < 3; i++) {
+      int xx = x + i - 1 < 0 ? 0 : x + i - 1 >= job->w ? job->w - 1 : x + i - 1;
+      nb[j][i] = job->src[(size_t)yy * job->w + xx];
+    }
+  }
+  kern->sobelRow(nb[0], nb[1], nb[2], out, 3, job->l2, job->thr);
+  return out[1];
+}
+
+// Sobel results for the rows [y0, y1).
+static int sobelBand(void* arg, int y0, int y1) {
+  const struct sobelJob* job = (const struct sobelJob*)arg;
+  const int w = job->w, h = job->h;
+  for (int y = y0; y < y1; y++) {
+    const uint8* row = job->src + (size_t)y * w;
+    const uint8* above = y > 0 ? row - w : row;
+    const uint8* below = y < h - 1 ? row + w : row;
+    uint8* out = job->dst + (size_t)y * w;
+    kern->sobelRow(above, row, below, out, w, job->l2, job->thr);
+    out[0] = sobelAt(job, 0, y);
+    out[w - 1] = sobelAt(job, w - 1, y);
+  }
+  return 1;
+}
+
+/// Sobel edge detector.
+/// Returns a new image with the norm of the gradient of img at each pixel,
+/// computed with the 3x3 Sobel operators (borders replicated) and saturated
+/// at PixMax.  If thr >= 0, the result is thresholded in the same pass:
+/// pixels with a norm >= thr are white (PixMax) and the others black (0).
+/// The maxval of the result is PixMax.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageSobel(Image img, SobelNorm norm, int thr) { ///
+  assert (img != NULL);
+  assert (norm == SOBEL_L1 || norm == SOBEL_L2);
+  if (img->tiled) {
+    // Read a raster copy, keeping the layout of img
+    Image r = rasterCopy(img);
+    Image res = r != NULL ? ImageSobel(r, norm, thr) : NULL;
+    rasterDone(img, r);
+    return res;
+  }
+  const int w = img->width, h = img->height;
+  traceBegin(__func__, img);
+  Image out = ImageCreate(w, h, PixMax);
+  if (out != NULL && w > 0) {
+    struct sobelJob job = { .src = img->pixel, .dst = out->pixel, .w = w, .h = h,
+                            .l2 = norm == SOBEL_L2, .thr = thr };
+    parallelBands(w, h, sobelBand, &job);
+    countPixels((unsigned long)w * h, 9ul * w * h);  // reads + store
+  }
+  traceEnd(out);
+  return out;
+}
+
+
+/// Binary images
+
+// A binary image stores one bit per pixel, packed in 64-bit words.
+// Each row starts at a new word; within a row, pixel x is bit 63-(x%64) of
+// word x/64 (leftmost pixel in the most significant bit, as in PBM files).
+// Bits past the width in the last word of a row are always 0.
+// Bit 1 means foreground: a level >= threshold, shown as white (maxval).
+struct bitimage {
+  int width;
+  int height;
+  int stride;      // words per row
+  uint64_t* word;  // bits (a raster scan of rows)
+};
+
+// Mask of the valid bits in the last word of a row.
+static inline uint64_t lastMask(int width) {
+  int r = width % 64;
+  return r == 0 ? ~(uint64_t)0 : ~(uint64_t)0 << (64 - r);
+}
+
+// Pointer to row y of bimg.
+static inline uint64_t* bitRow(BitImage bimg, int y) {
+  return bimg->word + (size_t)y * bimg->stride;
+}
+
+/// Create a new binary image with all bits 0.
+/// Requires: width and height must be non-negative.
+///
+/// On success, a new binary image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+BitImage BitImageCreate(int width, int height) { ///
+  assert (width >= 0);
+  assert (height >= 0);
+  BitImage bimg = (BitImage)malloc(sizeof(struct bitimage));
+  if (!check(bimg != NULL, "Memory couldn't be allocated for new image!")) {
+    return NULL;
+  }
+  bimg->width = width;
+  bimg->height = height;
+  bimg->stride = (width + 63) / 64;
+  bimg->word = (uint64_t*)calloc((size_t)bimg->stride * height + 1, sizeof(uint64_t));
+  if (!check(bimg->word != NULL, "Memory couldn't be allocated for new image!")) {
+    free(bimg);
+    return NULL;
+  }
+  return bimg;
+}
+
+/// Destroy the binary image pointed to by (*bimgp).
+/// If (*bimgp)==NULL, no operation is performed.
+/// Ensures: (*bimgp)==NULL.
+void BitImageDestroy(BitImage* bimgp) { ///
+  assert (bimgp != NULL);
+  if (*bimgp != NULL) {
+    free((*bimgp)->word);
+    free(*bimgp);
+    *bimgp = NULL;
+  }
+}
+
+/// Get binary image width
+int BitImageWidth(BitImage bimg) { ///
+  assert (bimg != NULL);
+  return bimg->width;
+}
+
+/// Get binary image height
+int BitImageHeight(BitImage bimg) { ///
+  assert (bimg != NULL);
+  return bimg->height;
+}
+
+/// Get the bit (0 or 1) at position (x,y).
+int BitImageGetBit(BitImage bimg, int x, int y) { ///
+  assert (bimg != NULL);
+  assert (0 <= x && x < bimg->width && 0 <= y && y < bimg->height);
+  return (int)(bitRow(bimg, y)[x / 64] >> (63 - x % 64)) & 1;
+}
+
+/// Set the bit at position (x,y) to bit (0 or 1).
+void BitImageSetBit(BitImage bimg, int x, int y, int bit) { ///
+  assert (bimg != NULL);
+  assert (0 <= x && x < bimg->width && 0 <= y && y < bimg->height);
+  uint64_t mask = (uint64_t)1 << (63 - x % 64);
+  uint64_t* word = bitRow(bimg, y) + x / 64;
+  *word = bit ? (*word | mask) : (*word & ~mask);
+}
+
+/// Threshold an image directly into a new binary image.
+/// Pixels with level>=thr get bit 1, others get bit 0, as in ImageThreshold.
+/// The image is not modified.
+///
+/// On success, a new binary image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+BitImage ImageToBits(Image img, uint8 thr) { ///
+  assert (img != NULL);
+  if (img->tiled) {
+    // Read a raster copy, keeping the layout of img
+    Image r = rasterCopy(img);
+    BitImage res = r != NULL ? ImageToBits(r, thr) : NULL;
+    rasterDone(img, r);
+    return res;
+  }
+  int w = img->width;
+  BitImage bimg = BitImageCreate(w, img->height);
+  if (bimg == NULL) return NULL;
+  for (int y = 0; y < img->height; y++) {
+    const uint8* src = img->pixel + (size_t)y * w;
+    uint64_t* dst = bitRow(bimg, y);
+    for (int k = 0; k < bimg->stride; k++) {
+      int n = w - 64*k < 64 ? w - 64*k : 64;
+      uint64_t word = 0;
+      for (int i = 0; i < n; i++) word |= (uint64_t)(src[64*k + i] >= thr) << (63 - i);
+      dst[k] = word;
+    }
+  }
+  countPixels((unsigned long)w * img->height, (unsigned long)w * img->height);  // count pixel memory accesses
+  return bimg;
+}
+
+/// Convert a binary image to a new image.
+/// Bits 1 become maxval (white) and bits 0 become 0 (black).
+/// Requires: maxval > 0.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image BitsToImage(BitImage bimg, uint8 maxval) { ///
+  assert (bimg != NULL);
+  int w = bimg->width;
+  Image img = ImageCreate(w, bimg->height, maxval);
+  if (img == NULL) return NULL;
+  for (int y = 0; y < bimg->height; y++) {
+    const uint64_t* src = bitRow(bimg, y);
+    uint8* dst = img->pixel + (size_t)y * w;
+    for (int x = 0; x < w; x++) {
+      dst[x] = (uint8)(-(int)((src[x / 64] >> (63 - x % 64)) & 1) & maxval);
+    }
+  }
+  countPixels((unsigned long)w * bimg->height, (unsigned long)w * bimg->height);  // count pixel memory accesses
+  return img;
+}
+
+/// Bitwise operations
+
+/// These combine two binary images of the same size, 64 pixels at a time,
+/// storing the result in bimg1.  bimg2 is not modified.
+
+/// bimg1 = bimg1 AND bimg2
+void BitImageAnd(BitImage bimg1, BitImage bimg2) { ///
+  assert (bimg1 != NULL && bimg2 != NULL);
+  assert (bimg1->width == bimg2->width && bimg1->height == bimg2->height);
+  size_t n = (size_t)bimg1->stride * bimg1->height;
+  for (size_t i = 0; i < n; i++) bimg1->word[i] &= bimg2->word[i];
+}
+
+/// bimg1 = bimg1 OR bimg2
+void BitImageOr(BitImage bimg1, BitImage bimg2) { ///
+  assert (bimg1 != NULL && bimg2 != NULL);
+  assert (bimg1->width == bimg2->width && bimg1->height == bimg2->height);
+  size_t n = (size_t)bimg1->stride * bimg1->height;
+  for (size_t i = 0; i < n; i++) bimg1->word[i] |= bimg2->word[i];
+}
+
+/// bimg1 = bimg1 XOR bimg2
+void BitImageXor(BitImage bimg1, BitImage bimg2) { ///
+  assert (bimg1 != NULL && bimg2 != NULL);
+  assert (bimg1->width == bimg2->width && bimg1->height == bimg2->height);
+  size_t n = (size_t)bimg1->stride * bimg1->height;
+  for (size_t i = 0; i < n; i++) bimg1->word[i] ^= bimg2->word[i];
+}
+
+/// bimg = NOT bimg
+void BitImageNot(BitImage bimg) { ///
+  assert (bimg != NULL);
+  if (bimg->stride == 0) return;
+  uint64_t mask = lastMask(bimg->width);
+  for (int y = 0; y < bimg->height; y++) {
+    uint64_t* row = bitRow(bimg, y);
+    for (int k = 0; k < bimg->stride; k++) row[k] = ~row[k];
+    row[bimg->stride - 1] &= mask;   // keep padding bits 0
+  }
+}
+
+/// Count the pixels with bit 1 (the foreground area).
+long BitImageCount(BitImage bimg) { ///
+  assert (bimg != NULL);
+  long count = 0;
+  size_t n = (size_t)bimg->stride * bimg->height;
+  for (size_t i = 0; i < n; i++) count += __builtin_popcountll(bimg->word[i]);
+  return count;
+}
+
+// 64 bits of row starting at pixel x.
+// Bits past the row end come from the next row (or from the extra word
+// allocated after the last row), so callers must mask them out.
+static inline uint64_t bitsAt(const uint64_t* row, int x) {
+  int s = x % 64;
+  const uint64_t* p = row + x / 64;
+  return s == 0 ? p[0] : (p[0] << s) | (p[1] >> (64 - s));
+}
+
+// Compare bimg2 to the subimage of bimg1 at (x, y), 64 pixels at a time.
+static int bitMatchAt(BitImage bimg1, int x, int y, BitImage bimg2) {
+  const int n = bimg2->stride;
+  const uint64_t mask = lastMask(bimg2->width);
+  for (int j = 0; j < bimg2->height; j++) {
+    const uint64_t* row1 = bitRow(bimg1, y + j);
+    const uint64_t* row2 = bitRow(bimg2, j);
+    for (int k = 0; k < n; k++) {
+      uint64_t diff = bitsAt(row1, x + 64*k) ^ row2[k];
+      if (k == n - 1) diff &= mask;
+      if (diff != 0) return 0;
+    }
+  }
+  return 1;
+}
+
+/// Locate a binary subimage inside another binary image.
+/// Searches for bimg2 inside bimg1, comparing 64 pixels at a time.
+/// If a match is found, returns 1 and matching position is set in vars (*px, *py).
+/// If no match is found, returns 0 and (*px, *py) are left untouched.
+/// The position returned is the first in x-major order, as in
+/// ImageLocateSubImage.
+int BitImageLocate(BitImage bimg1, int* px, int* py, BitImage bimg2) { ///
+  assert (bimg1 != NULL);
+  assert (bimg2 != NULL);
+  for (int x = 0; x <= bimg1->width - bimg2->width; x++) {
+    for (int y = 0; y <= bimg1->height - bimg2->height; y++) {
+      if (bitMatchAt(bimg1, x, y, bimg2)) {
+        *px = x;
+        *py = y;
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+// PBM files store rows of bits packed into bytes, most significant bit
+// first, and 1 means black.  Bits are complemented on load and save,
+// so that foreground (white) pixels are 0 in the file.
+
+// Store n bytes of a row of bits, as in a PBM file, into buf.
+static void bitRowToBytes(const uint64_t* row, int n, uint8* buf) {
+  for (int i = 0; i < n; i++) buf[i] = (uint8)~(row[i / 8] >> (56 - 8 * (i % 8)));
+}
+
+// Load n bytes of a row of bits, as in a PBM file, from buf.
+static void bitRowFromBytes(uint64_t* row, int n, const uint8* buf, uint64_t mask, int stride) {
+  for (int k = 0; k < stride; k++) row[k] = 0;
+  for (int i = 0; i < n; i++) row[i / 8] |= (uint64_t)(uint8)~buf[i] << (56 - 8 * (i % 8));
+  if (stride > 0) row[stride - 1] &= mask;
+}
+
+/// Load a raw PBM (P4) file.
+/// PBM black pixels (bit 1 in the file) become bits 0, and vice-versa.
+/// On success, a new binary image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+BitImage BitImageLoad(const char* filename) { ///
+  int w, h;
+  char c;
+  FILE* f = NULL;
+  BitImage bimg = NULL;
+  uint8* buf = NULL;
+
+  int success =
+  check( (f = fopen(filename, "rb")) != NULL, "Open failed" ) &&
+  // Parse PBM header
+  check( fscanf(f, "P%c ", &c) == 1 && c == '4' , "Invalid file format" ) &&
+  skipComments(f) >= 0 &&
+  check( fscanf(f, "%d ", &w) == 1 && w >= 0 , "Invalid width" ) &&
+  skipComments(f) >= 0 &&
+  check( fscanf(f, "%d", &h) == 1 && h >= 0 , "Invalid height" ) &&
+  check( fscanf(f, "%c", &c) == 1 && isspace(c) , "Whitespace expected" ) &&
+  // Allocate image
+  (bimg = BitImageCreate(w, h)) != NULL &&
+  check( (buf = (uint8*)malloc((size_t)(w + 7) / 8 + 1)) != NULL, "Out of memory" );
+  // Read bits, row by row
+  int n = (w + 7) / 8;
+  for (int y = 0; success && y < h; y++) {
+    success = check( fread(buf, 1, n, f) == (size_t)n, "Reading pixels" );
+    if (success) bitRowFromBytes(bitRow(bimg, y), n, buf, lastMask(w), bimg->stride);
+  }
+
+  // Cleanup
+  free(buf);
+  if (!success) {
+    errsave = errno;
+    BitImageDestroy(&bimg);
+    errno = errsave;
+  }
+  if (f != NULL) fclose(f);
+  return bimg;
+}
+
+/// Save binary image to a raw PBM (P4) file.
+/// Bits 1 are saved as white pixels, bits 0 as black pixels.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// a partial and invalid file may be left in the system.
+int BitImageSave(BitImage bimg, const char* filename) { ///
+  assert (bimg != NULL);
+  int w = bimg->width;
+  int h = bimg->height;
+  int n = (w + 7) / 8;
+  FILE* f = NULL;
+  uint8* buf = NULL;
+
+  int success =
+  check( (buf = (uint8*)malloc((size_t)n + 1)) != NULL, "Out of memory" ) &&
+  check( (f = fopen(filename, "wb")) != NULL, "Open failed" ) &&
+  check( fprintf(f, "P4\n%d %d\n", w, h) > 0, "Writing header failed" );
+  for (int y = 0; success && y < h; y++) {
+    bitRowToBytes(bitRow(bimg, y), n, buf);
+    success = check( fwrite(buf, 1, n, f) == (size_t)n, "Writing pixels failed" );
+  }
+
+  // Cleanup
+  free(buf);
+  if (f != NULL) fclose(f);
+  return success;
+}
+
+
+/// Resizing
+
+// Images are resized in two separable passes (rows, then columns), both
+// driven by precomputed coefficient tables.  Output sample X along an axis
+// is the weighted sum of n consecutive source samples starting at start[X],
+// with integer weights adding up to den:
+//   area:     weights are the exact overlaps of the output pixel with each
+//             source pixel, in units of 1/dst source pixels (den = src);
+//   bilinear: two weights with 8 fractional bits (den = 256), sampling at
+//             pixel centers, clamped at the borders;
+//   nearest:  one weight (den = 1).
+// The row pass keeps full sums (no rounding), and the final value is
+// rounded once: (sum + den/2) / den, where den = denX*denY.
+// The column pass runs across output pixels, so it can be vectorized.
+
+// Coefficient table for one axis
+struct resampleTable {
+  int n;             // weights per output sample
+  uint32_t den;      // sum of weights of each output sample
+  int* start;        // first source sample of each output sample
+  uint32_t* weight;  // n weights for each output sample
+};
+
+// Build the table to resample src samples into dst samples.
+// Returns 0 if there is no memory.
+static int resampleInit(struct resampleTable* t, int src, int dst, int method) {
+  if (method == RESAMPLE_AUTO) method = dst < src ? RESAMPLE_AREA : RESAMPLE_BILINEAR;
+  if (src == dst) method = RESAMPLE_NEAREST;
+  int nmax;
+  switch (method) {
+    case RESAMPLE_AREA: nmax = (src + dst - 1) / dst + 1; t->den = (uint32_t)src; break;
+    case RESAMPLE_BILINEAR: nmax = 2; t->den = 256; break;
+    default: nmax = 1; t->den = 1; break;
+  }
+  t->n = nmax < src ? nmax : src;
+  t->start = (int*)malloc(sizeof(int) * dst);
+  t->weight = (uint32_t*)calloc((size_t)dst * t->n, sizeof(uint32_t));
+  if (t->start == NULL || t->weight == NULL) return 0;
+  for (int X = 0; X < dst; X++) {
+    // Nonzero weights wt[0..] for source samples i0, i0+1, ...
+    uint32_t wt[nmax];
+    int i0, cnt;
+    if (method == RESAMPLE_AREA) {
+      long long a = (long long)X * src, b = (long long)(X + 1) * src;
+      i0 = (int)(a / dst);
+      int i1 = (int)((b - 1) / dst);
+      cnt = i1 - i0 + 1;
+      for (int i = i0; i <= i1; i++) {
+        long long lo = (long long)i * dst > a ? (long long)i * dst : a;
+        long long hi = (long long)(i + 1) * dst < b ? (long long)(i + 1) * dst : b;
+        wt[i - i0] = (uint32_t)(hi - lo);
+      }
+    } else if (method == RESAMPLE_BILINEAR) {
+      // Source position of the output pixel center, with 8 fractional bits
+      long long s = ((2ll*X + 1) * src - dst) * 256 / (2ll*dst);
+      if (s < 0) s = 0;
+      i0 = (int)(s >> 8);
+      uint32_t f = (uint32_t)(s & 255);
+      if (i0 >= src - 1) { i0 = src - 1; f = 0; }
+      cnt = f == 0 ? 1 : 2;
+      wt[0] = 256 - f;
+      wt[1] = f;
+    } else {
+      i0 = (int)((2ll*X + 1) * src / (2ll*dst));
+      cnt = 1;
+      wt[0] = 1;
+    }
+    // Fit the window of n samples inside [0, src)
+    int start = i0 < src - t->n ? i0 : src - t->n;
+    t->start[X] = start;
+    for (int k = 0; k < cnt; k++) t->weight[(size_t)X * t->n + i0 - start + k] = wt[k];
+  }
+  return 1;
+}
+
+static void resampleFree(struct resampleTable* t) {
+  free(t->start);
+  free(t->weight);
+}
+
+// Shared state of a resize job
+struct resizeJob {
+  const uint8* src;
+  int sw, sh;
+  Image out;
+  int dw, dh;
+  struct resampleTable tx, ty;
+};
+
+// Resize into the output rows [y0, y1).
+// Row pass results are kept in a ring of ty.n rows, tagged with their
+// source row, so each source row is passed once per band.
+static int resizeBand(void* arg, int y0, int y1) {
+  struct resizeJob* job = (struct resizeJob*)arg;
+  const int dw = job->dw, n = job->ty.n, nx = job->tx.n;
+  const uint64_t den = (uint64_t)job->tx.den * job->ty.den;
+  uint32_t* ring = (uint32_t*)malloc(sizeof(uint32_t) * (size_t)dw * n);
+  uint64_t* acc = (uint64_t*)malloc(sizeof(uint64_t) * (size_t)dw);
+  int tag[n];
+  if (ring == NULL || acc == NULL) {
+    free(ring);
+    free(acc);
+    return 0;
+  }
+  for (int k = 0; k < n; k++) tag[k] = -1;
+  for (int y = y0; y < y1; y++) {
+    const int start = job->ty.start[y];
+    const uint32_t* wy = job->ty.weight + (size_t)y * n;
+    for (int x = 0; x < dw; x++) acc[x] = den / 2;
+    for (int k = 0; k < n; k++) {
+      if (wy[k] == 0) continue;
+      int sy = start + k;
+      uint32_t* row = ring + (size_t)(sy % n) * dw;
+      if (tag[sy % n] != sy) {
+        // Row pass for source row sy
+        const uint8* s = job->src + (size_t)sy * job->sw;
+        for (int x = 0; x < dw; x++) {
+          const uint8* p = s + job->tx.start[x];
+          const uint32_t* wx = job->tx.weight + (size_t)x * nx;
+          uint32_t sum = 0;
+          for (int i = 0; i < nx; i++) sum += wx[i] * p[i];
+          row[x] = sum;
+        }
+        tag[sy % n] = sy;
+      }
+      const uint64_t c = wy[k];
+      for (int x = 0; x < dw; x++) acc[x] += c * row[x];
+    }
+    uint8* out = job->out->pixel + (size_t)y * dw;
+    for (int x = 0; x < dw; x++) out[x] = (uint8)(acc[x] / den);
+  }
+  free(ring);
+  free(acc);
+  return 1;
+}
+
+/// Resize an image to w x h pixels.
+/// method selects how pixels are resampled:
+///   RESAMPLE_AREA: each pixel is the exact mean of the area it covers in
+///     the original image (best for shrinking);
+///   RESAMPLE_BILINEAR: bilinear interpolation between pixel centers (best
+///     for enlarging);
+///   RESAMPLE_NEAREST: the nearest pixel;
+///   RESAMPLE_AUTO: area where an axis shrinks, bilinear where it grows.
+/// Ensures: The original img is not modified.
+/// Requires: w, h > 0 and img is not empty.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageResize(Image img, int w, int h, int method) { ///
+  assert (img != NULL);
+  assert (w > 0 && h > 0);
+  assert (img->width > 0 && img->height > 0);
+  assert (RESAMPLE_AUTO <= method && method <= RESAMPLE_AREA);
+  if (img->tiled) {
+    // Read a raster copy, keeping the layout of img
+    Image r = rasterCopy(img);
+    Image res = r != NULL ? ImageResize(r, w, h, method) : NULL;
+    rasterDone(img, r);
+    return res;
+  }
+  struct resizeJob job = { .src = img->pixel, .sw = img->width, .sh = img->height,
+                           .dw = w, .dh = h };
+  job.tx.start = job.ty.start = NULL;
+  job.tx.weight = job.ty.weight = NULL;
+  traceBegin(__func__, img);
+
+  int success =
+  check( resampleInit(&job.tx, img->width, w, method) &&
+         resampleInit(&job.ty, img->height, h, method), "Out of memory for resize" ) &&
+  (job.out = ImageCreate(w, h, img->maxval)) != NULL &&
+  check( parallelBands(w, h, resizeBand, &job), "Out of memory for resize" );
+  countPixels((unsigned long)w * h, (unsigned long)img->width * img->height + (unsigned long)w * h);
+
+  // Cleanup
+  resampleFree(&job.tx);
+  resampleFree(&job.ty);
+  if (!success) {
+    errsave = errno;
+    ImageDestroy(&job.out);
+    errno = errsave;
+  }
+  traceEnd(job.out);
+  return job.out;
+}
+
+
+/// Affine warping
+
+// Each output pixel center is mapped back to the original image by the
+// inverse transform.  Source coordinates are fixed-point numbers with
+// WARPBITS fractional bits; along a row they are advanced by a constant
+// increment, so there is no floating point per pixel.
+// The output is processed in WARPTILE x WARPTILE tiles, so that the source
+// pixels read by a tile stay in cache whatever the rotation angle, and rows
+// of tiles are split among threads.
+#define WARPBITS 16
+#define WARPTILE 64
+
+// Shared state of a warp job
+struct warpJob {
+  const uint8* src;
+  int sw, sh;
+  Image out;
+  int64_t ux, uy, u0;   // source x = ux*x + uy*y + u0 (fixed point)
+  int64_t vx, vy, v0;   // source y = vx*x + vy*y + v0 (fixed point)
+  int bilinear;
+};
+
+// Warp the rows of tiles [t0, t1).
+static int warpBand(void* arg, int t0, int t1) {
+  struct warpJob* job = (struct warpJob*)arg;
+  const int sw = job->sw, sh = job->sh;
+  const int w = job->out->width, h = job->out->height;
+  const int64_t half = (int64_t)1 << (WARPBITS - 1);
+  for (int ty = t0; ty < t1; ty++) {
+    int y1 = (ty + 1) * WARPTILE < h ? (ty + 1) * WARPTILE : h;
+    for (int x0 = 0; x0 < w; x0 += WARPTILE) {
+      int x1 = x0 + WARPTILE < w ? x0 + WARPTILE : w;
+      for (int y = ty * WARPTILE; y < y1; y++) {
+        uint8* out = job->out->pixel + (size_t)y * w;
+        int64_t u = job->ux * x0 + job->uy * y + job->u0;
+        int64_t v = job->vx * x0 + job->vy * y + job->v0;
+        for (int x = x0; x < x1; x++, u += job->ux, v += job->vx) {
+          // Nearest pixel
+          int64_t i = (u + half) >> WARPBITS;
+          int64_t j = (v + half) >> WARPBITS;
+          if (i < 0 || i >= sw || j < 0 || j >= sh) {
+            out[x] = 0;   // outside the original image: black
+          } else if (!job->bilinear) {
+            out[x] = job->src[(size_t)j * sw + i];
+          } else {
+            // Interpolate the 4 pixels around (u, v), with 8-bit weights,
+            // replicating the border pixels
+            int i0 = (int)(u >> WARPBITS), j0 = (int)(v >> WARPBITS);
+            uint32_t fx = (uint32_t)(u >> (WARPBITS - 8)) & 255;
+            uint32_t fy = (uint32_t)(v >> (WARPBITS - 8)) & 255;
+            int ia = i0 < 0 ? 0 : i0, ib = i0 + 1 < sw ? i0 + 1 : sw - 1;
+            int ja = j0 < 0 ? 0 : j0, jb = j0 + 1 < sh ? j0 + 1 : sh - 1;
+            const uint8* ra = job->src + (size_t)ja * sw;
+            const uint8* rb = job->src + (size_t)jb * sw;
+            uint32_t top = ra[ia] * (256 - fx) + ra[ib] * fx;
+            uint32_t bottom = rb[ia] * (256 - fx) + rb[ib] * fx;
+            out[x] = (uint8)((top * (256 - fy) + bottom * fy + 32768) >> 16);
+          }
+        }
+      }
+    }
+  }
+  return 1;
+}
+
+/// Apply an affine transformation to an image.
+/// The transformation maps each point (x, y) of img to the point
+///   (m[0]*x + m[1]*y + m[2], m[3]*x + m[4]*y + m[5])
+/// of the result, a w x h image.  Coordinates refer to the top left corner
+/// of pixel (0,0), so pixel (x,y) is centered at (x+0.5, y+0.5).
+/// method is RESAMPLE_NEAREST or RESAMPLE_BILINEAR (RESAMPLE_AUTO selects
+/// bilinear).  Result pixels mapped from outside img are black (0).
+/// Ensures: The original img is not modified.
+/// Requires: w, h >= 0 and the transformation is invertible.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageWarpAffine(Image img, const double m[6], int w, int h, int method) { ///
+  assert (img != NULL);
+  assert (m != NULL);
+  assert (w >= 0 && h >= 0);
+  assert (method == RESAMPLE_AUTO || method == RESAMPLE_NEAREST || method == RESAMPLE_BILINEAR);
+  if (img->tiled) {
+    // Read a raster copy, keeping the layout of img
+    Image r = rasterCopy(img);
+    Image res = r != NULL ? ImageWarpAffine(r, m, w, h, method) : NULL;
+    rasterDone(img, r);
+    return res;
+  }
+  double det = m[0]*m[4] - m[1]*m[3];
+  assert (det != 0.0);
+  // Inverse transformation
+  double a = m[4]/det, b = -m[1]/det, c = -m[3]/det, d = m[0]/det;
+  double e = -(a*m[2] + b*m[5]), f = -(c*m[2] + d*m[5]);
+  // Source pixel index coordinates of the center of result pixel (x, y):
+  //   u = a*(x+0.5) + b*(y+0.5) + e - 0.5, and similarly for v
+  const double one = (double)((int64_t)1 << WARPBITS);
+  struct warpJob job = { .src = img->pixel, .sw = img->width, .sh = img->height,
+                         .bilinear = method != RESAMPLE_NEAREST };
+  job.ux = roundHalf(a * one);
+  job.uy = roundHalf(b * one);
+  job.u0 = roundHalf((0.5*a + 0.5*b + e - 0.5) * one);
+  job.vx = roundHalf(c * one);
+  job.vy = roundHalf(d * one);
+  job.v0 = roundHalf((0.5*c + 0.5*d + f - 0.5) * one);
+
+  traceBegin(__func__, img);
+  job.out = ImageCreate(w, h, img->maxval);
+  if (job.out != NULL) {
+    // Rows of tiles are split among threads (counting pixels in a long)
+    int tileRows = (h + WARPTILE - 1) / WARPTILE;
+    parallelSplit(tileRows, threadsFor((long)w * WARPTILE * tileRows), warpBand, &job);
+    countPixels((unsigned long)w * h, 2ul * w * h);  // count pixel memory accesses (nearest pixel)
+  }
+  traceEnd(job.out);
+  return job.out;
+}
+
+/// Rotate an image by an arbitrary angle.
+/// The rotation is counter-clockwise by the given number of degrees, about
+/// the center of the image.  The result is just large enough to contain
+/// the whole rotated image; uncovered pixels are black.
+/// method is as in ImageWarpAffine.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageRotateAngle(Image img, double degrees, int method) { ///
+  assert (img != NULL);
+  double t = degrees * (M_PI / 180.0);
+  double cs = cos(t), sn = sin(t);
+  // Bounding box of the rotated image (ignoring rounding noise)
+  double bw = fabs(img->width * cs) + fabs(img->height * sn);
+  double bh = fabs(img->width * sn) + fabs(img->height * cs);
+  int w = (int)ceil(bw - 1e-6), h = (int)ceil(bh - 1e-6);
+  // Move the center to the origin, rotate (y grows downwards) and
+  // move the origin to the center of the result
+  double cx = img->width / 2.0, cy = img->height / 2.0;
+  double m[6] = {
+    cs, sn, w / 2.0 - cs*cx - sn*cy,
+    -sn, cs, h / 2.0 + sn*cx - cs*cy,
+  };
+  return ImageWarpAffine(img, m, w, h, method);
+}
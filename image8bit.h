@@ -23,6 +23,49 @@ extern const uint8 PixMax;
 // Type Image is a pointer to image objects
 typedef struct image *Image;
 
+// Resampling methods used by geometric transformations
+typedef enum {
+  RESAMPLE_AUTO,      // let the operation choose
+  RESAMPLE_NEAREST,   // nearest pixel
+  RESAMPLE_BILINEAR,  // bilinear interpolation
+  RESAMPLE_AREA,      // mean of the area covered (for shrinking)
+} Resampling;
+
+// Norms of the gradient computed by ImageSobel
+typedef enum {
+  SOBEL_L1,     // |gx| + |gy|
+  SOBEL_L2,     // approximately sqrt(gx^2 + gy^2), within 7%
+} SobelNorm;
+
+// Statistics of a connected component (see ImageLabel)
+typedef struct {
+  long area;                // number of pixels
+  int x, y, width, height;  // bounding box
+  double cx, cy;            // centroid (mean of the pixel positions)
+} ImageComponent;
+
+// Memory layouts of the pixels of an image (see ImageSetLayout)
+typedef enum {
+  LAYOUT_RASTER,    // rows one after the other (a raster scan)
+  LAYOUT_TILED,     // 64x64 tiles one after the other, each a raster scan
+} ImageLayout;
+
+// Where a subimage was found (see ImageLocateMany)
+typedef struct {
+  int found;    // 1 if found, 0 otherwise (x and y are then unspecified)
+  int x, y;     // position of the match
+} ImageMatch;
+
+// Type ImageIndex is a pointer to search index objects (see ImageIndexCreate)
+typedef struct imageIndex *ImageIndex;
+
+// Type BitImage is a pointer to binary (1 bit per pixel) image objects
+typedef struct bitimage *BitImage;
+
+// Type ImageContext is a pointer to the state of the library used by a
+// thread (see ImageContextUse)
+typedef struct imageContext *ImageContext;
+
 /// Error handling functions
 
 /// Error cause.
@@ -33,12 +76,77 @@ typedef struct image *Image;
 ///
 /// After a successful operation, the result is not garanteed (it might be
 /// the previous error cause).  It is not meant to be used in that situation!
+/// Each thread sees the error cause of its own context (see ImageContextUse).
 char* ImageErrMsg() ;
 
 /// Init Image library.  (Call once!)
-/// Currently, simply calibrate instrumentation and set names of counters.
+/// Calibrate instrumentation, set names of counters and select the
+/// kernels for this CPU.
+/// Also reads settings from the environment: IMAGE8BIT_TRACE (see
+/// InstrTraceOpen) and IMAGE8BIT_ALLOC (see ImageSetAlloc).
 void ImageInit(void) ;
 
+/// Name of the instruction set level of the kernels in use:
+/// "scalar", "sse2", "sse41", "avx2", "avx512" (or "generic" on
+/// other architectures).
+/// ImageInit selects the best level supported by the CPU.  The environment
+/// variable IMAGE8BIT_ISA may name a lower level to use instead.
+const char* ImageKernels(void) ;
+
+/// Set the number of threads used by parallel operations (in the calling
+/// thread's context).
+/// n == 0 (the default) uses one thread per online processor.
+void ImageSetThreads(int n) ;
+
+// Allocation policies for large pixel arrays (may be or'ed together)
+enum {
+  ALLOC_HUGEPAGES = 1,    // align to huge pages, and advise the kernel to use them
+  ALLOC_FIRSTTOUCH = 2,   // zero new images by bands of rows, in parallel
+};
+
+/// Set the allocation policy for large pixel arrays (in the calling
+/// thread's context): ALLOC_HUGEPAGES, ALLOC_FIRSTTOUCH, both (or'ed) or
+/// none (0).
+/// Huge pages (the default) cut TLB misses when walking big images; they
+/// are used for arrays of 16 MiB or more, whose size is rounded up to a
+/// whole number of 2 MiB huge pages.
+/// With ALLOC_FIRSTTOUCH, the pages of a new image go to the NUMA nodes of
+/// the threads that zero its bands of rows, as they do for the results of
+/// filters, which are written band by band.
+/// ImageInit reads a policy from the environment variable IMAGE8BIT_ALLOC,
+/// if set: a list of "hugepages" and "firsttouch" (or "none").
+void ImageSetAlloc(int policy) ;
+
+/// Contexts
+
+/// The error cause (ImageErrMsg), the instrumentation counters (InstrCount
+/// and the other state of InstrReset and InstrPrint) and the settings
+/// (ImageSetThreads, ImageSetAlloc) are kept in a context.  Each thread
+/// uses a default context of its own, so threads may run independent
+/// operations concurrently, without locks, each with its own error cause,
+/// counters and settings.  (Images themselves must not be modified by one
+/// thread while used by another.  Converting a tiled image to raster
+/// layout modifies it: see ImageSetLayout.)
+/// A context may also be created, and used by one thread after another,
+/// e.g. to follow a pipeline whose steps run in different threads.
+/// New contexts, including the default ones, start with the settings read
+/// by ImageInit, which must be called before any thread is started.
+
+/// Create a new context, with the default settings and no error cause.
+/// (The caller is responsible for destroying the returned context!)
+/// On failure, returns NULL and errCause is set.
+ImageContext ImageContextCreate(void) ;
+
+/// Destroy the context pointed to by (*ctxp), which no thread may be
+/// using.  If (*ctxp)==NULL, no operation is performed.
+/// Ensures: (*ctxp)==NULL.
+void ImageContextDestroy(ImageContext* ctxp) ;
+
+/// Make the calling thread use context c (NULL: its default context) for
+/// the error cause, the instrumentation counters and the settings.
+/// Returns the context used before (NULL if it was the default one).
+ImageContext ImageContextUse(ImageContext c) ;
+
 /// Image management functions
 
 /// Create a new black image.
@@ -58,6 +166,18 @@ Image ImageCreate(int width, int height, uint8 maxval) ;
 /// Should never fail, and should preserve global errno/errCause.
 void ImageDestroy(Image* imgp) ;
 
+/// Clone an image.
+/// The clone shares the pixels of img until either of them is modified,
+/// and only then are the pixels copied.  So cloning is cheap, and the
+/// original img is not modified by operations on the clone (or vice-versa).
+/// If img has handed out row pointers for writing (see ImageRowPtr), which
+/// may still be written through, the pixels are copied right away.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageClone(Image img) ;
+
 /// PGM file operations
 
 /// Load a raw PGM file.
@@ -91,6 +211,12 @@ int ImageMaxval(Image img) ;
 /// On return,
 /// *min is set to the minimum gray level in the image,
 /// *max is set to the maximum.
+/// (For an image with no pixels, *min and *max are not changed.)
+/// From the second call on, the histogram of the image is kept, and
+/// updated as it is modified by ImagePaste, ImageBlend, ImageSetPixel or
+/// the pixel transformations, so calling this again only costs a scan of
+/// the 256 levels.  (Not while the pixels may be written through row
+/// pointers: see ImageRowPtr.)
 void ImageStats(Image img, uint8* min, uint8* max) ;
 
 /// Check if pixel position (x,y) is inside img.
@@ -110,30 +236,107 @@ int ImageValidRect(Image img, int x, int y, int w, int h) ;
 uint8 ImageGetPixel(Image img, int x, int y) ;
 
 /// Set the pixel at position (x,y) to new level.
+/// If img shares its pixels with a clone, they are copied first: if there
+/// is no memory for that, the pixel is not set and errCause is set.
 void ImageSetPixel(Image img, int x, int y, uint8 level) ;
 
+/// Row access
+
+/// These give direct access to the rows of pixels, for efficient
+/// operations written outside this module.  No bounds are checked on
+/// the pixels of a row: the caller must stay within [0, width).
+/// Pixel accesses are counted once per row, as width accesses.
+/// Row pointers remain valid until the image is destroyed or modified by
+/// an in-place operation that reallocates its pixels (e.g. ImageBlur).
+/// Writes through them change only that image: clones made after
+/// ImageRowPtr get a copy of the pixels (see ImageClone).  They are seen by
+/// every later operation: meanwhile, the image keeps no derived results
+/// (see ImageStats and ImageBlurred).
+/// Rows are contiguous in raster layout only: a tiled image is converted
+/// to raster layout first (see ImageSetLayout).
+
+/// Distance, in pixels, from a row to the next one.
+/// Pixel (x, y+1) is at ImageRowPtr(img, y) + ImageStride(img) + x.
+int ImageStride(Image img) ;
+
+/// Pointer to the first pixel of row y, for reading and writing.
+/// Requires: 0 <= y < height.
+/// If img shares its pixels with a clone, they are copied first: if there
+/// is no memory for that, returns NULL and errCause is set.
+uint8* ImageRowPtr(Image img, int y) ;
+
+/// Pointer to the first pixel of row y, for reading only.
+/// Requires: 0 <= y < height.
+/// If img is tiled and there is no memory to convert it to raster layout,
+/// returns NULL and errCause is set.
+const uint8* ImageRowConst(Image img, int y) ;
+
+/// Function applied to each row by ImageForEachRow.
+///   row : the first pixel of row y, which has width pixels.
+///   stride : distance to the next row, as in ImageStride.
+///   arg : the argument given to ImageForEachRow.
+typedef void (*ImageRowFunc)(uint8* row, int stride, int y, int width, void* arg);
+
+/// Call fn for each row of img, in order, from y = 0 to height-1.
+/// The function may read and modify the pixels of the row it is given,
+/// but must not keep the row pointer after it returns.
+///
+/// On success, returns nonzero.
+/// On failure (no memory to copy pixels shared with a clone), returns 0,
+/// errCause is set and fn is not called.
+int ImageForEachRow(Image img, ImageRowFunc fn, void* arg) ;
+
+/// Pixel layout
+
+/// Images are created in raster layout, the layout of PGM files.
+/// In tiled layout, pixels are grouped in 64x64 tiles (4 KiB, one memory
+/// page each), so that neighbouring pixels in a column are close in memory.
+/// ImageGetPixel, ImageSetPixel, ImageStats, ImageSave, the pixel
+/// transformations and ImageRotate (whose result is also tiled) work on
+/// tiled images directly.  Other operations that only read an image (such
+/// as ImageCrop, ImageLocateSubImage or ImageSobel) read a raster copy of
+/// a tiled image, which keeps its layout.  Operations that modify an image
+/// in place (such as ImageBlur or ImagePaste, for its first image) or hand
+/// out row pointers (ImageRowPtr, ImageRowConst, ImageForEachRow) convert
+/// it to raster layout first.  Either may fail for lack of memory
+/// (operations that cannot report failures, such as ImageLocateSubImage,
+/// then find no match).
+
+/// Memory layout of the pixels of img.
+ImageLayout ImageGetLayout(Image img) ;
+
+/// Convert the pixels of img to the given memory layout.
+/// The image does not change: only the order of its pixels in memory.
+///
+/// On success, returns nonzero.
+/// On failure, returns 0, errCause is set and img is not modified.
+int ImageSetLayout(Image img, ImageLayout layout) ;
+
 /// Pixel transformations
 
 /// These functions modify the pixel levels in an image, but do not change
 /// pixel positions or image geometry in any way.
-/// All of these functions modify the image in-place: no allocation involved.
-/// They never fail.
+/// All of these functions modify the image in-place.  They allocate memory
+/// only to copy pixels shared with a clone (see ImageClone):
+/// On success, they return nonzero.
+/// On failure (no memory for the copy), they return 0, errCause is set
+/// and the image is not modified.
 
 /// Transform image to negative image.
 /// This transforms dark pixels to light pixels and vice-versa,
 /// resulting in a "photographic negative" effect.
-void ImageNegative(Image img) ;
+int ImageNegative(Image img) ;
 
 /// Apply threshold to image.
 /// Transform all pixels with level<thr to black (0) and
 /// all pixels with level>=thr to white (maxval).
-void ImageThreshold(Image img, uint8 thr) ;
+int ImageThreshold(Image img, uint8 thr) ;
 
 /// Brighten image by a factor.
 /// Multiply each pixel level by a factor, but saturate at maxval.
 /// This will brighten the image if factor>1.0 and
 /// darken the image if factor<1.0.
-void ImageBrighten(Image img, double factor) ;
+int ImageBrighten(Image img, double factor) ;
 
 /// Geometric transformations
 
@@ -148,6 +351,7 @@ void ImageBrighten(Image img, double factor) ;
 /// Rotate an image.
 /// Returns a rotated version of the image.
 /// The rotation is 90 degrees clockwise.
+/// If img is tiled, so is the result, and it is rotated tile by tile.
 /// Ensures: The original img is not modified.
 /// 
 /// On success, a new image is returned.
@@ -178,21 +382,76 @@ Image ImageMirror(Image img) ;
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageCrop(Image img, int x, int y, int w, int h) ;
 
+/// Resize an image to w x h pixels.
+/// method selects how pixels are resampled:
+///   RESAMPLE_AREA: each pixel is the exact mean of the area it covers in
+///     the original image (best for shrinking);
+///   RESAMPLE_BILINEAR: bilinear interpolation between pixel centers (best
+///     for enlarging);
+///   RESAMPLE_NEAREST: the nearest pixel;
+///   RESAMPLE_AUTO: area where an axis shrinks, bilinear where it grows.
+/// Ensures: The original img is not modified.
+/// Requires: w, h > 0 and img is not empty.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageResize(Image img, int w, int h, int method) ;
+
+/// Apply an affine transformation to an image.
+/// The transformation maps each point (x, y) of img to the point
+///   (m[0]*x + m[1]*y + m[2], m[3]*x + m[4]*y + m[5])
+/// of the result, a w x h image.  Coordinates refer to the top left corner
+/// of pixel (0,0), so pixel (x,y) is centered at (x+0.5, y+0.5).
+/// method is RESAMPLE_NEAREST or RESAMPLE_BILINEAR (RESAMPLE_AUTO selects
+/// bilinear).  Result pixels mapped from outside img are black (0).
+/// Ensures: The original img is not modified.
+/// Requires: w, h >= 0 and the transformation is invertible.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageWarpAffine(Image img, const double m[6], int w, int h, int method) ;
+
+/// Rotate an image by an arbitrary angle.
+/// The rotation is counter-clockwise by the given number of degrees, about
+/// the center of the image.  The result is just large enough to contain
+/// the whole rotated image; uncovered pixels are black.
+/// method is as in ImageWarpAffine.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageRotateAngle(Image img, double degrees, int method) ;
+
 /// Operations on two images
 
 /// Paste an image into a larger image.
 /// Paste img2 into position (x, y) of img1.
-/// This modifies img1 in-place: no allocation involved.
+/// This modifies img1 in-place.  It allocates memory (and so may fail)
+/// only to give img1 its own copy of pixels shared with a clone (see
+/// ImageClone), to convert a tiled img1 to raster layout, or to read a
+/// tiled img2 through a raster copy (see ImageSetLayout).
 /// Requires: img2 must fit inside img1 at position (x, y).
-void ImagePaste(Image img1, int x, int y, Image img2) ;
+///
+/// On success, returns nonzero.
+/// On failure, returns 0, errCause is set and img1 is not modified.
+int ImagePaste(Image img1, int x, int y, Image img2) ;
 
 /// Blend an image into a larger image.
 /// Blend img2 into position (x, y) of img1.
-/// This modifies img1 in-place: no allocation involved.
+/// This modifies img1 in-place.  It allocates memory (and so may fail)
+/// only to give img1 its own copy of pixels shared with a clone (see
+/// ImageClone), to convert a tiled img1 to raster layout, or to read a
+/// tiled img2 through a raster copy (see ImageSetLayout).
 /// Requires: img2 must fit inside img1 at position (x, y).
 /// alpha usually is in [0.0, 1.0], but values outside that interval
 /// may provide interesting effects.  Over/underflows should saturate.
-void ImageBlend(Image img1, int x, int y, Image img2, double alpha) ;
+///
+/// On success, returns nonzero.
+/// On failure, returns 0, errCause is set and img1 is not modified.
+int ImageBlend(Image img1, int x, int y, Image img2, double alpha) ;
 
 /// Compare an image to a subimage of a larger image.
 /// Returns 1 (true) if img2 matches subimage of img1 at pos (x, y).
@@ -203,14 +462,347 @@ int ImageMatchSubImage(Image img1, int x, int y, Image img2) ;
 /// Searches for img2 inside img1.
 /// If a match is found, returns 1 and matching position is set in vars (*px, *py).
 /// If no match is found, returns 0 and (*px, *py) are left untouched.
+/// The search is done in parallel, but the position returned is always the
+/// first match in x-major order (smallest x, then smallest y).
 int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) ;
 
+/// Locate an approximate subimage inside another image.
+/// Searches for a subimage of img1 whose sum of absolute differences (SAD)
+/// to img2 is at most maxSad.
+/// If one is found, returns 1 and its position is set in vars (*px, *py).
+/// If none is found, returns 0 and (*px, *py) are left untouched.
+/// The position returned is the first in x-major order, as in
+/// ImageLocateSubImage.  With maxSad==0 this is ImageLocateSubImage.
+int ImageLocateWithin(Image img1, int* px, int* py, Image img2, unsigned long maxSad) ;
+
+/// Locate the best approximation of a subimage inside another image.
+/// Finds the subimage of img1 with the least sum of absolute differences
+/// (SAD) to img2, and sets its position in (*px, *py) and its SAD in *sad.
+/// Ties are broken by x-major order, as in ImageLocateSubImage.
+/// Returns 1, or 0 if img2 does not fit inside img1 (vars left untouched).
+/// Requires: img2 has less than 2^24 pixels and img1 less than 2^32 positions.
+int ImageLocateBest(Image img1, int* px, int* py, Image img2, unsigned long* sad) ;
+
+/// Locate several subimages inside an image, in a single scan.
+/// Searches for each of img2[0..n-1] inside img1, and sets results[i] to
+/// the first match of img2[i] in x-major order, as ImageLocateSubImage
+/// would find it (results[i].found is 0 if there is none).
+/// The scan costs about the same for any number of subimages, except for
+/// the positions where a subimage matches its first few pixels.
+/// Requires: n >= 0.
+///
+/// On success, returns nonzero.
+/// On failure, returns 0 and errCause is set.
+int ImageLocateMany(Image img1, Image img2[], int n, ImageMatch results[]) ;
+
+/// Search indexes
+
+/// A search index of an image speeds up locating many subimages in it.
+/// It lists the positions of the image by a hash of the 8x8 block of
+/// pixels there, so a subimage at least 8x8 is only compared at the
+/// positions whose block matches its top left block: a search costs
+/// about the size of the subimage plus the number of those candidates,
+/// instead of the size of the image.  The index takes about 8 bytes per
+/// pixel of the image.
+/// The index keeps a clone of the indexed image (see ImageClone), so it
+/// stays valid if the image is later modified (which then copies the
+/// pixels) or destroyed.
+
+/// Create a search index of img.
+/// Requires: img has less than 2^32 pixels.
+///
+/// On success, a new index is returned.
+/// (The caller is responsible for destroying the returned index!)
+/// On failure, returns NULL and errCause is set.
+ImageIndex ImageIndexCreate(Image img) ;
+
+/// Destroy the index pointed to by (*idxp).
+/// If (*idxp)==NULL, no operation is performed.
+/// Ensures: (*idxp)==NULL.
+void ImageIndexDestroy(ImageIndex* idxp) ;
+
+/// Locate a subimage inside the indexed image.
+/// As ImageLocateSubImage: returns 1 and sets (*px, *py) to the first
+/// match of img2 in x-major order, or returns 0 if there is none.
+/// Subimages smaller than 8x8 are located by a full scan.
+int ImageIndexLocate(ImageIndex idx, int* px, int* py, Image img2) ;
+
+/// Save a search index to a file.
+/// The image is not saved: save it with ImageSave, if needed.
+/// The file is in the byte order of this machine.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// a partial and invalid file may be left in the system.
+int ImageIndexSave(ImageIndex idx, const char* filename) ;
+
+/// Load a search index of img from a file saved by ImageIndexSave.
+/// Loading is faster than creating the index, but still reads every pixel
+/// of img, to check that it is the image indexed.
+/// On success, a new index is returned.
+/// (The caller is responsible for destroying the returned index!)
+/// On failure (including an index of another image), returns NULL and
+/// errno/errCause are set accordingly.
+ImageIndex ImageIndexLoad(const char* filename, Image img) ;
+
 /// Filtering
 
 /// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter.
 /// Each pixel is substituted by the mean of the pixels in the rectangle
 /// [x-dx, x+dx]x[y-dy, y+dy].
 /// The image is changed in-place.
-void ImageBlur(Image img, int dx, int dy) ;
+/// Requires: dx, dy >= 0.
+///
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set and img is not modified.
+int ImageBlur(Image img, int dx, int dy) ;
+
+/// Blurred copy of an image.
+/// Returns a new image with img blurred as by ImageBlur(img, dx, dy),
+/// without modifying img.
+/// The blurred image is kept with img: when img is only modified in a
+/// region (by ImagePaste, ImageBlend or ImageSetPixel), blurring it again
+/// with the same dx, dy only recomputes the pixels around that region.
+/// (Nothing is kept while the pixels may be written through row pointers:
+/// see ImageRowPtr.)
+/// Requires: dx, dy >= 0.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageBlurred(Image img, int dx, int dy) ;
+
+/// Convolve an image with a separable kernel.
+/// Rows are convolved with kernel kx[0..nkx-1], then columns with kernel
+/// ky[0..nky-1].  Kernels are centered: tap nk/2 weighs the pixel itself.
+/// Near the borders, taps falling outside the image are dropped and the
+/// others rescaled to keep the kernel sum (as ImageBlur does).
+/// Results are rounded and saturated to [0, maxval].
+/// The image is changed in-place.
+/// Requires: nkx and nky are odd.
+///   The sums of absolute weights of kx and ky must not exceed 8 each.
+///   (Near the borders, taps are not rescaled beyond that bound.)
+///
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set and img is not modified.
+int ImageConvolveSeparable(Image img, const double* kx, int nkx,
+                           const double* ky, int nky) ;
+
+/// Convolve an image with a small 2D kernel.
+/// k[j*nkx + i] is the weight at column i and row j of a nkx x nky kernel,
+/// centered on the pixel, as in ImageConvolveSeparable.
+/// Borders are handled, and results rounded, as in ImageConvolveSeparable.
+/// The image is changed in-place.
+/// Requires: nkx and nky are odd.
+///   The sum of absolute weights of k must not exceed 2048.
+///
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set and img is not modified.
+int ImageConvolve(Image img, const double* k, int nkx, int nky) ;
+
+/// Blur an image with an approximate Gaussian filter of deviation sigma.
+/// The filter is a cascade of three mean filters (as in ImageBlur) applied
+/// to rows and columns, so the cost does not depend on sigma.
+/// The image is changed in-place.
+/// Requires: sigma >= 0.
+///
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set and the image may have
+/// been blurred along rows only.
+int ImageGaussianBlur(Image img, double sigma) ;
+
+/// Apply a (2dx+1)x(2dy+1) median filter to an image.
+/// Each pixel is substituted by the median of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy] that are inside the image.
+/// When the number of such pixels is even, the lower median is used.
+/// The cost per pixel does not depend on dx, dy.
+/// The image is changed in-place.
+/// Requires: dx, dy >= 0 and 2dy+1 < 65536.
+///
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set and img is not modified.
+int ImageMedian(Image img, int dx, int dy) ;
+
+/// Morphology
+
+/// Erode an image with a (2dx+1)x(2dy+1) rectangle.
+/// Each pixel is substituted by the minimum of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy] that are inside the image.
+/// The image is changed in-place.
+/// Requires: dx, dy >= 0.
+///
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set and the image may have
+/// been eroded along rows only.
+int ImageErode(Image img, int dx, int dy) ;
+
+/// Dilate an image with a (2dx+1)x(2dy+1) rectangle.
+/// Each pixel is substituted by the maximum of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy] that are inside the image.
+/// The image is changed in-place.
+/// Requires: dx, dy >= 0.
+///
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set and the image may have
+/// been dilated along rows only.
+int ImageDilate(Image img, int dx, int dy) ;
+
+/// Morphological opening: erode, then dilate, with the same rectangle.
+/// Removes bright details smaller than the rectangle.
+/// Success and failure are treated as in ImageErode.
+int ImageOpen(Image img, int dx, int dy) ;
+
+/// Morphological closing: dilate, then erode, with the same rectangle.
+/// Removes dark details smaller than the rectangle.
+/// Success and failure are treated as in ImageErode.
+int ImageClose(Image img, int dx, int dy) ;
+
+/// Connected components
+
+/// Label the connected components of the foreground of img.
+/// Foreground pixels are those with a nonzero level (as in the result of
+/// ImageThreshold), connected to their 4 (connectivity==4) or 8
+/// (connectivity==8) neighbours.
+/// Components are numbered from 1, in the raster order of their first
+/// pixel.  On return, *labels points to a new width*height array, in
+/// raster order, with the label of each pixel (0 for the background), and
+/// *stats to a new array with the statistics of component i in
+/// (*stats)[i-1].  (The caller is responsible for freeing both arrays!)
+/// Rows are labeled by bands in parallel, and then merged.
+/// Requires: connectivity is 4 or 8; img has less than 2^32 pixels.
+///
+/// On success, returns the number of components (possibly 0).
+/// On failure, returns -1, errno/errCause are set and *labels and *stats
+/// are left untouched.
+int ImageLabel(Image img, int connectivity, uint32_t** labels, ImageComponent** stats) ;
+
+/// Distance transform
+
+/// Squared Euclidean distance from each pixel to the nearest foreground
+/// (nonzero) pixel of img.
+/// Returns a new width*height array, in raster order, with the exact
+/// squared distances (0 on the foreground), or UINT32_MAX everywhere if
+/// img has no foreground.
+/// (The caller is responsible for freeing the returned array!)
+/// Requires: width*width + height*height < 2^32.
+/// On failure, returns NULL and errno/errCause are set accordingly.
+uint32_t* ImageDistanceSquared(Image img) ;
+
+/// Euclidean distance transform.
+/// Returns a new image with the distance from each pixel to the nearest
+/// foreground (nonzero) pixel of img, rounded to the nearest integer and
+/// saturated at PixMax (which is also the distance if there is no
+/// foreground).  The maxval of the result is PixMax.
+/// Requires: width*width + height*height < 2^32.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageDistanceTransform(Image img) ;
+
+/// Edge detection
+
+/// Sobel edge detector.
+/// Returns a new image with the norm of the gradient of img at each pixel,
+/// computed with the 3x3 Sobel operators (borders replicated) and saturated
+/// at PixMax.  If thr >= 0, the result is thresholded in the same pass:
+/// pixels with a norm >= thr are white (PixMax) and the others black (0).
+/// The maxval of the result is PixMax.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageSobel(Image img, SobelNorm norm, int thr) ;
+
+/// Binary images
+
+/// A binary image stores one bit per pixel, packed in 64-bit words.
+/// Bit 1 means foreground: a level >= threshold, shown as white.
+
+/// Create a new binary image with all bits 0.
+/// Requires: width and height must be non-negative.
+///
+/// On success, a new binary image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+BitImage BitImageCreate(int width, int height) ;
+
+/// Destroy the binary image pointed to by (*bimgp).
+/// If (*bimgp)==NULL, no operation is performed.
+/// Ensures: (*bimgp)==NULL.
+void BitImageDestroy(BitImage* bimgp) ;
+
+/// Get binary image width
+int BitImageWidth(BitImage bimg) ;
+
+/// Get binary image height
+int BitImageHeight(BitImage bimg) ;
+
+/// Get the bit (0 or 1) at position (x,y).
+int BitImageGetBit(BitImage bimg, int x, int y) ;
+
+/// Set the bit at position (x,y) to bit (0 or 1).
+void BitImageSetBit(BitImage bimg, int x, int y, int bit) ;
+
+/// Threshold an image directly into a new binary image.
+/// Pixels with level>=thr get bit 1, others get bit 0, as in ImageThreshold.
+/// The image is not modified.
+///
+/// On success, a new binary image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+BitImage ImageToBits(Image img, uint8 thr) ;
+
+/// Convert a binary image to a new image.
+/// Bits 1 become maxval (white) and bits 0 become 0 (black).
+/// Requires: maxval > 0.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image BitsToImage(BitImage bimg, uint8 maxval) ;
+
+/// Bitwise operations
+
+/// These combine two binary images of the same size, 64 pixels at a time,
+/// storing the result in bimg1.  bimg2 is not modified.
+
+/// bimg1 = bimg1 AND bimg2
+void BitImageAnd(BitImage bimg1, BitImage bimg2) ;
+
+/// bimg1 = bimg1 OR bimg2
+void BitImageOr(BitImage bimg1, BitImage bimg2) ;
+
+/// bimg1 = bimg1 XOR bimg2
+void BitImageXor(BitImage bimg1, BitImage bimg2) ;
+
+/// bimg = NOT bimg
+void BitImageNot(BitImage bimg) ;
+
+/// Count the pixels with bit 1 (the foreground area).
+long BitImageCount(BitImage bimg) ;
+
+/// Locate a binary subimage inside another binary image.
+/// Searches for bimg2 inside bimg1, comparing 64 pixels at a time.
+/// If a match is found, returns 1 and matching position is set in vars (*px, *py).
+/// If no match is found, returns 0 and (*px, *py) are left untouched.
+/// The position returned is the first in x-major order, as in
+/// ImageLocateSubImage.
+int BitImageLocate(BitImage bimg1, int* px, int* py, BitImage bimg2) ;
+
+/// Load a raw PBM (P4) file.
+/// PBM black pixels (bit 1 in the file) become bits 0, and vice-versa.
+/// On success, a new binary image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+BitImage BitImageLoad(const char* filename) ;
+
+/// Save binary image to a raw PBM (P4) file.
+/// Bits 1 are saved as white pixels, bits 0 as black pixels.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// a partial and invalid file may be left in the system.
+int BitImageSave(BitImage bimg, const char* filename) ;
 
 #endif
@@ -0,0 +1,742 @@
+// imageCheck - Regression checks of the image8bit module.
+//
+// Each check runs some module functions on small pseudo-random images and
+// compares their results to straightforward reference implementations
+// (brute force, pixel by pixel).  It prints the first difference found,
+// and exits with a nonzero status if there is one.
+// The Makefile runs each check as a test target (see make checks).
+//
+// This program is an example use of the image8bit module,
+// a programming project for the course AED, DETI / UA.PT
+//
+// You may freely use and modify this code, NO WARRANTY, blah blah,
+// as long as you give proper credit to the original and subsequent authors.
+
+#include <assert.h>
+#include <errno.h>
+#include "error.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "image8bit.h"
+
+static const char* USAGE =
+    "USAGE: imageCheck CHECK\n"
+    "  Compare the results of image8bit functions to reference results.\n"
+    "\n"
+    "CHECKS:\n"
+    "  blur            ImageBlur and ImageBlurred, for small and large windows\n"
+    "                  (run with IMAGE8BIT_ISA=... to check each kernel level)\n"
+    "  conv            ImageConvolve with the largest weights allowed\n"
+    "  median          ImageMedian, for small and large windows\n"
+    "  morph           ImageErode, ImageDilate, ImageOpen and ImageClose\n"
+    "  label           ImageLabel with 4 and 8 connectivity\n"
+    "  dist            ImageDistanceSquared\n"
+    "  locatesad       ImageLocateWithin and ImageLocateBest\n"
+    "  locatemany      ImageLocateMany\n"
+    "  cow             Clones sharing pixels, and writes through row pointers\n"
+    "  cache           ImageStats and ImageBlurred after changes to the image\n"
+    "  layout          Operations that read tiled images, and keep them tiled\n"
+    "  threads         Locate functions with more threads than an operation uses\n"
+    ;
+
+// Number of differences found
+static int fails = 0;
+
+// Report a difference (only the first few).
+static void fail(const char* check, const char* what, int x, int y, long got, long want) {
+  if (fails++ < 5) {
+    printf("# %s: %s at (%d,%d): got %ld, want %ld\n", check, what, x, y, got, want);
+  }
+}
+
+// A new w x h image of pseudo-random levels in [0, levels).
+// Few levels make flat regions and repeated patterns.
+static Image randomImage(int w, int h, int levels) {
+  Image img = ImageCreate(w, h, 255);
+  if (img == NULL) error(2, errno, "Creating image: %s", ImageErrMsg());
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x++) ImageSetPixel(img, x, y, (uint8)(rand() % levels));
+  }
+  return img;
+}
+
+// A copy of the pixels of img, in raster order.
+static uint8* pixelsOf(Image img) {
+  int w = ImageWidth(img), h = ImageHeight(img);
+  uint8* p = (uint8*)malloc((size_t)w * h + 1);
+  if (p == NULL) error(2, errno, "Out of memory");
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x++) p[(size_t)y * w + x] = ImageGetPixel(img, x, y);
+  }
+  return p;
+}
+
+// Compare all pixels of img to p.
+static void comparePixels(const char* what, Image img, const uint8* p) {
+  int w = ImageWidth(img), h = ImageHeight(img);
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x++) {
+      uint8 want = p[(size_t)y * w + x];
+      if (ImageGetPixel(img, x, y) != want) fail(what, "pixel", x, y, ImageGetPixel(img, x, y), want);
+    }
+  }
+}
+
+// Reference blur: mean of the window clamped to the image, rounded as
+// (sum+count/2)/count.
+static uint8 refBlur(const uint8* p, int w, int h, int x, int y, int dx, int dy) {
+  unsigned long sum = 0, count = 0;
+  for (int j = y - dy; j <= y + dy; j++) {
+    for (int i = x - dx; i <= x + dx; i++) {
+      if (0 <= i && i < w && 0 <= j && j < h) {
+        sum += p[(size_t)j * w + i];
+        count++;
+      }
+    }
+  }
+  return (uint8)((sum + count/2) / count);
+}
+
+// Compare img to the reference blur of pixels p.
+static void compareBlur(const char* what, Image img, const uint8* p, int dx, int dy) {
+  int w = ImageWidth(img), h = ImageHeight(img);
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x++) {
+      uint8 want = refBlur(p, w, h, x, y, dx, dy);
+      if (ImageGetPixel(img, x, y) != want) fail(what, "pixel", x, y, ImageGetPixel(img, x, y), want);
+    }
+  }
+}
+
+// Blur with every small window (unrolled kernels) and a few large ones
+// (sliding sums), on images narrower, shorter and larger than the windows.
+static void checkBlur(void) {
+  static const int size[][2] = { {1, 1}, {3, 2}, {7, 9}, {40, 5}, {5, 40}, {301, 217} };
+  for (int s = 0; s < (int)(sizeof(size) / sizeof(size[0])); s++) {
+    for (int dy = 0; dy <= 5; dy++) {
+      for (int dx = 0; dx <= 5; dx++) {
+        Image img = randomImage(size[s][0], size[s][1], 256);
+        uint8* p = pixelsOf(img);
+        Image copy = ImageBlurred(img, dx, dy);
+        if (copy == NULL) error(2, errno, "ImageBlurred: %s", ImageErrMsg());
+        compareBlur("ImageBlurred", copy, p, dx, dy);
+        if (!ImageBlur(img, dx, dy)) error(2, errno, "ImageBlur: %s", ImageErrMsg());
+        compareBlur("ImageBlur", img, p, dx, dy);
+        free(p);
+        ImageDestroy(&copy);
+        ImageDestroy(&img);
+      }
+    }
+  }
+}
+
+// A white image convolved with a kernel of large positive weights stays
+// white (its sums used to overflow 32-bit accumulators).
+static void checkConv(void) {
+  double k[25];
+  for (int i = 0; i < 25; i++) k[i] = 80.0;   // sum 2000, near the bound
+  Image img = ImageCreate(20, 20, 255);
+  if (img == NULL) error(2, errno, "Creating image: %s", ImageErrMsg());
+  ImageNegative(img);
+  if (!ImageConvolve(img, k, 5, 5)) error(2, errno, "ImageConvolve: %s", ImageErrMsg());
+  for (int y = 0; y < 20; y++) {
+    for (int x = 0; x < 20; x++) {
+      if (ImageGetPixel(img, x, y) != 255) fail("ImageConvolve", "pixel", x, y, ImageGetPixel(img, x, y), 255);
+    }
+  }
+  ImageDestroy(&img);
+}
+
+// Reference median: lower median of the window clamped to the image.
+static uint8 refMedian(const uint8* p, int w, int h, int x, int y, int dx, int dy) {
+  unsigned long hist[256] = { 0 };
+  unsigned long count = 0;
+  for (int j = y - dy; j <= y + dy; j++) {
+    for (int i = x - dx; i <= x + dx; i++) {
+      if (0 <= i && i < w && 0 <= j && j < h) {
+        hist[p[(size_t)j * w + i]]++;
+        count++;
+      }
+    }
+  }
+  unsigned long below = 0;
+  int v = 0;
+  while (below + hist[v] <= (count - 1) / 2) below += hist[v++];
+  return (uint8)v;
+}
+
+// Median filter with small and large windows, on images narrower, shorter
+// and larger than the windows, with many levels and with few (even counts
+// of pixels on borders then tie often).
+static void checkMedian(void) {
+  static const int size[][2] = { {1, 1}, {3, 2}, {7, 9}, {40, 5}, {5, 40}, {131, 97} };
+  static const int win[][2] = { {0, 0}, {1, 0}, {0, 1}, {1, 1}, {2, 3}, {4, 4}, {20, 1}, {1, 20} };
+  for (int s = 0; s < (int)(sizeof(size) / sizeof(size[0])); s++) {
+    for (int k = 0; k < (int)(sizeof(win) / sizeof(win[0])); k++) {
+      int dx = win[k][0], dy = win[k][1];
+      Image img = randomImage(size[s][0], size[s][1], k % 2 == 0 ? 256 : 3);
+      int w = ImageWidth(img), h = ImageHeight(img);
+      uint8* p = pixelsOf(img);
+      if (!ImageMedian(img, dx, dy)) error(2, errno, "ImageMedian: %s", ImageErrMsg());
+      for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+          uint8 want = refMedian(p, w, h, x, y, dx, dy);
+          if (ImageGetPixel(img, x, y) != want) fail("ImageMedian", "pixel", x, y, ImageGetPixel(img, x, y), want);
+        }
+      }
+      free(p);
+      ImageDestroy(&img);
+    }
+  }
+}
+
+// Reference erosion (or dilation, if dilate) of the w x h pixels p, into q:
+// minimum (maximum) of each window clamped to the image.
+static void refMorph(const uint8* p, uint8* q, int w, int h, int dx, int dy, int dilate) {
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x++) {
+      uint8 v = dilate ? 0 : 255;
+      for (int j = y - dy; j <= y + dy; j++) {
+        for (int i = x - dx; i <= x + dx; i++) {
+          if (0 <= i && i < w && 0 <= j && j < h) {
+            uint8 a = p[(size_t)j * w + i];
+            if (dilate ? a > v : a < v) v = a;
+          }
+        }
+      }
+      q[(size_t)y * w + x] = v;
+    }
+  }
+}
+
+// Erode, dilate, open and close with small and large rectangles, on images
+// narrower, shorter and larger than them, and wider than a block of
+// columns with a partial last block.
+static void checkMorph(void) {
+  static const int size[][2] = { {1, 1}, {3, 2}, {7, 9}, {40, 5}, {5, 40}, {131, 97} };
+  static const int win[][2] = { {0, 0}, {1, 0}, {0, 1}, {1, 1}, {2, 3}, {4, 4}, {20, 1}, {1, 20} };
+  static const char* name[] = { "ImageErode", "ImageDilate", "ImageOpen", "ImageClose" };
+  for (int s = 0; s < (int)(sizeof(size) / sizeof(size[0])); s++) {
+    for (int k = 0; k < (int)(sizeof(win) / sizeof(win[0])); k++) {
+      for (int op = 0; op < 4; op++) {
+        int dx = win[k][0], dy = win[k][1];
+        Image img = randomImage(size[s][0], size[s][1], 256);
+        int w = ImageWidth(img), h = ImageHeight(img);
+        uint8* p = pixelsOf(img);
+        uint8* q = (uint8*)malloc((size_t)w * h + 1);
+        if (q == NULL) error(2, errno, "Out of memory");
+        // Open and close are an erosion and a dilation, in either order
+        int first = op == 0 || op == 2 ? 0 : 1;
+        refMorph(p, q, w, h, dx, dy, first);
+        if (op >= 2) {
+          memcpy(p, q, (size_t)w * h);
+          refMorph(p, q, w, h, dx, dy, !first);
+        }
+        int ok = op == 0 ? ImageErode(img, dx, dy) : op == 1 ? ImageDilate(img, dx, dy)
+               : op == 2 ? ImageOpen(img, dx, dy) : ImageClose(img, dx, dy);
+        if (!ok) error(2, errno, "%s: %s", name[op], ImageErrMsg());
+        comparePixels(name[op], img, q);
+        free(q);
+        free(p);
+        ImageDestroy(&img);
+      }
+    }
+  }
+}
+
+// Reference labeling: flood fill from each unlabeled foreground pixel, in
+// raster order, so components are numbered as ImageLabel numbers them.
+// Returns the number of components.
+static int refLabel(const uint8* p, int w, int h, int conn, uint32_t* label) {
+  int* stack = (int*)malloc(sizeof(int) * ((size_t)w * h + 1));
+  if (stack == NULL) error(2, errno, "Out of memory");
+  memset(label, 0, sizeof(uint32_t) * (size_t)w * h);
+  int n = 0;
+  for (int i = 0; i < w * h; i++) {
+    if (p[i] == 0 || label[i] != 0) continue;
+    label[i] = ++n;
+    int top = 0;
+    stack[top++] = i;
+    while (top > 0) {
+      int c = stack[--top];
+      int cx = c % w, cy = c / w;
+      for (int dy = -1; dy <= 1; dy++) {
+        for (int dx = -1; dx <= 1; dx++) {
+          if ((dx == 0 && dy == 0) || (conn == 4 && dx != 0 && dy != 0)) continue;
+          int x = cx + dx, y = cy + dy;
+          if (x < 0 || x >= w || y < 0 || y >= h) continue;
+          int q = y * w + x;
+          if (p[q] == 0 || label[q] != 0) continue;
+          label[q] = n;
+          stack[top++] = q;
+        }
+      }
+    }
+  }
+  free(stack);
+  return n;
+}
+
+// Label images of sparse and dense foreground, with both connectivities,
+// and compare labels and component areas to the flood fill.
+static void checkLabel(void) {
+  static const int size[][2] = { {1, 1}, {17, 1}, {1, 13}, {31, 23}, {300, 250} };
+  for (int s = 0; s < (int)(sizeof(size) / sizeof(size[0])); s++) {
+    for (int conn = 4; conn <= 8; conn += 4) {
+      for (int density = 1; density <= 3; density++) {
+        int w = size[s][0], h = size[s][1];
+        Image img = randomImage(w, h, 4);
+        ImageThreshold(img, (uint8)(4 - density));
+        uint8* p = pixelsOf(img);
+        uint32_t* want = (uint32_t*)malloc(sizeof(uint32_t) * ((size_t)w * h + 1));
+        if (want == NULL) error(2, errno, "Out of memory");
+        int nwant = refLabel(p, w, h, conn, want);
+        uint32_t* labels;
+        ImageComponent* stats;
+        int n = ImageLabel(img, conn, &labels, &stats);
+        if (n < 0) error(2, errno, "ImageLabel: %s", ImageErrMsg());
+        if (n != nwant) fail("ImageLabel", "components", w, h, n, nwant);
+        long* area = (long*)calloc((size_t)nwant + 1, sizeof(long));
+        if (area == NULL) error(2, errno, "Out of memory");
+        for (int i = 0; i < w * h; i++) {
+          if (labels[i] != want[i]) fail("ImageLabel", "label", i % w, i / w, labels[i], want[i]);
+          area[want[i]]++;
+        }
+        for (int c = 1; c <= n && c <= nwant; c++) {
+          if (stats[c-1].area != area[c]) fail("ImageLabel", "area of component", c, 0, stats[c-1].area, area[c]);
+        }
+        free(area);
+        free(labels);
+        free(stats);
+        free(want);
+        free(p);
+        ImageDestroy(&img);
+      }
+    }
+  }
+}
+
+// Compare squared distances to the nearest foreground pixel, found by
+// trying every foreground pixel, on images with few and many of them
+// (and none).
+static void checkDist(void) {
+  static const int size[][2] = { {1, 1}, {9, 1}, {1, 9}, {37, 29}, {80, 60} };
+  for (int s = 0; s < (int)(sizeof(size) / sizeof(size[0])); s++) {
+    for (int density = 0; density <= 3; density++) {
+      int w = size[s][0], h = size[s][1];
+      Image img = randomImage(w, h, 64);
+      ImageThreshold(img, (uint8)(density == 0 ? 255 : 64 - density * density));
+      uint8* p = pixelsOf(img);
+      uint32_t* d = ImageDistanceSquared(img);
+      if (d == NULL) error(2, errno, "ImageDistanceSquared: %s", ImageErrMsg());
+      for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+          uint32_t want = UINT32_MAX;
+          for (int j = 0; j < h; j++) {
+            for (int i = 0; i < w; i++) {
+              uint32_t d2 = (uint32_t)((i - x) * (i - x) + (j - y) * (j - y));
+              if (p[(size_t)j * w + i] != 0 && d2 < want) want = d2;
+            }
+          }
+          uint32_t got = d[(size_t)y * w + x];
+          if (got != want) fail("ImageDistanceSquared", "distance", x, y, got, want);
+        }
+      }
+      free(d);
+      free(p);
+      ImageDestroy(&img);
+    }
+  }
+}
+
+// First match of img2 in img1, in x-major order, trying every position.
+static int refLocate(Image img1, Image img2, int* px, int* py) {
+  int w2 = ImageWidth(img2), h2 = ImageHeight(img2);
+  for (int x = 0; x + w2 <= ImageWidth(img1); x++) {
+    for (int y = 0; y + h2 <= ImageHeight(img1); y++) {
+      int match = 1;
+      for (int j = 0; j < h2 && match; j++) {
+        for (int i = 0; i < w2 && match; i++) {
+          match = ImageGetPixel(img1, x + i, y + j) == ImageGetPixel(img2, i, j);
+        }
+      }
+      if (match) {
+        *px = x;
+        *py = y;
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+// Sum of absolute differences between img2 and the subimage of img1 at (x, y).
+static unsigned long refSad(Image img1, int x, int y, Image img2) {
+  unsigned long sad = 0;
+  for (int j = 0; j < ImageHeight(img2); j++) {
+    for (int i = 0; i < ImageWidth(img2); i++) {
+      sad += (unsigned long)abs(ImageGetPixel(img1, x + i, y + j) - ImageGetPixel(img2, i, j));
+    }
+  }
+  return sad;
+}
+
+// Locate altered subimages by SAD, with several tolerances, and compare to
+// an exhaustive x-major search: the first position within the tolerance,
+// and the first position of least SAD.
+static void checkLocateSad(void) {
+  static const unsigned long maxSad[] = { 0, 1, 5, 40, 100000 };
+  for (int t = 0; t < 40; t++) {
+    Image img1 = randomImage(60, 45, t % 2 == 0 ? 4 : 256);
+    // Subimages of many widths (and one too wide to fit)
+    int w = t == 0 ? 61 : 1 + rand() % 20, h = 1 + rand() % 12;
+    Image img2 = ImageCreate(w, h, 255);
+    if (img2 == NULL) error(2, errno, "Creating image: %s", ImageErrMsg());
+    int x0 = w <= 60 ? rand() % (60 - w + 1) : 0, y0 = rand() % (45 - h + 1);
+    for (int j = 0; j < h && w <= 60; j++) {
+      for (int i = 0; i < w; i++) ImageSetPixel(img2, i, j, ImageGetPixel(img1, x0 + i, y0 + j));
+    }
+    // Alter a few pixels, by small or large amounts
+    for (int k = t % 4; k > 0; k--) {
+      int i = rand() % w, j = rand() % h;
+      ImageSetPixel(img2, i, j, (uint8)(ImageGetPixel(img2, i, j) + (k == 1 ? 1 : rand() % 256)));
+    }
+    int fits = w <= 60;
+    int bx = -1, by = -1;
+    unsigned long best = ~0ul;
+    for (int x = 0; fits && x + w <= 60; x++) {
+      for (int y = 0; y + h <= 45; y++) {
+        unsigned long sad = refSad(img1, x, y, img2);
+        if (sad < best) {
+          best = sad;
+          bx = x;
+          by = y;
+        }
+      }
+    }
+    for (int m = 0; m < (int)(sizeof(maxSad) / sizeof(maxSad[0])); m++) {
+      int rx = -1, ry = -1, want = 0;
+      for (int x = 0; fits && !want && x + w <= 60; x++) {
+        for (int y = 0; !want && y + h <= 45; y++) {
+          if (refSad(img1, x, y, img2) <= maxSad[m]) {
+            want = 1;
+            rx = x;
+            ry = y;
+          }
+        }
+      }
+      int x = -1, y = -1;
+      int found = ImageLocateWithin(img1, &x, &y, img2, maxSad[m]);
+      if (found != want) fail("ImageLocateWithin", "found, with maxSad", t, (int)maxSad[m], found, want);
+      else if (x != rx || y != ry) {
+        fail("ImageLocateWithin", "position x*1000+y, with maxSad", t, (int)maxSad[m], x * 1000L + y, rx * 1000L + ry);
+      }
+    }
+    int x = -1, y = -1;
+    unsigned long sad = 0;
+    int found = ImageLocateBest(img1, &x, &y, img2, &sad);
+    if (found != fits) fail("ImageLocateBest", "found", t, 0, found, fits);
+    else if (fits && (sad != best || x != bx || y != by)) {
+      fail("ImageLocateBest", "SAD*1000000+x*1000+y", t, 0,
+           (long)sad * 1000000 + x * 1000L + y, (long)best * 1000000 + bx * 1000L + by);
+    }
+    ImageDestroy(&img2);
+    ImageDestroy(&img1);
+  }
+}
+
+// Locate subimages of many sizes (narrower than a key, too large, empty),
+// cut from an image of few levels (so they match in many places) or
+// altered (so they may not match at all).
+static void checkLocateMany(void) {
+  enum { N = 40 };
+  for (int levels = 2; levels <= 256; levels *= 8) {
+    Image img1 = randomImage(120, 90, levels);
+    Image img2[N];
+    for (int t = 0; t < N; t++) {
+      int w = t == 0 ? 0 : (t == 1 ? 121 : 1 + rand() % 12);
+      int h = t == 1 ? 5 : 1 + rand() % 12;
+      int x0 = rand() % (120 - (w < 120 ? w : 0)), y0 = rand() % (90 - h);
+      img2[t] = ImageCreate(w, h, 255);
+      if (img2[t] == NULL) error(2, errno, "Creating image: %s", ImageErrMsg());
+      for (int j = 0; j < h && w <= 120; j++) {
+        for (int i = 0; i < w; i++) ImageSetPixel(img2[t], i, j, ImageGetPixel(img1, x0 + i, y0 + j));
+      }
+      if (t % 3 == 2) ImageSetPixel(img2[t], w - 1, h - 1, (uint8)(rand() % levels));
+    }
+    ImageMatch found[N];
+    if (!ImageLocateMany(img1, img2, N, found)) error(2, errno, "ImageLocateMany: %s", ImageErrMsg());
+    for (int t = 0; t < N; t++) {
+      int x = -1, y = -1;
+      int want = refLocate(img1, img2[t], &x, &y);
+      if (found[t].found != want) fail("ImageLocateMany", "found of subimage", t, 0, found[t].found, want);
+      else if (want && (found[t].x != x || found[t].y != y)) {
+        fail("ImageLocateMany", "position x*1000+y of subimage", t, 0,
+             found[t].x * 1000L + found[t].y, x * 1000L + y);
+      }
+      ImageDestroy(&img2[t]);
+    }
+    ImageDestroy(&img1);
+  }
+}
+
+// Modify images and their clones in every way that may copy shared pixels,
+// and check that each change reaches only the image changed.
+static void checkCow(void) {
+  const int w = 37, h = 23;
+  Image a = randomImage(w, h, 256);
+  uint8* pa = pixelsOf(a);
+
+  // In-place operations on a clone, or on the original
+  Image b = ImageClone(a);
+  if (b == NULL) error(2, errno, "ImageClone: %s", ImageErrMsg());
+  ImageNegative(b);
+  comparePixels("ImageNegative of clone: original", a, pa);
+  ImageDestroy(&b);
+  b = ImageClone(a);
+  if (b == NULL) error(2, errno, "ImageClone: %s", ImageErrMsg());
+  ImageBlur(a, 1, 1);
+  comparePixels("ImageBlur of original: clone", b, pa);
+  ImageDestroy(&b);
+  free(pa);
+  pa = pixelsOf(a);
+  b = ImageClone(a);
+  if (b == NULL) error(2, errno, "ImageClone: %s", ImageErrMsg());
+  ImageSetPixel(a, 3, 4, (uint8)~ImageGetPixel(a, 3, 4));
+  comparePixels("ImageSetPixel of original: clone", b, pa);
+  ImageDestroy(&b);
+  free(pa);
+
+  // A clone made after ImageRowPtr must not see writes through the row
+  pa = pixelsOf(a);
+  uint8* row = ImageRowPtr(a, 1);
+  if (row == NULL) error(2, errno, "ImageRowPtr: %s", ImageErrMsg());
+  b = ImageClone(a);
+  if (b == NULL) error(2, errno, "ImageClone: %s", ImageErrMsg());
+  row[0] = (uint8)~row[0];
+  comparePixels("write through row pointer: clone made after it", b, pa);
+  pa[w] = (uint8)~pa[w];
+  comparePixels("write through row pointer: original", a, pa);
+  ImageDestroy(&b);
+
+  // And neither may a clone of a clone
+  Image c = ImageClone(a);
+  if (c == NULL) error(2, errno, "ImageClone: %s", ImageErrMsg());
+  b = ImageClone(c);
+  if (b == NULL) error(2, errno, "ImageClone: %s", ImageErrMsg());
+  row[1] = (uint8)~row[1];
+  comparePixels("write through row pointer: clone of clone", b, pa);
+  ImageDestroy(&b);
+  ImageDestroy(&c);
+  free(pa);
+  ImageDestroy(&a);
+}
+
+// Compare ImageStats and ImageBlurred of img to references computed from
+// its current pixels.
+static void compareDerived(const char* what, Image img, int dx, int dy) {
+  int w = ImageWidth(img), h = ImageHeight(img);
+  uint8* p = pixelsOf(img);
+  int lo = 255, hi = 0;
+  for (int i = 0; i < w * h; i++) {
+    if (p[i] < lo) lo = p[i];
+    if (p[i] > hi) hi = p[i];
+  }
+  uint8 min, max;
+  ImageStats(img, &min, &max);
+  if (min != lo) fail(what, "ImageStats min", 0, 0, min, lo);
+  if (max != hi) fail(what, "ImageStats max", 0, 0, max, hi);
+  Image blur = ImageBlurred(img, dx, dy);
+  if (blur == NULL) error(2, errno, "ImageBlurred: %s", ImageErrMsg());
+  compareBlur(what, blur, p, dx, dy);
+  ImageDestroy(&blur);
+  free(p);
+}
+
+// Change an image in every way that updates or discards its histogram and
+// blurred copy, checking them after each change.
+static void checkCache(void) {
+  const int w = 60, h = 45, dx = 2, dy = 1;
+  Image img = randomImage(w, h, 200);
+  Image small = randomImage(7, 5, 256);
+  compareDerived("first", img, dx, dy);
+  compareDerived("again", img, dx, dy);
+  ImageSetPixel(img, 10, 10, 250);
+  compareDerived("ImageSetPixel", img, dx, dy);
+  ImagePaste(img, 30, 20, small);
+  compareDerived("ImagePaste", img, dx, dy);
+  ImageBlend(img, 0, 0, small, 0.3);
+  compareDerived("ImageBlend", img, dx, dy);
+  ImageNegative(img);
+  compareDerived("ImageNegative", img, dx, dy);
+  ImageBlur(img, 1, 1);
+  compareDerived("ImageBlur", img, dx, dy);
+
+  // Writes through a row pointer taken before the results are computed
+  uint8* row = ImageRowPtr(img, 5);
+  if (row == NULL) error(2, errno, "ImageRowPtr: %s", ImageErrMsg());
+  compareDerived("before write through row pointer", img, dx, dy);
+  row[7] = 255;
+  row[8] = 0;
+  compareDerived("write through row pointer", img, dx, dy);
+  ImageSetPixel(img, 20, 30, 1);
+  compareDerived("ImageSetPixel after row pointer", img, dx, dy);
+  row[9] = 128;
+  compareDerived("second write through row pointer", img, dx, dy);
+  // Results are kept again once the image gets new pixels
+  ImageBlur(img, 1, 1);
+  compareDerived("ImageBlur after row pointer", img, dx, dy);
+  ImageSetPixel(img, 0, 0, 255);
+  compareDerived("ImageSetPixel after ImageBlur", img, dx, dy);
+  ImageDestroy(&small);
+  ImageDestroy(&img);
+}
+
+// Check that a read-only operation on tiled image t left it tiled and
+// gave the same result as on its raster twin.
+static void compareLayout(const char* what, Image t, long got, long want) {
+  if (ImageGetLayout(t) != LAYOUT_TILED) fail(what, "layout of tiled image", 0, 0, ImageGetLayout(t), LAYOUT_TILED);
+  if (got != want) fail(what, "result", 0, 0, got, want);
+}
+
+// Run operations that only read an image on tiled images (spanning several
+// tiles, with partial ones), and on raster twins for reference.
+static void checkLayout(void) {
+  const int w = 150, h = 100;
+  Image r1 = randomImage(w, h, 4);
+  Image r2 = randomImage(9, 7, 4);
+  for (int j = 0; j < 7; j++) {
+    for (int i = 0; i < 9; i++) ImageSetPixel(r2, i, j, ImageGetPixel(r1, 70 + i, 60 + j));
+  }
+  Image t1 = ImageClone(r1), t2 = ImageClone(r2);
+  if (t1 == NULL || t2 == NULL) error(2, errno, "ImageClone: %s", ImageErrMsg());
+  if (!ImageSetLayout(t1, LAYOUT_TILED) || !ImageSetLayout(t2, LAYOUT_TILED)) {
+    error(2, errno, "ImageSetLayout: %s", ImageErrMsg());
+  }
+  uint8* p1 = pixelsOf(r1);
+
+  int x = -1, y = -1, rx = -1, ry = -1;
+  int found = ImageLocateSubImage(t1, &x, &y, t2);
+  int want = ImageLocateSubImage(r1, &rx, &ry, r2);
+  compareLayout("ImageLocateSubImage", t1, found, want);
+  compareLayout("ImageLocateSubImage (subimage)", t2, x * 1000L + y, rx * 1000L + ry);
+  compareLayout("ImageMatchSubImage", t1, ImageMatchSubImage(t1, rx, ry, t2),
+                ImageMatchSubImage(r1, rx, ry, r2));
+  Image many[2] = { t2, r2 };
+  ImageMatch m[2];
+  if (!ImageLocateMany(t1, many, 2, m)) error(2, errno, "ImageLocateMany: %s", ImageErrMsg());
+  compareLayout("ImageLocateMany", t1, m[0].x * 1000L + m[0].y, rx * 1000L + ry);
+  compareLayout("ImageLocateMany (subimage)", t2, m[1].x * 1000L + m[1].y, rx * 1000L + ry);
+
+  Image crop = ImageCrop(t1, 60, 50, 80, 40);
+  if (crop == NULL) error(2, errno, "ImageCrop: %s", ImageErrMsg());
+  compareLayout("ImageCrop", t1, ImageGetPixel(crop, 79, 39), ImageGetPixel(r1, 139, 89));
+  ImageDestroy(&crop);
+  Image sobel = ImageSobel(t1, SOBEL_L1, 0), rsobel = ImageSobel(r1, SOBEL_L1, 0);
+  if (sobel == NULL || rsobel == NULL) error(2, errno, "ImageSobel: %s", ImageErrMsg());
+  uint8* ps = pixelsOf(rsobel);
+  comparePixels("ImageSobel of tiled image", sobel, ps);
+  compareLayout("ImageSobel", t1, 0, 0);
+  free(ps);
+  ImageDestroy(&sobel);
+  ImageDestroy(&rsobel);
+  Image blur = ImageBlurred(t1, 2, 1);
+  if (blur == NULL) error(2, errno, "ImageBlurred: %s", ImageErrMsg());
+  compareBlur("ImageBlurred of tiled image", blur, p1, 2, 1);
+  compareLayout("ImageBlurred", t1, 0, 0);
+  ImageDestroy(&blur);
+
+  // Pasting a tiled image reads it only
+  Image r3 = randomImage(w, h, 256);
+  if (!ImagePaste(r3, 3, 4, t2)) error(2, errno, "ImagePaste: %s", ImageErrMsg());
+  compareLayout("ImagePaste", t2, ImageGetPixel(r3, 11, 10), ImageGetPixel(r2, 8, 6));
+  ImageDestroy(&r3);
+
+  comparePixels("tiled image after reads", t1, p1);
+  free(p1);
+  ImageDestroy(&t1);
+  ImageDestroy(&t2);
+  ImageDestroy(&r1);
+  ImageDestroy(&r2);
+}
+
+// Locate a subimage with 128 threads requested (more than MAXTHREADS, so
+// the job is capped), and compare to a single thread and to brute force.
+static void checkThreads(void) {
+  Image img1 = randomImage(200, 150, 4);
+  Image img2 = ImageCreate(20, 20, 255);
+  if (img2 == NULL) error(2, errno, "Creating image: %s", ImageErrMsg());
+  for (int j = 0; j < 20; j++) {
+    for (int i = 0; i < 20; i++) ImageSetPixel(img2, i, j, ImageGetPixel(img1, 150 + i, 100 + j));
+  }
+  ImageSetPixel(img2, 10, 10, (uint8)(ImageGetPixel(img2, 10, 10) ^ 1));  // no exact match
+  int rx = -1, ry = -1;
+  int want = refLocate(img1, img2, &rx, &ry);
+  for (int nt = 1; nt <= 128; nt *= 128) {
+    ImageSetThreads(nt);
+    int x = -1, y = -1;
+    int found = ImageLocateSubImage(img1, &x, &y, img2);
+    if (found != want) fail("ImageLocateSubImage", "found, with threads", nt, 0, found, want);
+    else if (want && (x != rx || y != ry)) {
+      fail("ImageLocateSubImage", "position x*1000+y, with threads", nt, 0, x * 1000L + y, rx * 1000L + ry);
+    }
+    x = y = -1;
+    found = ImageLocateWithin(img1, &x, &y, img2, 1);
+    if (!found || x != 150 || y != 100) {
+      fail("ImageLocateWithin", "position x*1000+y, with threads", nt, 0, x * 1000L + y, 150100);
+    }
+    unsigned long sad = 99;
+    x = y = -1;
+    found = ImageLocateBest(img1, &x, &y, img2, &sad);
+    if (!found || sad != 1 || x != 150 || y != 100) {
+      fail("ImageLocateBest", "SAD*1000000+x*1000+y, with threads", nt, 0,
+           (long)sad * 1000000 + x * 1000L + y, 1150100);
+    }
+  }
+  ImageSetThreads(0);
+  ImageDestroy(&img2);
+  ImageDestroy(&img1);
+}
+
+int main(int ac, char* av[]) {
+  program_name = av[0];
+  if (ac != 2) {
+    error(1, 0, "\n%s", USAGE);
+  }
+
+  ImageInit();
+  srand(2023);
+
+  if (strcmp(av[1], "blur") == 0) {
+    checkBlur();
+  } else if (strcmp(av[1], "conv") == 0) {
+    checkConv();
+  } else if (strcmp(av[1], "median") == 0) {
+    checkMedian();
+  } else if (strcmp(av[1], "morph") == 0) {
+    checkMorph();
+  } else if (strcmp(av[1], "label") == 0) {
+    checkLabel();
+  } else if (strcmp(av[1], "dist") == 0) {
+    checkDist();
+  } else if (strcmp(av[1], "locatesad") == 0) {
+    checkLocateSad();
+  } else if (strcmp(av[1], "locatemany") == 0) {
+    checkLocateMany();
+  } else if (strcmp(av[1], "cow") == 0) {
+    checkCow();
+  } else if (strcmp(av[1], "cache") == 0) {
+    checkCache();
+  } else if (strcmp(av[1], "layout") == 0) {
+    checkLayout();
+  } else if (strcmp(av[1], "threads") == 0) {
+    checkThreads();
+  } else {
+    error(1, 0, "Unknown check: %s\n%s", av[1], USAGE);
+  }
+
+  printf("# %s (%s kernels): %s\n", av[1], ImageKernels(), fails == 0 ? "OK" : "FAILED");
+  return fails == 0 ? 0 : 3;
+}
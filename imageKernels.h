@@ -0,0 +1,137 @@
+/// imageKernels - Inner loops of image8bit, for one instruction set.
+///
+/// This file is part of the image8bit module.
+/// It has no include guard on purpose: image8bit.c includes it once for
+/// each instruction set level, after defining KLEVEL to a suffix for the
+/// function names (and selecting the target with #pragma GCC target).
+/// Each inclusion defines a set of static kernels, named name_KLEVEL, and
+/// a table of them, kernels_KLEVEL, of type struct kernels.
+///
+/// Kernels work on plain arrays of pixels, one row (or block) at a time.
+/// They are written as simple loops over pixels, which the compiler
+/// vectorizes with the instructions of the selected target.
+
+#ifndef KLEVEL
+#error "KLEVEL must be defined before including imageKernels.h"
+#endif
+
+#define KNAME(name) KCAT(name, KLEVEL)
+
+// Apply a lookup table to n pixels, in-place.
+static void KNAME(lutRow_)(uint8* restrict row, int n, const uint8* restrict lut) {
+  for (int i = 0; i < n; i++) row[i] = lut[row[i]];
+}
+
+// Blend n pixels of src into dst with the given alpha:
+// dst = (1-alpha)*dst + alpha*src, rounded (as in ImageBlend).
+// Fused multiply-adds would round differently on some targets, so they
+// are disabled here.
+#pragma GCC push_options
+#pragma GCC optimize ("fp-contract=off")
+static void KNAME(blendRow_)(uint8* restrict dst, const uint8* restrict src,
+                             int n, double alpha) {
+  const double beta = 1 - alpha;
+  for (int i = 0; i < n; i++) dst[i] = (uint8)(int)(beta * dst[i] + alpha * src[i] + 0.5);
+}
+#pragma GCC pop_options
+
+// Store the n pixels of src in reverse order into dst.
+static void KNAME(mirrorRow_)(uint8* restrict dst, const uint8* restrict src, int n) {
+  for (int i = 0; i < n; i++) dst[i] = src[n - 1 - i];
+}
+
+// Rotate a block of bw x bh pixels 90 degrees counter-clockwise.
+// src points to the top left pixel of the block, and dst to the pixel
+// where it goes: column i of the block goes to the row dstride*i bytes
+// before dst.
+static void KNAME(rotateBlock_)(const uint8* restrict src, int sstride,
+                                uint8* restrict dst, int dstride, int bw, int bh) {
+  for (int i = 0; i < bw; i++) {
+    uint8* d = dst - (long)i * dstride;
+    for (int j = 0; j < bh; j++) d[j] = src[(size_t)j * sstride + i];
+  }
+}
+
+// Add n pixels to n sums.
+static void KNAME(addRow_)(uint32_t* restrict sum, const uint8* restrict s, int n) {
+  for (int i = 0; i < n; i++) sum[i] += s[i];
+}
+
+// Subtract n pixels from n sums.
+static void KNAME(subRow_)(uint32_t* restrict sum, const uint8* restrict s, int n) {
+  for (int i = 0; i < n; i++) sum[i] -= s[i];
+}
+
+// Sum of absolute differences of n pixels.
+static unsigned KNAME(sadRow_)(const uint8* restrict a, const uint8* restrict b, int n) {
+  unsigned sum = 0;
+  for (int i = 0; i < n; i++) sum += a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+  return sum;
+}
+
+// Sobel gradient magnitude of the pixels x = 1..n-2 of row b, given the
+// rows above (a) and below (c).  The magnitude is |gx| + |gy| or, if l2,
+// max + 3/8 min of |gx| and |gy| (within 7% of the Euclidean norm).
+// If thr >= 0, out[x] is 255 for a magnitude >= thr and 0 otherwise;
+// else it is the magnitude, saturated at 255.
+static void KNAME(sobelRow_)(const uint8* restrict a, const uint8* restrict b,
+                             const uint8* restrict c, uint8* restrict out,
+                             int n, int l2, int thr) {
+  for (int x = 1; x < n - 1; x++) {
+    int16_t gx = (int16_t)((a[x+1] + 2*b[x+1] + c[x+1]) - (a[x-1] + 2*b[x-1] + c[x-1]));
+    int16_t gy = (int16_t)((c[x-1] + 2*c[x] + c[x+1]) - (a[x-1] + 2*a[x] + a[x+1]));
+    int16_t ax = gx < 0 ? -gx : gx, ay = gy < 0 ? -gy : gy;
+    int16_t hi = ax > ay ? ax : ay, lo = ax > ay ? ay : ax;
+    int16_t m = l2 ? hi + ((3*lo) >> 3) : ax + ay;
+    out[x] = thr >= 0 ? (m >= thr ? 255 : 0) : (m > 255 ? 255 : m);
+  }
+}
+
+// Define the row kernel of a blur with a (2DX+1)x(2DY+1) window.
+// s points to the first window row, w pixels wide (rows are w apart).
+// Computes the column sums col[0..w-1] and the means of the interior
+// pixels out[DX..w-DX-1], rounded as (sum+count/2)/count.
+// The window size is a constant, so the loops over the window unroll and
+// the division becomes a multiplication.
+#define KBLURROW(DX, DY)                                                  \
+static void KNAME(blurRow_##DX##_##DY##_)(const uint8* restrict s, int w, \
+                               uint16_t* restrict col, uint8* restrict out) { \
+  const uint32_t count = (2*DX + 1) * (2*DY + 1);                         \
+  for (int x = 0; x < w; x++) {                                           \
+    uint16_t c = 0;                                                       \
+    for (int j = 0; j <= 2*DY; j++) c += s[(size_t)j * w + x];            \
+    col[x] = c;                                                           \
+  }                                                                       \
+  for (int x = DX; x < w - DX; x++) {                                     \
+    uint32_t sum = 0;                                                     \
+    for (int i = -DX; i <= DX; i++) sum += col[x + i];                    \
+    out[x] = (uint8)((sum + count/2) / count);                            \
+  }                                                                       \
+}
+
+#define KBLURROWS(DY) KBLURROW(0, DY) KBLURROW(1, DY) KBLURROW(2, DY) KBLURROW(3, DY)
+KBLURROWS(0)
+KBLURROWS(1)
+KBLURROWS(2)
+KBLURROWS(3)
+
+#define KBLURTAB(DY) { KNAME(blurRow_0_##DY##_), KNAME(blurRow_1_##DY##_), \
+                       KNAME(blurRow_2_##DY##_), KNAME(blurRow_3_##DY##_) }
+
+// The kernels of this instruction set level
+static const struct kernels KNAME(kernels_) = {
+  .lutRow = KNAME(lutRow_),
+  .blendRow = KNAME(blendRow_),
+  .mirrorRow = KNAME(mirrorRow_),
+  .rotateBlock = KNAME(rotateBlock_),
+  .addRow = KNAME(addRow_),
+  .subRow = KNAME(subRow_),
+  .sadRow = KNAME(sadRow_),
+  .sobelRow = KNAME(sobelRow_),
+  .blurRow = { KBLURTAB(0), KBLURTAB(1), KBLURTAB(2), KBLURTAB(3) },
+};
+
+#undef KBLURTAB
+#undef KBLURROWS
+#undef KBLURROW
+#undef KNAME
@@ -39,29 +39,66 @@ static const char* USAGE =
     "  save FILE       Save CURR to PGM file\n"
     "  info            Show information on CURR (size and range)\n"
     "  tic             Reset instrumentation counters and times.\n"
-    "  toc             Print instrumentation counters and times.\n"
+    "  toc             Print instrumentation counters, times and rates.\n"
+    "  tocjson         Print the same as toc, as one JSON line.\n"
+    "  trace FILE      Write trace of next operations to FILE (Chrome JSON).\n"
+    "                  (Or set IMAGE8BIT_TRACE=FILE to trace everything.)\n"
     "\n"              
     "  neg             Apply photo-negative effect to CURR\n"
     "  thr LEVEL       Apply thresholding to CURR\n"
     "  bri FACTOR      Scale brightness in CURR by FACTOR\n"
     "\n"              
     "  create W,H      Create new black image with WxH pixels\n"
+    "  clone           Clone CURR, creating new image (pixels are shared until\n"
+    "                  either image is modified)\n"
+    "  layout L        Store CURR pixels in layout L: raster, or tiled (64x64 tiles)\n"
     "  rotate          Rotate CURR 90º counter-clockwise, creating new image\n"
+    "  turn DEGREES    Rotate CURR counter-clockwise by any angle, creating new image\n"
+    "  warp M,W,H      Apply affine map M=A,B,C,D,E,F: (x,y)->(Ax+By+C,Dx+Ey+F)\n"
+    "                  to CURR, creating new WxH image\n"
     "  mirror          Mirror CURR left-to-right, creating new image\n"
     "  crop X,Y,W,H    Crop a rectangle from CURR, creating new image\n"
+    "  resize W,H      Resize CURR to WxH pixels, creating new image\n"
     "\n"              
     "  paste X,Y       Paste PRED into CURR at position (X,Y)\n"
     "  blend X,Y,alpha Blend PRED into CURR at position (X,Y) with given alpha\n"
     "\n"              
     "  locate          Search PRED in CURR, print matching position, or NOTFOUND\n"
+    "  locate~ MAXERR  Search PRED in CURR allowing a mean absolute error up to\n"
+    "                  MAXERR per pixel, print first matching position, or NOTFOUND\n"
+    "  best            Search PRED in CURR, print the closest position and its error\n"
+    "  locateall K     Search each of the K images before CURR in CURR, in a\n"
+    "                  single scan, print their matching positions, or NOTFOUND\n"
+    "  index           Build a search index of CURR, for find\n"
+    "  saveindex FILE  Save the search index to FILE\n"
+    "  loadindex FILE  Load a search index of CURR from FILE\n"
+    "  find            Search CURR in the indexed image, print matching position,\n"
+    "                  or NOTFOUND\n"
     "\n"              
     "  blur DX,DY      blur CURR using (2DX+1)x(2Dy+1) mean filter\n"
+    "  blurred DX,DY   blurred copy of CURR, creating new image (cached: only\n"
+    "                  the region changed since the last copy is recomputed)\n"
+    "  median DX,DY    apply (2DX+1)x(2DY+1) median filter to CURR\n"
+    "  erode DX,DY     erode CURR with (2DX+1)x(2DY+1) rectangle (local min)\n"
+    "  dilate DX,DY    dilate CURR with (2DX+1)x(2DY+1) rectangle (local max)\n"
+    "  open DX,DY      erode and then dilate CURR\n"
+    "  close DX,DY     dilate and then erode CURR\n"
+    "  gauss SIGMA     blur CURR using approximate Gaussian filter\n"
+    "  sepconv K       convolve rows and then columns of CURR with kernel K\n"
+    "  conv NX,NY,K    convolve CURR with NXxNY kernel K (given row by row)\n"
+    "  label C         label connected components of nonzero pixels of CURR with\n"
+    "                  connectivity C (4 or 8), print table of components\n"
+    "  dist            distance from each pixel of CURR to the nearest nonzero pixel\n"
+    "                  (saturated at 255), creating new image\n"
+    "  edges N[,T]     Sobel gradient norm of CURR, N=l1 or l2 (approximate),\n"
+    "                  thresholded at T if given, creating new image\n"
     "\n"              
     "OPERANDS:\n"     
     "  X,Y             Pixel coordinates: 0,0 is top left corner\n"
     "  DX,DY           Displacement\n"
     "  W,H             Width and height of image or rectangular region\n"
     "  alpha           Blending factor\n"
+    "  K               Kernel weights W0,W1,... (odd number of weights)\n"
     "\n"
     ;
 
@@ -74,9 +111,35 @@ static char* errors[] = {
   "Invalid operand",
   "Invalid rect (overflow)",
   "Invalid alpha",
+  "Cannot create trace file",
+  "No search index",
 };
 
 
+// Maximum number of kernel weights accepted in operands
+#define MAXWEIGHTS 256
+
+// Parse a list of comma-separated numbers from s into v[0..max-1].
+// Returns the number of values parsed, or -1 if s is invalid or too long.
+static int parseList(const char* s, double* v, int max) {
+  int n = 0;
+  int len;
+  while (n < max && sscanf(s, "%lf%n", &v[n], &len) == 1) {
+    n++;
+    s += len;
+    if (*s == '\0') return n;
+    if (*s++ != ',') return -1;
+  }
+  return -1;
+}
+
+// Sum of the absolute values of v[0..n-1].
+static double sumAbs(const double* v, int n) {
+  double sum = 0.0;
+  for (int i = 0; i < n; i++) sum += v[i] < 0.0 ? -v[i] : v[i];
+  return sum;
+}
+
 // This program strives for correctness and robustness.
 // You may want to temporarily comment out operand validation, namely
 // precondition checks, so that you can force precondition violations, and
@@ -100,9 +163,14 @@ int main(int ac, char* av[]) {
   const int N = 10;   // buffer capacity
   Image img[N];     // the images
   int n = 0;          // number of images created
+  ImageIndex index = NULL;  // the search index (of some image)
 
   int k = 1;
   while (k < ac) {
+    // Trace each operation as a span, named as in the command line
+    char args[64];
+    snprintf(args, sizeof(args), "\"arg\":%d,\"image\":%d", k, n-1);
+    InstrTraceBegin(av[k], args);
     if (strcmp(av[k], "info") == 0) {
       if (n < 1) { err = 2; break; }
       fprintf(stderr, "Info on I%d\n", n-1);
@@ -117,24 +185,29 @@ int main(int ac, char* av[]) {
       InstrReset();
     } else if (strcmp(av[k], "toc") == 0) {
       InstrPrint();
+    } else if (strcmp(av[k], "tocjson") == 0) {
+      InstrPrintJSON();
+    } else if (strcmp(av[k], "trace") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (!InstrTraceOpen(av[k])) { err = 8; break; }
     } else if (strcmp(av[k], "neg") == 0) {
       if (n < 1) { err = 2; break; }
       fprintf(stderr, "Negating I%d\n", n-1);
-      ImageNegative(img[n-1]);
+      if (!ImageNegative(img[n-1])) { err = 4; break; }
     } else if (strcmp(av[k], "thr") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
       uint8 thr;
       if (sscanf(av[k], "%hhu", &thr) != 1) { err = 5; break; }
       fprintf(stderr, "Thresholding I%d at %d\n", n-1, thr);
-      ImageThreshold(img[n-1], (uint8)thr);
+      if (!ImageThreshold(img[n-1], (uint8)thr)) { err = 4; break; }
     } else if (strcmp(av[k], "bri") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
       double factor;
       if (sscanf(av[k], "%lf", &factor) != 1) { err = 5; break; }
       fprintf(stderr, "Brightening I%d by %lf\n", n-1, factor);
-      ImageBrighten(img[n-1], factor);
+      if (!ImageBrighten(img[n-1], factor)) { err = 4; break; }
     } else if (strcmp(av[k], "create") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n >= N) { err = 3; break; }
@@ -151,6 +224,44 @@ int main(int ac, char* av[]) {
       img[n] = ImageRotate(img[n-1]);
       if (img[n] == NULL) { err = 4; break; }
       n++;
+    } else if (strcmp(av[k], "turn") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      if (n >= N) { err = 3; break; }
+      double degrees;
+      if (sscanf(av[k], "%lf", &degrees) != 1) { err = 5; break; }
+      fprintf(stderr, "Rotating I%d by %.3f degrees -> I%d\n", n-1, degrees, n);
+      img[n] = ImageRotateAngle(img[n-1], degrees, RESAMPLE_BILINEAR);
+      if (img[n] == NULL) { err = 4; break; }
+      n++;
+    } else if (strcmp(av[k], "warp") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      if (n >= N) { err = 3; break; }
+      double m[8];
+      if (parseList(av[k], m, 8) != 8) { err = 5; break; }
+      w = (int)m[6]; h = (int)m[7];
+      if (w < 0 || h < 0 || m[0]*m[4] - m[1]*m[3] == 0.0) { err = 5; break; }   // precondition check!
+      fprintf(stderr, "Warping I%d to %dx%d -> I%d\n", n-1, w, h, n);
+      img[n] = ImageWarpAffine(img[n-1], m, w, h, RESAMPLE_BILINEAR);
+      if (img[n] == NULL) { err = 4; break; }
+      n++;
+    } else if (strcmp(av[k], "layout") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      ImageLayout layout;
+      if (strcmp(av[k], "raster") == 0) layout = LAYOUT_RASTER;
+      else if (strcmp(av[k], "tiled") == 0) layout = LAYOUT_TILED;
+      else { err = 5; break; }
+      fprintf(stderr, "Layout of I%d: %s\n", n-1, av[k]);
+      if (!ImageSetLayout(img[n-1], layout)) { err = 4; break; }
+    } else if (strcmp(av[k], "clone") == 0) {
+      if (n < 1) { err = 2; break; }
+      if (n >= N) { err = 3; break; }
+      fprintf(stderr, "Cloning I%d -> I%d\n", n-1, n);
+      img[n] = ImageClone(img[n-1]);
+      if (img[n] == NULL) { err = 4; break; }
+      n++;
     } else if (strcmp(av[k], "mirror") == 0) {
       if (n < 1) { err = 2; break; }
       if (n >= N) { err = 3; break; }
@@ -168,6 +279,17 @@ int main(int ac, char* av[]) {
       img[n] = ImageCrop(img[n-1], x, y, w, h);
       if (img[n] == NULL) { err = 4; break; }
       n++;
+    } else if (strcmp(av[k], "resize") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      if (n >= N) { err = 3; break; }
+      if (sscanf(av[k], "%d,%d", &w, &h) != 2) { err = 5; break; }
+      if (w <= 0 || h <= 0) { err = 5; break; }   // precondition check!
+      if (ImageWidth(img[n-1]) == 0 || ImageHeight(img[n-1]) == 0) { err = 5; break; }
+      fprintf(stderr, "Resizing I%d to %dx%d -> I%d\n", n-1, w, h, n);
+      img[n] = ImageResize(img[n-1], w, h, RESAMPLE_AUTO);
+      if (img[n] == NULL) { err = 4; break; }
+      n++;
     } else if (strcmp(av[k], "paste") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 2) { err = 2; break; }
@@ -176,7 +298,7 @@ int main(int ac, char* av[]) {
       h = ImageHeight(img[n-2]);
       if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 6; break; }
       fprintf(stderr, "Pasting I%d at I%d (%d,%d)\n", n-2, n-1, x, y);
-      ImagePaste(img[n-1], x, y, img[n-2]);
+      if (!ImagePaste(img[n-1], x, y, img[n-2])) { err = 4; break; }
     } else if (strcmp(av[k], "blend") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 2) { err = 2; break; }
@@ -186,7 +308,7 @@ int main(int ac, char* av[]) {
       h = ImageHeight(img[n-2]);
       if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 6; break; }
       fprintf(stderr, "Blending I%d with I%d@(%d,%d) with alpha=%.3f\n", n-2, n-1, x, y, alpha);
-      ImageBlend(img[n-1], x, y, img[n-2], alpha);
+      if (!ImageBlend(img[n-1], x, y, img[n-2], alpha)) { err = 4; break; }
     } else if (strcmp(av[k], "locate") == 0) {
       if (n < 2) { err = 2; break; }
       fprintf(stderr, "Locating I%d in I%d\n", n-2, n-1);
@@ -195,13 +317,182 @@ int main(int ac, char* av[]) {
       } else {
         printf("# NOTFOUND\n");
       }
+    } else if (strcmp(av[k], "locateall") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      int m;
+      if (sscanf(av[k], "%d", &m) != 1 || m < 1) { err = 5; break; }
+      if (n < m + 1) { err = 2; break; }
+      fprintf(stderr, "Locating I%d..I%d in I%d\n", n-1-m, n-2, n-1);
+      ImageMatch found[N];
+      if (!ImageLocateMany(img[n-1], &img[n-1-m], m, found)) { err = 4; break; }
+      for (int i = 0; i < m; i++) {
+        if (found[i].found) {
+          printf("# I%d FOUND (%d,%d)\n", n-1-m+i, found[i].x, found[i].y);
+        } else {
+          printf("# I%d NOTFOUND\n", n-1-m+i);
+        }
+      }
+    } else if (strcmp(av[k], "index") == 0) {
+      if (n < 1) { err = 2; break; }
+      fprintf(stderr, "Indexing I%d\n", n-1);
+      ImageIndexDestroy(&index);
+      index = ImageIndexCreate(img[n-1]);
+      if (index == NULL) { err = 4; break; }
+    } else if (strcmp(av[k], "saveindex") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (index == NULL) { err = 9; break; }
+      fprintf(stderr, "Saving index %s\n", av[k]);
+      if (!ImageIndexSave(index, av[k])) { err = 4; break; }
+    } else if (strcmp(av[k], "loadindex") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      fprintf(stderr, "Loading index %s of I%d\n", av[k], n-1);
+      ImageIndexDestroy(&index);
+      index = ImageIndexLoad(av[k], img[n-1]);
+      if (index == NULL) { err = 4; break; }
+    } else if (strcmp(av[k], "find") == 0) {
+      if (n < 1) { err = 2; break; }
+      if (index == NULL) { err = 9; break; }
+      fprintf(stderr, "Finding I%d in indexed image\n", n-1);
+      if (ImageIndexLocate(index, &x, &y, img[n-1])) {
+        printf("# FOUND (%d,%d)\n", x, y);
+      } else {
+        printf("# NOTFOUND\n");
+      }
+    } else if (strcmp(av[k], "locate~") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 2) { err = 2; break; }
+      double maxerr;
+      if (sscanf(av[k], "%lf", &maxerr) != 1 || maxerr < 0.0) { err = 5; break; }
+      w = ImageWidth(img[n-2]);
+      h = ImageHeight(img[n-2]);
+      unsigned long maxSad = (unsigned long)(maxerr * w * h);
+      fprintf(stderr, "Locating I%d in I%d with SAD <= %lu\n", n-2, n-1, maxSad);
+      if (ImageLocateWithin(img[n-1], &x, &y, img[n-2], maxSad)) {
+        printf("# FOUND (%d,%d)\n", x, y);
+      } else {
+        printf("# NOTFOUND\n");
+      }
+    } else if (strcmp(av[k], "best") == 0) {
+      if (n < 2) { err = 2; break; }
+      fprintf(stderr, "Locating best match of I%d in I%d\n", n-2, n-1);
+      unsigned long sad;
+      if (ImageLocateBest(img[n-1], &x, &y, img[n-2], &sad)) {
+        w = ImageWidth(img[n-2]);
+        h = ImageHeight(img[n-2]);
+        printf("# BEST (%d,%d) SAD %lu (%.3f per pixel)\n", x, y, sad, w*h > 0 ? (double)sad/(w*h) : 0.0);
+      } else {
+        printf("# NOTFOUND\n");
+      }
     } else if (strcmp(av[k], "blur") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
       int dx; int dy;
       if (sscanf(av[k], "%d,%d", &dx, &dy) != 2) { err = 5; break; }
+      if (dx < 0 || dy < 0) { err = 5; break; }   // precondition check!
       fprintf(stderr, "Blur I%d with %dx%d mean filter\n", n-1, 2*dx+1, 2*dy+1);
-      ImageBlur(img[n-1], dx, dy);
+      if (!ImageBlur(img[n-1], dx, dy)) { err = 4; break; }
+    } else if (strcmp(av[k], "blurred") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      if (n >= N) { err = 3; break; }
+      int dx; int dy;
+      if (sscanf(av[k], "%d,%d", &dx, &dy) != 2) { err = 5; break; }
+      if (dx < 0 || dy < 0) { err = 5; break; }   // precondition check!
+      fprintf(stderr, "Blurred copy of I%d with %dx%d mean filter -> I%d\n", n-1, 2*dx+1, 2*dy+1, n);
+      img[n] = ImageBlurred(img[n-1], dx, dy);
+      if (img[n] == NULL) { err = 4; break; }
+      n++;
+    } else if (strcmp(av[k], "label") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      int conn;
+      if (sscanf(av[k], "%d", &conn) != 1 || (conn != 4 && conn != 8)) { err = 5; break; }
+      fprintf(stderr, "Labeling I%d with %d-connectivity\n", n-1, conn);
+      uint32_t* labels;
+      ImageComponent* comp;
+      int nc = ImageLabel(img[n-1], conn, &labels, &comp);
+      if (nc < 0) { err = 4; break; }
+      printf("# Components: %d\n", nc);
+      printf("# label      area       x       y   width  height        cx        cy\n");
+      for (int i = 0; i < nc; i++) {
+        printf("# %5d %9ld %7d %7d %7d %7d %9.2f %9.2f\n", i + 1, comp[i].area,
+               comp[i].x, comp[i].y, comp[i].width, comp[i].height, comp[i].cx, comp[i].cy);
+      }
+      free(labels);
+      free(comp);
+    } else if (strcmp(av[k], "dist") == 0) {
+      if (n < 1) { err = 2; break; }
+      if (n >= N) { err = 3; break; }
+      fprintf(stderr, "Distance transform of I%d -> I%d\n", n-1, n);
+      img[n] = ImageDistanceTransform(img[n-1]);
+      if (img[n] == NULL) { err = 4; break; }
+      n++;
+    } else if (strcmp(av[k], "edges") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      if (n >= N) { err = 3; break; }
+      char norm[3];
+      int thr = -1;
+      int got = sscanf(av[k], "%2[l12],%d", norm, &thr);
+      if (got < 1 || (strcmp(norm, "l1") != 0 && strcmp(norm, "l2") != 0)) { err = 5; break; }
+      if (got == 2 && thr < 0) { err = 5; break; }
+      fprintf(stderr, "Edges of I%d (%s norm, threshold %d) -> I%d\n", n-1, norm, thr, n);
+      img[n] = ImageSobel(img[n-1], norm[1] == '2' ? SOBEL_L2 : SOBEL_L1, thr);
+      if (img[n] == NULL) { err = 4; break; }
+      n++;
+    } else if (strcmp(av[k], "median") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      int dx; int dy;
+      if (sscanf(av[k], "%d,%d", &dx, &dy) != 2) { err = 5; break; }
+      if (dx < 0 || dy < 0) { err = 5; break; }   // precondition check!
+      fprintf(stderr, "Median I%d with %dx%d filter\n", n-1, 2*dx+1, 2*dy+1);
+      if (!ImageMedian(img[n-1], dx, dy)) { err = 4; break; }
+    } else if (strcmp(av[k], "erode") == 0 || strcmp(av[k], "dilate") == 0 ||
+               strcmp(av[k], "open") == 0 || strcmp(av[k], "close") == 0) {
+      const char* op = av[k];
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      int dx; int dy;
+      if (sscanf(av[k], "%d,%d", &dx, &dy) != 2) { err = 5; break; }
+      if (dx < 0 || dy < 0) { err = 5; break; }   // precondition check!
+      fprintf(stderr, "Morphology %s I%d with %dx%d rectangle\n", op, n-1, 2*dx+1, 2*dy+1);
+      int ok;
+      switch (op[0]) {
+        case 'e': ok = ImageErode(img[n-1], dx, dy); break;
+        case 'd': ok = ImageDilate(img[n-1], dx, dy); break;
+        case 'o': ok = ImageOpen(img[n-1], dx, dy); break;
+        default: ok = ImageClose(img[n-1], dx, dy); break;
+      }
+      if (!ok) { err = 4; break; }
+    } else if (strcmp(av[k], "gauss") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      double sigma;
+      if (sscanf(av[k], "%lf", &sigma) != 1 || sigma < 0.0) { err = 5; break; }
+      fprintf(stderr, "Gaussian blur I%d with sigma=%.3f\n", n-1, sigma);
+      if (!ImageGaussianBlur(img[n-1], sigma)) { err = 4; break; }
+    } else if (strcmp(av[k], "sepconv") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      double kern[MAXWEIGHTS];
+      int nk = parseList(av[k], kern, MAXWEIGHTS);
+      if (nk < 1 || nk % 2 == 0) { err = 5; break; }
+      if (sumAbs(kern, nk) > 8.0) { err = 5; break; }   // precondition check!
+      fprintf(stderr, "Convolve I%d with separable %dx%d kernel\n", n-1, nk, nk);
+      if (!ImageConvolveSeparable(img[n-1], kern, nk, kern, nk)) { err = 4; break; }
+    } else if (strcmp(av[k], "conv") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      double kern[MAXWEIGHTS+2];
+      int nk = parseList(av[k], kern, MAXWEIGHTS+2);
+      if (nk < 3) { err = 5; break; }
+      int nx = (int)kern[0]; int ny = (int)kern[1];
+      if (nx < 1 || nx % 2 == 0 || ny < 1 || ny % 2 == 0 || nk != 2 + nx*ny) { err = 5; break; }
+      if (sumAbs(kern+2, nx*ny) > 2048.0) { err = 5; break; }   // precondition check!
+      fprintf(stderr, "Convolve I%d with %dx%d kernel\n", n-1, nx, ny);
+      if (!ImageConvolve(img[n-1], kern+2, nx, ny)) { err = 4; break; }
     } else if (strcmp(av[k], "save") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
@@ -214,9 +505,18 @@ int main(int ac, char* av[]) {
       if (img[n] == NULL) { err = 4; break; }
       n++;
     }
+    if (n > 0) {
+      snprintf(args, sizeof(args), "\"image\":%d,\"width\":%d,\"height\":%d",
+               n-1, ImageWidth(img[n-1]), ImageHeight(img[n-1]));
+    }
+    InstrTraceEnd(n > 0 ? args : NULL);
     k++;
   }
+  // A failed operation leaves its span open
+  if (err != 0) InstrTraceEnd(NULL);
   
+  ImageIndexDestroy(&index);
+
   // Destroy remaining images
   while (n > 0) {
     ImageDestroy(&img[--n]);
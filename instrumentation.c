@@ -13,19 +13,28 @@
 /// ...
 /// InstrReset();  // reset to zero
 /// for (...) {
-///   InstrCount[0] += 3;  // to count array acesses
-///   InstrCount[1] += 1;  // to count addition
+///   InstrAddExact(0, 3);  // to count array acesses
+///   InstrAddExact(1, 1);  // to count addition
 ///   a[k] = a[i] + a[j];
 /// }
+/// InstrAdd(0, 3*n);  // or count once, after the loop
 /// InstrPrint();  // to show time and counters
 
 #include "instrumentation.h"
+#include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 /// Cpu time in seconds
 double cpu_time(void) ; ///
 
+/// Wall clock time in seconds (monotonic, since some arbitrary moment)
+double wall_time(void) ; ///
+
+/// Cpu time of the calling thread in seconds
+double thread_time(void) ; ///
+
 #if defined(__linux__) || defined(__APPLE__)
 
 //
@@ -42,6 +51,22 @@ double cpu_time(void) {
   return (double)current_time.tv_sec + 1.0e-9 * (double)current_time.tv_nsec;
 }
 
+double wall_time(void) {
+  struct timespec current_time;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &current_time) != 0)
+    return -1.0; // clock_gettime() failed!!!
+  return (double)current_time.tv_sec + 1.0e-9 * (double)current_time.tv_nsec;
+}
+
+double thread_time(void) {
+  struct timespec current_time;
+
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &current_time) != 0)
+    return -1.0; // clock_gettime() failed!!!
+  return (double)current_time.tv_sec + 1.0e-9 * (double)current_time.tv_nsec;
+}
+
 #endif
 
 
@@ -66,19 +91,36 @@ double cpu_time(void) {
   return (double)current_time.QuadPart / (double)frequency.QuadPart;
 }
 
+// cpu_time already measures wall clock time here
+double wall_time(void) {
+  return cpu_time();
+}
+
+double thread_time(void) {
+  return cpu_time();
+}
+
 #endif
 
-/// Array of operation counters:
-unsigned long InstrCount[NUMCOUNTERS];  ///extern
+/// State of the calling thread, used unless InstrUse selects another one
+_Thread_local InstrState InstrOwn;  ///extern
+
+/// State in use by the calling thread (NULL: InstrOwn)
+_Thread_local InstrState* InstrCur = NULL;  ///extern
+
+/// Make the calling thread count into state s (NULL: its own, InstrOwn).
+/// Returns the state used before (NULL if it was InstrOwn).
+InstrState* InstrUse(InstrState* s) { ///
+  InstrState* old = InstrCur;
+  InstrCur = s;
+  return old;
+}
 
 /// Array of names for the counters:
 char* InstrName[NUMCOUNTERS] = {NULL};  ///extern
     // All elements initialized to NULL
     // See: https://en.cppreference.com/w/c/language/array_initialization
 
-/// Cpu_time read on previous reset (~seconds)
-double InstrTime;  ///extern
-
 /// Calibrated Time Unit (in seconds, initially 1s)
 double InstrCTU = 1.0;  ///extern
 
@@ -101,29 +143,219 @@ void InstrCalibrate(void) { ///
   InstrCTU = cpu_time() - time;
 }
 
-/// Reset counters to zero and store cpu_time.
+/// Reset counters to zero and store cpu_time, wall_time and thread_time
+/// (in the state of the calling thread).
 void InstrReset(void) { ///
   for (int i = 0; i < NUMCOUNTERS; i++)
     InstrCount[i] = 0ul;
+  InstrPixels = InstrBytes = 0ul;
   InstrTime = cpu_time();
+  InstrWallTime = wall_time();
+  InstrThreadTime = thread_time();
+}
+
+// Times and rates since the last reset
+struct instrTimes {
+  double time;      // process cpu time
+  double caltime;   // process cpu time in calibrated time units
+  double walltime;  // wall clock time
+  double thrtime;   // cpu time of this thread
+  double mpixps;    // millions of pixels processed per (wall clock) second
+  double bps;       // bytes accessed per (wall clock) second
+};
+
+static struct instrTimes instrTimes(void) {
+  struct instrTimes t;
+  t.time = cpu_time() - InstrTime;
+  t.caltime = t.time / InstrCTU;
+  t.walltime = wall_time() - InstrWallTime;
+  t.thrtime = thread_time() - InstrThreadTime;
+  t.mpixps = t.walltime > 0.0 ? InstrPixels / t.walltime * 1e-6 : 0.0;
+  t.bps = t.walltime > 0.0 ? InstrBytes / t.walltime : 0.0;
+  return t;
 }
 
-// Print times and all named counter values
+// Print times and all named counter values, followed by
+// wall clock time, thread time and rates
 void InstrPrint(void) { ///
   // elapsed time since last reset:
-  double time = cpu_time() - InstrTime;
-  // compute time in calibrated time units:
-  double caltime = time / InstrCTU;
+  struct instrTimes t = instrTimes();
 
   printf("#%14.15s\t%15.15s", "time", "caltime");
   for (int i = 0; i < NUMCOUNTERS; i++)
     if (InstrName[i] != NULL)
       printf("\t%15.15s", InstrName[i]);
+  printf("\t%15.15s\t%15.15s\t%15.15s\t%15.15s", "walltime", "thrtime", "MPix/s", "MB/s");
   puts("");
-  printf("%15.6f\t%15.6f", time, caltime);
+  printf("%15.6f\t%15.6f", t.time, t.caltime);
   for (int i = 0; i < NUMCOUNTERS; i++)
     if (InstrName[i] != NULL)
       printf("\t%15lu", InstrCount[i]);  
+  printf("\t%15.6f\t%15.6f\t%15.3f\t%15.3f", t.walltime, t.thrtime, t.mpixps, t.bps * 1e-6);
   puts("");
 }
 
+/// Print the same data as InstrPrint, as a JSON object in a single line.
+/// Times are in seconds and rates per second.
+void InstrPrintJSON(void) { ///
+  struct instrTimes t = instrTimes();
+
+  printf("{\"time\":%.6f,\"caltime\":%.6f,\"walltime\":%.6f,\"thrtime\":%.6f",
+         t.time, t.caltime, t.walltime, t.thrtime);
+  printf(",\"pixels\":%lu,\"bytes\":%lu,\"pixels_per_s\":%.0f,\"bytes_per_s\":%.0f",
+         InstrPixels, InstrBytes, t.mpixps * 1e6, t.bps);
+  for (int i = 0; i < NUMCOUNTERS; i++)
+    if (InstrName[i] != NULL)
+      printf(",\"%s\":%lu", InstrName[i], InstrCount[i]);
+  puts("}");
+}
+
+
+/// Tracing
+
+// Events are written in the JSON array of a "traceEvents" object, with
+// timestamps in microseconds since the trace was opened.  A mutex keeps
+// events from different threads whole.  Threads are numbered 1, 2, ...
+// in the order they first write an event.
+
+// Maximum nesting of spans with counters, in each thread
+#define TRACEDEPTH 32
+
+/// Trace file (NULL if not tracing)
+FILE* _Atomic InstrTraceFile = NULL;  ///extern
+
+static pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER;
+static double traceStart;     // wall_time when the trace was opened
+static int traceEvents;       // number of events written
+static int traceThreads;      // number of threads seen
+
+static _Thread_local int traceTid;    // number of this thread (0: none yet)
+static _Thread_local int traceDepth;  // number of open spans in this thread
+// Counters when each open span began
+static _Thread_local unsigned long traceCount[TRACEDEPTH][NUMCOUNTERS];
+// Whether each open span shows the change of the counters
+static _Thread_local int traceCounted[TRACEDEPTH];
+
+/// Start writing trace spans to a new file.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno is set.
+int InstrTraceOpen(const char* filename) { ///
+  static int registered = 0;
+  InstrTraceClose();
+  FILE* f = fopen(filename, "w");
+  if (f == NULL) return 0;
+  if (!registered) {
+    atexit(InstrTraceClose);
+    registered = 1;
+  }
+  fputs("{\"traceEvents\":[\n", f);
+  pthread_mutex_lock(&traceLock);
+  traceStart = wall_time();
+  traceEvents = 0;
+  InstrTraceFile = f;
+  pthread_mutex_unlock(&traceLock);
+  return 1;
+}
+
+/// Finish the trace file and close it.
+/// Called at exit, if a trace file is open.
+void InstrTraceClose(void) { ///
+  if (InstrTraceFile == NULL) return;
+  pthread_mutex_lock(&traceLock);
+  FILE* f = InstrTraceFile;
+  if (f != NULL) {
+    int errsave = errno;
+    InstrTraceFile = NULL;
+    fputs("\n]}\n", f);
+    fclose(f);
+    errno = errsave;
+  }
+  pthread_mutex_unlock(&traceLock);
+}
+
+// Write s as a JSON string.
+static void traceString(FILE* f, const char* s) {
+  putc('"', f);
+  for (; *s != '\0'; s++) {
+    if (*s == '"' || *s == '\\') fprintf(f, "\\%c", *s);
+    else if ((unsigned char)*s < ' ') fprintf(f, "\\u%04x", *s);
+    else putc(*s, f);
+  }
+  putc('"', f);
+}
+
+// Write an event of phase ph ('B' or 'E') for the calling thread.
+// count, if not NULL, has the counters when the span began.
+// Preserves errno.
+static void traceEvent(char ph, const char* name, const char* args,
+                       const unsigned long* count) {
+  int errsave = errno;
+  double time = wall_time();
+  pthread_mutex_lock(&traceLock);
+  FILE* f = InstrTraceFile;
+  if (f != NULL) {
+    if (traceTid == 0) traceTid = ++traceThreads;
+    fputs(traceEvents++ > 0 ? ",\n" : "", f);
+    fprintf(f, "{\"ph\":\"%c\",\"pid\":1,\"tid\":%d,\"ts\":%.3f", ph, traceTid,
+            (time - traceStart) * 1e6);
+    if (name != NULL) {
+      fputs(",\"name\":", f);
+      traceString(f, name);
+    }
+    fputs(",\"args\":{", f);
+    const char* sep = "";
+    if (args != NULL && args[0] != '\0') {
+      fputs(args, f);
+      sep = ",";
+    }
+    if (count != NULL) {
+      for (int i = 0; i < NUMCOUNTERS; i++) {
+        if (InstrName[i] == NULL) continue;
+        fputs(sep, f);
+        traceString(f, InstrName[i]);
+        // (If the counter was reset meanwhile, count from zero.)
+        unsigned long c = InstrCount[i];
+        fprintf(f, ":%lu", c >= count[i] ? c - count[i] : c);
+        sep = ",";
+      }
+    }
+    fputs("}}", f);
+  }
+  pthread_mutex_unlock(&traceLock);
+  errno = errsave;
+}
+
+/// Begin a span in the calling thread.
+///   name : the name shown for the span.
+///   args : NULL, or JSON object members to show with the span,
+///          e.g. "\"width\":640,\"height\":480".
+/// Does nothing if not tracing.
+void InstrTraceBegin(const char* name, const char* args) { ///
+  if (InstrTraceFile == NULL) return;
+  if (traceDepth < TRACEDEPTH) {
+    for (int i = 0; i < NUMCOUNTERS; i++) traceCount[traceDepth][i] = InstrCount[i];
+    traceCounted[traceDepth] = 1;
+  }
+  traceDepth++;
+  traceEvent('B', name, args, NULL);
+}
+
+/// Begin a span in the calling thread, as InstrTraceBegin, but without the
+/// change of the counters.  For spans whose work is counted elsewhere
+/// (e.g. by the thread that waits for it), whose counters would not change.
+void InstrTraceBeginUncounted(const char* name, const char* args) { ///
+  if (InstrTraceFile == NULL) return;
+  if (traceDepth < TRACEDEPTH) traceCounted[traceDepth] = 0;
+  traceDepth++;
+  traceEvent('B', name, args, NULL);
+}
+
+/// End the last span begun in the calling thread.
+///   args : NULL, or more JSON object members to show with the span.
+/// Does nothing if not tracing.
+void InstrTraceEnd(const char* args) { ///
+  if (InstrTraceFile == NULL || traceDepth == 0) return;
+  traceDepth--;
+  int counted = traceDepth < TRACEDEPTH && traceCounted[traceDepth];
+  traceEvent('E', NULL, args, counted ? traceCount[traceDepth] : NULL);
+}
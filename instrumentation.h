@@ -13,29 +13,107 @@
 /// ...
 /// InstrReset();  // reset to zero
 /// for (...) {
-///   InstrCount[0] += 3;  // to count array acesses
-///   InstrCount[1] += 1;  // to count addition
+///   InstrAddExact(0, 3);  // to count array acesses
+///   InstrAddExact(1, 1);  // to count addition
 ///   a[k] = a[i] + a[j];
 /// }
+/// InstrAdd(0, 3*n);  // or count once, after the loop
 /// InstrPrint();  // to show time and counters
 
 #ifndef INSTRUMENTATION_H
 #define INSTRUMENTATION_H
 
+#include <stdio.h>
+
 /// Cpu time in seconds
 double cpu_time(void) ; ///
 
+/// Wall clock time in seconds (monotonic, since some arbitrary moment)
+double wall_time(void) ; ///
+
+/// Cpu time of the calling thread in seconds
+double thread_time(void) ; ///
+
 /// Ten counters should be more than enough
 #define NUMCOUNTERS 10
 
-/// Array of operation counters:
-extern unsigned long InstrCount[NUMCOUNTERS];  ///extern
+/// Instrumentation level, chosen when building (e.g. -DINSTRLEVEL=0):
+///   0 (release): counting is compiled out; counters stay at zero.
+///   1 (profiling): operations count once per row or per call.
+///   2 (teaching): besides, single pixel accesses are counted one by one.
+/// Times are measured and printed at every level.
+#ifndef INSTRLEVEL
+#define INSTRLEVEL 2
+#endif
+
+/// State of the instrumentation: counters, and times and work since the
+/// last reset.  Each thread has its own state (InstrOwn), so that threads
+/// count concurrently, without locks and without mixing their counts.
+/// A thread may count into another state instead, with InstrUse.
+typedef struct {
+  unsigned long count[NUMCOUNTERS];  // operation counters
+  double time;        // cpu_time read on previous reset
+  double walltime;    // wall_time read on previous reset
+  double thrtime;     // thread_time read on previous reset
+  unsigned long pixels;  // pixels processed since last reset
+  unsigned long bytes;   // bytes of pixel memory accessed since last reset
+} InstrState;
+
+/// State of the calling thread, used unless InstrUse selects another one
+extern _Thread_local InstrState InstrOwn;  ///extern
+
+/// State in use by the calling thread (NULL: InstrOwn)
+extern _Thread_local InstrState* InstrCur;  ///extern
+
+/// State in use by the calling thread.
+static inline InstrState* InstrCurrent(void) {
+  return InstrCur != NULL ? InstrCur : &InstrOwn;
+}
+
+/// Make the calling thread count into state s (NULL: its own, InstrOwn).
+/// Returns the state used before (NULL if it was InstrOwn).
+InstrState* InstrUse(InstrState* s) ;
+
+/// Add n to counter i (at levels 1 and 2).
+/// Use for counts aggregated per row or per operation.
+#if INSTRLEVEL >= 1
+#define InstrAdd(i, n) ((void)(InstrCount[i] += (unsigned long)(n)))
+#else
+#define InstrAdd(i, n) ((void)0)
+#endif
+
+/// Add n to counter i (at level 2 only).
+/// Use for exact counts in per-pixel loops.
+#if INSTRLEVEL >= 2
+#define InstrAddExact(i, n) InstrAdd(i, n)
+#else
+#define InstrAddExact(i, n) ((void)0)
+#endif
+
+/// Array of operation counters (of the calling thread's state):
+#define InstrCount (InstrCurrent()->count)
 
 /// Array of names for the counters:
 extern char* InstrName[NUMCOUNTERS];  ///extern
 
 /// Cpu_time read on previous reset (~seconds)
-extern double InstrTime;  ///extern
+#define InstrTime (InstrCurrent()->time)
+
+/// Wall_time read on previous reset (~seconds)
+#define InstrWallTime (InstrCurrent()->walltime)
+
+/// Thread_time (of the thread that called InstrReset) read on previous reset
+#define InstrThreadTime (InstrCurrent()->thrtime)
+
+/// Pixels processed and bytes of pixel memory accessed since last reset.
+/// Unlike the counters, these are kept at every INSTRLEVEL (they are
+/// added once per operation), to report throughput rates.
+#define InstrPixels (InstrCurrent()->pixels)
+#define InstrBytes (InstrCurrent()->bytes)
+
+/// Add the work of an operation: pixels processed and bytes accessed.
+#define InstrWork(pixels, bytes) \
+  ((void)(InstrPixels += (unsigned long)(pixels), InstrBytes += (unsigned long)(bytes)))
 
 /// Calibrated Time Unit (in seconds, initially 1s)
 extern double InstrCTU;  ///extern
@@ -45,10 +123,58 @@ extern double InstrCTU;  ///extern
 /// a reasonably cpu-independent time unit.
 void InstrCalibrate(void) ;
 
-/// Reset counters to zero and store cpu_time.
+/// Reset counters to zero and store cpu_time, wall_time and thread_time
+/// (in the state of the calling thread).
 void InstrReset(void) ;
 
+/// Print times and all named counter values, followed by wall clock time,
+/// thread time and rates: pixels processed and bytes accessed per second
+/// (of wall clock time).
+/// The cpu time ("time") adds up all threads of the process, while
+/// "thrtime" is the cpu time of the calling thread only.
 void InstrPrint(void) ;
 
+/// Print the same data as InstrPrint, as a JSON object in a single line.
+/// Times are in seconds and rates per second.
+void InstrPrintJSON(void) ;
+
+/// Tracing
+
+/// Spans of execution may be written to a trace file, in the Chrome trace
+/// event format (JSON), to be viewed in chrome://tracing or
+/// https://ui.perfetto.dev.  Each span shows its name, thread and
+/// arguments, and the change of each named counter while it lasted.
+/// Spans may be nested, and may be begun and ended in several threads.
+
+/// Trace file (NULL if not tracing)
+/// It is atomic, so that threads may check it while another opens the trace.
+extern FILE* _Atomic InstrTraceFile;  ///extern
+
+/// Start writing trace spans to a new file.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno is set.
+int InstrTraceOpen(const char* filename) ;
+
+/// Finish the trace file and close it.
+/// Called at exit, if a trace file is open.
+void InstrTraceClose(void) ;
+
+/// Begin a span in the calling thread.
+///   name : the name shown for the span.
+///   args : NULL, or JSON object members to show with the span,
+///          e.g. "\"width\":640,\"height\":480".
+/// Does nothing if not tracing.
+void InstrTraceBegin(const char* name, const char* args) ;
+
+/// Begin a span in the calling thread, as InstrTraceBegin, but without the
+/// change of the counters.  For spans whose work is counted elsewhere
+/// (e.g. by the thread that waits for it), whose counters would not change.
+void InstrTraceBeginUncounted(const char* name, const char* args) ;
+
+/// End the last span begun in the calling thread.
+///   args : NULL, or more JSON object members to show with the span.
+/// Does nothing if not tracing.
+void InstrTraceEnd(const char* args) ;
+
 #endif
 